@@ -0,0 +1,169 @@
+/*
+ * Loading a directory of small route files with createKMLBatch, at 1, 2, 4 ... threads up to one per
+ * processor, against loading them one at a time with createValidKMLWithSchema. Every file is validated.
+ * The bundled schema imports others over HTTP, so a small lax schema for the KML namespace is written
+ * next to the files instead, which keeps the numbers the same with or without network access.
+ *
+ * Usage: benchBatch [numFiles] [passes]     (defaults: 5000 3)
+*/
+
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+#include "benchHelpers.h"
+
+static const char laxSchema[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<xs:schema xmlns:xs=\"http://www.w3.org/2001/XMLSchema\" targetNamespace=\"http://www.opengis.net/kml/2.2\"\n"
+    "    elementFormDefault=\"qualified\">\n"
+    "  <xs:element name=\"kml\">\n"
+    "    <xs:complexType>\n"
+    "      <xs:sequence><xs:any processContents=\"lax\" minOccurs=\"0\" maxOccurs=\"unbounded\"/></xs:sequence>\n"
+    "      <xs:anyAttribute processContents=\"lax\"/>\n"
+    "    </xs:complexType>\n"
+    "  </xs:element>\n"
+    "</xs:schema>\n";
+
+// A route of 30 points and a point at its start, about 1.5 KB.
+static bool writeRoute(const char * fileName, int number) {
+    FILE * fp = fopen(fileName, "w");
+    if (fp == NULL) {
+        return false;
+    }
+
+    double longitude = randomIn(-80, -79);
+    double latitude = randomIn(43, 44);
+    fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<kml xmlns=\"http://www.opengis.net/kml/2.2\"><Document><name>Route %d</name>\n"
+        "<Placemark><name>Start</name><Point><coordinates>%.6f,%.6f</coordinates></Point></Placemark>\n"
+        "<Placemark><name>Route</name><LineString><coordinates>", number, longitude, latitude);
+    for (int i = 0; i < 30; i++) {
+        fprintf(fp, "%.6f,%.6f,%.1f ", longitude, latitude, randomIn(0, 300));
+        longitude += randomIn(-0.001, 0.001);
+        latitude += randomIn(-0.001, 0.001);
+    }
+    fprintf(fp, "</coordinates></LineString></Placemark>\n</Document></kml>\n");
+
+    return fclose(fp) == 0;
+}
+
+static void collect(int index, const char * fileName, KML * doc, void * userData) {
+    if (doc != NULL) {
+        __atomic_add_fetch((int *) userData, 1, __ATOMIC_RELAXED);
+        deleteKML(doc);
+    }
+}
+
+// Loads every file passes times, and returns the best rate in files per second, or -1 if a file did not load.
+static double timeLoads(char ** fileNames, int numFiles, const KMLSchema * schema, int numThreads, int passes) {
+    double best = -1;
+    for (int pass = 0; pass < passes; pass++) {
+        int loaded = 0;
+        double start = now();
+        if (numThreads == 0) {
+            for (int i = 0; i < numFiles; i++) {
+                KML * doc = createValidKMLWithSchema(fileNames[i], schema);
+                collect(i, fileNames[i], doc, &loaded);
+            }
+        } else {
+            createKMLBatch((const char * const *) fileNames, numFiles, schema, KML_PARSE_DEFAULT, numThreads, &collect, &loaded);
+        }
+        double rate = numFiles / (now() - start);
+
+        if (loaded != numFiles) {
+            return -1;
+        }
+        if (rate > best) {
+            best = rate;
+        }
+    }
+
+    return best;
+}
+
+int main(int argc, char ** argv) {
+    int numFiles = argc > 1 ? atoi(argv[1]) : 5000;
+    int passes = argc > 2 ? atoi(argv[2]) : 3;
+    if (numFiles < 1 || passes < 1) {
+        fprintf(stderr, "usage: %s [numFiles] [passes]\n", argv[0]);
+        return 1;
+    }
+
+    char dirName[] = "/tmp/benchBatchXXXXXX";
+    if (mkdtemp(dirName) == NULL) {
+        fprintf(stderr, "benchBatch: could not create a directory for the files\n");
+        return 1;
+    }
+
+    kmlInit();
+
+    char schemaFile[64];
+    snprintf(schemaFile, sizeof(schemaFile), "%s/lax.xsd", dirName);
+    FILE * fp = fopen(schemaFile, "w");
+    if (fp != NULL) {
+        fputs(laxSchema, fp);
+        fclose(fp);
+    }
+    KMLSchema * schema = loadKMLSchema(schemaFile);
+    remove(schemaFile);
+
+    srand(1);
+    char ** fileNames = malloc(numFiles * sizeof(char *));
+    int written = 0;
+    for (; written < numFiles; written++) {
+        fileNames[written] = malloc(strlen(dirName) + 32);
+        sprintf(fileNames[written], "%s/route%d.kml", dirName, written);
+        if (!writeRoute(fileNames[written], written)) {
+            free(fileNames[written]);
+            break;
+        }
+    }
+
+    int status = 0;
+    if (schema == NULL || written < numFiles) {
+        fprintf(stderr, "benchBatch: could not write the schema and the files to %s\n", dirName);
+        status = 1;
+    } else {
+        int numProcessors = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        printf("%d route files, validated, best of %d passes, %d processors\n", numFiles, passes, numProcessors);
+        printf("%34s %10s %10s\n", "", "files/s", "speedup");
+
+        double sequential = timeLoads(fileNames, numFiles, schema, 0, passes);
+        printf("%34s %10.0f %9.2fx\n", "createValidKMLWithSchema", sequential, 1.0);
+        for (int numThreads = 1; sequential > 0; numThreads *= 2) {
+            if (numThreads > numProcessors) {
+                numThreads = numProcessors;
+            }
+            double rate = timeLoads(fileNames, numFiles, schema, numThreads, passes);
+            if (rate < 0) {
+                sequential = -1;
+                break;
+            }
+
+            char label[64];
+            snprintf(label, sizeof(label), "createKMLBatch, %d thread%s", numThreads, numThreads == 1 ? "" : "s");
+            printf("%34s %10.0f %9.2fx\n", label, rate, rate / sequential);
+            fflush(stdout);
+
+            if (numThreads == numProcessors) {
+                break;
+            }
+        }
+
+        if (sequential < 0) {
+            fprintf(stderr, "benchBatch: not every file could be loaded\n");
+            status = 1;
+        }
+    }
+
+    for (int i = 0; i < written; i++) {
+        remove(fileNames[i]);
+        free(fileNames[i]);
+    }
+    free(fileNames);
+    rmdir(dirName);
+    if (schema != NULL) {
+        deleteKMLSchema(schema);
+    }
+    kmlCleanup();
+
+    return status;
+}
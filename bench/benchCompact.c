@@ -0,0 +1,159 @@
+/*
+ * Heap taken by the coordinates of a loaded document, measured with mallinfo2 rather than taken from
+ * getLineCoordinateBytes, so that malloc overhead and everything the parser keeps are counted. The
+ * document is generated with numPaths paths of pointsPerPath points and loaded in each encoding, then
+ * with the coordinates list filled by getLineCoordinates, and then compacted with compactKML after
+ * that, which must give back the memory of the list.
+ *
+ * Usage: benchCompact [numPaths] [pointsPerPath]     (defaults: 200 5000)
+*/
+
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+#include "benchHelpers.h"
+#include <malloc.h>
+
+// Bytes of heap in use, counting the blocks malloc hands out with mmap.
+static size_t heapBytes(void) {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+static bool writeDocument(const char * fileName, int numPaths, int pointsPerPath) {
+    FILE * fp = fopen(fileName, "w");
+    if (fp == NULL) {
+        return false;
+    }
+
+    fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<kml xmlns=\"http://www.opengis.net/kml/2.2\"><Document><name>benchCompact</name>\n");
+    for (int i = 0; i < numPaths; i++) {
+        fprintf(fp, "<Placemark><name>Path %d</name><LineString><coordinates>", i);
+        double longitude = randomIn(-80, -79);
+        double latitude = randomIn(43, 44);
+        for (int j = 0; j < pointsPerPath; j++) {
+            fprintf(fp, "%.7f,%.7f,%.1f ", longitude, latitude, randomIn(0, 300));
+            longitude += randomIn(-0.0001, 0.0001);
+            latitude += randomIn(-0.0001, 0.0001);
+        }
+        fprintf(fp, "</coordinates></LineString></Placemark>\n");
+    }
+    fprintf(fp, "</Document></kml>\n");
+
+    return fclose(fp) == 0;
+}
+
+// Fills the coordinates list of every path, and returns false if one could not be filled.
+static bool fillLists(KML * doc) {
+    void * elem;
+    ListIterator iter = createIterator(doc->pathPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL) {
+        Line * line = ((PathPlacemark *) elem)->pathData;
+        if (line != NULL && getLength(getLineCoordinates(line)) != getNumCoordinates(line)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static size_t reportedBytes(const KML * doc) {
+    size_t bytes = 0;
+    void * elem;
+    ListIterator iter = createIterator(doc->pathPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL) {
+        bytes += getLineCoordinateBytes(((PathPlacemark *) elem)->pathData);
+    }
+
+    return bytes;
+}
+
+static void report(const char * label, size_t heap, const KML * doc, long numPoints) {
+    printf("%-40s %12.1f %12.1f %12.1f\n", label, heap / 1e6, (double) heap / numPoints, (double) reportedBytes(doc) / numPoints);
+}
+
+int main(int argc, char ** argv) {
+    int numPaths = argc > 1 ? atoi(argv[1]) : 200;
+    int pointsPerPath = argc > 2 ? atoi(argv[2]) : 5000;
+    if (numPaths < 1 || pointsPerPath < 1) {
+        fprintf(stderr, "usage: %s [numPaths] [pointsPerPath]\n", argv[0]);
+        return 1;
+    }
+
+    char fileName[] = "/tmp/benchCompactXXXXXX";
+    int fd = mkstemp(fileName);
+    if (fd < 0) {
+        fprintf(stderr, "benchCompact: could not create a file to generate\n");
+        return 1;
+    }
+    close(fd);
+    srand(1);
+    if (!writeDocument(fileName, numPaths, pointsPerPath)) {
+        fprintf(stderr, "benchCompact: could not write %s\n", fileName);
+        remove(fileName);
+        return 1;
+    }
+
+    kmlInit();
+    long numPoints = (long) numPaths * pointsPerPath;
+    printf("%d paths of %d points\n", numPaths, pointsPerPath);
+    printf("%-40s %12s %12s %12s\n", "", "heap MB", "heap B/pt", "reported B/pt");
+
+    const struct {
+        const char * label;
+        unsigned int flags;
+    } loads[] = {
+        {"doubles", 0},
+        {"KML_PARSE_COMPACT", KML_PARSE_COMPACT},
+        {"KML_PARSE_COMPACT_DELTA", KML_PARSE_COMPACT_DELTA},
+    };
+
+    bool ok = true;
+    size_t doubleHeap = 0;
+    for (size_t i = 0; i < sizeof(loads) / sizeof(loads[0]) && ok; i++) {
+        size_t before = heapBytes();
+        KML * doc = createKMLWithFlags(fileName, loads[i].flags);
+        if (doc == NULL) {
+            ok = false;
+            break;
+        }
+        size_t heap = heapBytes() - before;
+        report(loads[i].label, heap, doc, numPoints);
+        if (loads[i].flags == 0) {
+            doubleHeap = heap;
+        }
+        deleteKML(doc);
+    }
+
+    size_t listHeap = 0;
+    size_t compactHeap = 0;
+    if (ok) {
+        size_t before = heapBytes();
+        KML * doc = createKML(fileName);
+        ok = doc != NULL && fillLists(doc);
+        if (ok) {
+            listHeap = heapBytes() - before;
+            report("doubles, getLineCoordinates on each", listHeap, doc, numPoints);
+
+            ok = compactKML(doc, KML_COORDINATES_DELTA);
+            compactHeap = heapBytes() - before;
+            report("then compactKML to delta", compactHeap, doc, numPoints);
+        }
+        deleteKML(doc);
+    }
+    remove(fileName);
+    kmlCleanup();
+
+    if (!ok) {
+        fprintf(stderr, "benchCompact: a load or conversion failed\n");
+        return 1;
+    }
+
+    // Compacting has to give back the list, which takes more than the doubles themselves.
+    if (compactHeap >= doubleHeap) {
+        fprintf(stderr, "benchCompact: compactKML kept %.1f MB after the list was filled\n", compactHeap / 1e6);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * Coordinate parsing with scanCoordinate against the copy, trim, strtok_r and atof tokenizer initPath
+ * used before it. Both parse the same <coordinates> text of one million "lon,lat[,alt]" tuples into an
+ * array, and must produce the same doubles bit for bit. One tuple in ten has no altitude.
+ *
+ * Usage: benchCoordinates [numTuples] [passes]     (defaults: 1000000 5)
+*/
+
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+#include "benchHelpers.h"
+
+// The text of a <coordinates> element, with the newline and indentation libxml2 keeps around it.
+static char * makeText(int numTuples) {
+    char * text = malloc((size_t) numTuples * 48 + 64);
+    if (text == NULL) {
+        return NULL;
+    }
+
+    char * p = text + sprintf(text, "\n          ");
+    for (int i = 0; i < numTuples; i++) {
+        if (i % 10 == 9) {
+            p += sprintf(p, "%.6f,%.6f ", randomIn(-180, 180), randomIn(-90, 90));
+        } else {
+            p += sprintf(p, "%.7f,%.7f,%.1f ", randomIn(-180, 180), randomIn(-90, 90), randomIn(0, 3000));
+        }
+    }
+    sprintf(p, "\n        ");
+
+    return text;
+}
+
+// The tokenizer initPath used before scanCoordinate, storing into an array instead of one malloc per tuple.
+static int parseWithStrtok(const char * text, Coordinate * coordinates) {
+    char * copy = malloc(strlen(text) + 1);
+    char * rest = copy;
+    strcpy(copy, text);
+    rest = trimString(rest);
+
+    int count = 0;
+    char * token = strtok_r(rest, " ", &rest);
+    do {
+        char * subtoken = strtok_r(token, ",", &token);
+        int pos = 0;
+        Coordinate * c = &coordinates[count++];
+        c->longitude = -1;
+        c->latitude = -1;
+        c->altitude = DBL_MAX;
+        do {
+            if (pos == 0) {
+                c->longitude = atof(subtoken);
+            } else if (pos == 1) {
+                c->latitude = atof(subtoken);
+            } else if (pos == 2) {
+                c->altitude = atof(subtoken);
+            }
+            subtoken = strtok_r(token, ",", &token);
+            pos++;
+        } while (subtoken != NULL);
+        token = strtok_r(rest, " ", &rest);
+    } while (token != NULL);
+
+    free(copy);
+    return count;
+}
+
+static int parseWithScanner(const char * text, Coordinate * coordinates) {
+    const char * end = text + strlen(text);
+    const char * p = text;
+    int count = 0;
+    while ((p = scanCoordinate(p, end, &coordinates[count])) != NULL) {
+        count++;
+    }
+
+    return count;
+}
+
+// Runs the parser passes times, and returns the best time of a pass in milliseconds.
+static double timeParser(int (*parse)(const char *, Coordinate *), const char * text, Coordinate * coordinates, int passes, int * count) {
+    double best = 0;
+    for (int pass = 0; pass < passes; pass++) {
+        double start = now();
+        *count = parse(text, coordinates);
+        double elapsed = (now() - start) * 1e3;
+        if (pass == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    return best;
+}
+
+int main(int argc, char ** argv) {
+    int numTuples = argc > 1 ? atoi(argv[1]) : 1000000;
+    int passes = argc > 2 ? atoi(argv[2]) : 5;
+    if (numTuples < 1 || passes < 1) {
+        fprintf(stderr, "usage: %s [numTuples] [passes]\n", argv[0]);
+        return 1;
+    }
+
+    srand(1);
+    char * text = makeText(numTuples);
+    Coordinate * expected = malloc(numTuples * sizeof(Coordinate));
+    Coordinate * actual = malloc(numTuples * sizeof(Coordinate));
+    if (text == NULL || expected == NULL || actual == NULL) {
+        fprintf(stderr, "benchCoordinates: out of memory\n");
+        return 1;
+    }
+
+    int strtokCount;
+    int scanCount;
+    double strtokTime = timeParser(&parseWithStrtok, text, expected, passes, &strtokCount);
+    double scanTime = timeParser(&parseWithScanner, text, actual, passes, &scanCount);
+
+    if (strtokCount != numTuples || scanCount != numTuples) {
+        fprintf(stderr, "benchCoordinates: parsed %d and %d tuples out of %d\n", strtokCount, scanCount, numTuples);
+        return 1;
+    }
+    if (memcmp(expected, actual, numTuples * sizeof(Coordinate)) != 0) {
+        fprintf(stderr, "benchCoordinates: scanCoordinate and strtok/atof parsed different values\n");
+        return 1;
+    }
+
+    double megabytes = strlen(text) / 1e6;
+    printf("%d tuples, %.1f MB of text, best of %d passes\n", numTuples, megabytes, passes);
+    printf("%16s %10s %10s\n", "", "ms", "MB/s");
+    printf("%16s %10.1f %10.0f\n", "strtok_r/atof", strtokTime, megabytes / strtokTime * 1e3);
+    printf("%16s %10.1f %10.0f\n", "scanCoordinate", scanTime, megabytes / scanTime * 1e3);
+    printf("speedup %.1fx, identical results\n", strtokTime / scanTime);
+
+    free(text);
+    free(expected);
+    free(actual);
+    return 0;
+}
@@ -0,0 +1,182 @@
+/*
+ * Path lengths with pathDistance, the SIMD kernel getPathLen uses, against summing the scalar dist()
+ * over every segment. Measured on the paths of the files in test-files and on a synthetic track of one
+ * million segments, a random walk of steps up to about 100 m. Reports the largest difference between
+ * the two lengths as well.
+ *
+ * Usage: benchDistance [corpusDir] [numSegments]     (defaults: test-files 1000000)
+*/
+
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+#include "benchHelpers.h"
+#include <dirent.h>
+
+// Every path is measured until about this many segments have been covered, per method.
+#define SEGMENTS_PER_RUN 20000000
+
+typedef struct {
+    const double * latitudes;
+    const double * longitudes;
+    int length;
+} Track;
+
+static double scalarLength(const Track * track) {
+    double length = 0;
+    for (int i = 1; i < track->length; i++) {
+        length += dist(track->latitudes[i - 1], track->longitudes[i - 1], track->latitudes[i], track->longitudes[i]);
+    }
+
+    return length;
+}
+
+static double kernelLength(const Track * track) {
+    return pathDistance(track->latitudes, track->longitudes, track->length);
+}
+
+// Measures every track over and over, and returns the time per segment in nanoseconds.
+static double timeLengths(double (*length)(const Track *), const Track * tracks, int numTracks, long segments, double * total) {
+    int repeats = (int) (SEGMENTS_PER_RUN / segments) + 1;
+
+    double start = now();
+    for (int r = 0; r < repeats; r++) {
+        *total = 0;
+        for (int t = 0; t < numTracks; t++) {
+            *total += length(&tracks[t]);
+        }
+    }
+
+    return (now() - start) / ((double) repeats * segments) * 1e9;
+}
+
+// Times both methods, prints a line of the table, and returns the largest relative difference of a track.
+static double compare(const char * name, const Track * tracks, int numTracks) {
+    long segments = 0;
+    double worst = 0;
+    for (int t = 0; t < numTracks; t++) {
+        segments += tracks[t].length - 1;
+
+        double expected = scalarLength(&tracks[t]);
+        double difference = fabs(kernelLength(&tracks[t]) - expected);
+        if (expected > 0 && difference / expected > worst) {
+            worst = difference / expected;
+        }
+    }
+
+    double scalarTotal;
+    double kernelTotal;
+    double scalarTime = timeLengths(&scalarLength, tracks, numTracks, segments, &scalarTotal);
+    double kernelTime = timeLengths(&kernelLength, tracks, numTracks, segments, &kernelTotal);
+
+    printf("%-16s %6d %10ld %15.2f %15.2f %8.1fx %12.1e\n", name, numTracks, segments, scalarTime, kernelTime, scalarTime / kernelTime, worst);
+    return worst;
+}
+
+// Collects the paths of every file in the corpus. The documents are returned in docs, to be deleted afterwards.
+static int loadTracks(const char * dirName, Track ** tracks, KML *** docs, int * numDocs) {
+    DIR * dir = opendir(dirName);
+    if (dir == NULL) {
+        return 0;
+    }
+
+    int numTracks = 0;
+    int capacity = 0;
+    *tracks = NULL;
+    *docs = NULL;
+    *numDocs = 0;
+
+    struct dirent * entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t nameLength = strlen(entry->d_name);
+        if (nameLength < 4 || strcmp(entry->d_name + nameLength - 4, ".kml") != 0) {
+            continue;
+        }
+
+        char fileName[1024];
+        snprintf(fileName, sizeof(fileName), "%s/%s", dirName, entry->d_name);
+        KML * doc = createKML(fileName);
+        if (doc == NULL) {
+            continue;
+        }
+        *docs = realloc(*docs, (*numDocs + 1) * sizeof(KML *));
+        (*docs)[(*numDocs)++] = doc;
+
+        void * elem;
+        ListIterator iter = createIterator(doc->pathPlacemarks);
+        while ((elem = nextElement(&iter)) != NULL) {
+            const Line * line = ((PathPlacemark *) elem)->pathData;
+            if (line == NULL || line->points.length < 2 || line->points.encoding != KML_COORDINATES_DOUBLE) {
+                continue;
+            }
+            if (numTracks == capacity) {
+                capacity = capacity == 0 ? 16 : capacity * 2;
+                *tracks = realloc(*tracks, capacity * sizeof(Track));
+            }
+            Track * track = &(*tracks)[numTracks++];
+            track->latitudes = line->points.latitudes;
+            track->longitudes = line->points.longitudes;
+            track->length = line->points.length;
+        }
+    }
+    closedir(dir);
+
+    return numTracks;
+}
+
+int main(int argc, char ** argv) {
+    const char * dirName = argc > 1 ? argv[1] : "test-files";
+    int numSegments = argc > 2 ? atoi(argv[2]) : 1000000;
+    if (numSegments < 1) {
+        fprintf(stderr, "usage: %s [corpusDir] [numSegments]\n", argv[0]);
+        return 1;
+    }
+
+    kmlInit();
+    printf("%-16s %6s %10s %15s %15s %9s %12s\n", "tracks", "paths", "segments", "dist (ns/seg)", "kernel (ns/seg)", "speedup", "max rel diff");
+
+    Track * tracks;
+    KML ** docs;
+    int numDocs;
+    int numTracks = loadTracks(dirName, &tracks, &docs, &numDocs);
+    if (numTracks == 0) {
+        fprintf(stderr, "benchDistance: no paths in %s\n", dirName);
+        return 1;
+    }
+    double worst = compare(dirName, tracks, numTracks);
+
+    double * latitudes = malloc((numSegments + 1) * sizeof(double));
+    double * longitudes = malloc((numSegments + 1) * sizeof(double));
+    if (latitudes == NULL || longitudes == NULL) {
+        fprintf(stderr, "benchDistance: out of memory\n");
+        return 1;
+    }
+    srand(1);
+    latitudes[0] = 43.5;
+    longitudes[0] = -80.2;
+    for (int i = 1; i <= numSegments; i++) {
+        latitudes[i] = latitudes[i - 1] + randomIn(-0.001, 0.001);
+        longitudes[i] = longitudes[i - 1] + randomIn(-0.001, 0.001);
+    }
+    Track synthetic = {latitudes, longitudes, numSegments + 1};
+    double syntheticWorst = compare("synthetic", &synthetic, 1);
+    if (syntheticWorst > worst) {
+        worst = syntheticWorst;
+    }
+
+    free(latitudes);
+    free(longitudes);
+    free(tracks);
+    for (int i = 0; i < numDocs; i++) {
+        deleteKML(docs[i]);
+    }
+    free(docs);
+    kmlCleanup();
+
+    // The error bound of the kernel is documented in KMLDistance.c. Whole tracks land well inside 1e-9.
+    if (worst > 1e-9) {
+        fprintf(stderr, "benchDistance: the kernel differs from dist() by %.1e relative\n", worst);
+        return 1;
+    }
+
+    return 0;
+}
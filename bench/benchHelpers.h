@@ -0,0 +1,55 @@
+/**
+ * @file benchHelpers.h
+ * @brief Timing and input helpers shared by the benchmarks in bench/.
+ */
+
+#ifndef BENCH_HELPERS_H
+#define BENCH_HELPERS_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// Wall clock time in seconds, from a monotonic clock.
+static inline double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// A random number between low and high, drawn with rand so that srand makes runs repeatable.
+static inline double randomIn(double low, double high) {
+    return low + (high - low) * (rand() / (double) RAND_MAX);
+}
+
+// Peak resident set size of the process in megabytes. It only ever grows, so compare it before and after.
+static inline double peakMegabytes(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+}
+
+// Reads a whole file into a new NUL-terminated string, or returns NULL.
+static inline char * readFile(const char * fileName, size_t * length) {
+    FILE * fp = fopen(fileName, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char * contents = malloc(size + 1);
+    if (contents == NULL || fread(contents, 1, size, fp) != (size_t) size) {
+        free(contents);
+        fclose(fp);
+        return NULL;
+    }
+    contents[size] = '\0';
+    fclose(fp);
+
+    *length = (size_t) size;
+    return contents;
+}
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ * Loading from memory and from a mapped file against createKML, on the files in test-files and on a
+ * generated file of numPaths paths. createKMLFromMemory is given the contents read beforehand, so it
+ * is timed without the read. Every load must print the same as the createKML one.
+ *
+ * Usage: benchMemory [corpusDir] [numPaths]     (defaults: test-files 20000)
+*/
+
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+#include "benchHelpers.h"
+#include <dirent.h>
+
+// Each file is loaded until about this much of it has been read, and never fewer than 3 times.
+#define BYTES_PER_RUN 50000000
+
+typedef enum {
+    LOAD_FILE,
+    LOAD_MEMORY,
+    LOAD_MAPPED,
+    NUM_LOADS
+} LoadKind;
+
+static KML * load(LoadKind kind, const char * fileName, const char * contents, size_t length) {
+    switch (kind) {
+        case LOAD_FILE:
+            return createKML(fileName);
+        case LOAD_MEMORY:
+            return createKMLFromMemory(contents, length);
+        case LOAD_MAPPED:
+            return createKMLMapped(fileName);
+        default:
+            return NULL;
+    }
+}
+
+// Loads the file with every method, and prints the time per load. Returns false if a load failed or differed.
+static bool compare(const char * label, const char * fileName) {
+    size_t length;
+    char * contents = readFile(fileName, &length);
+    if (contents == NULL) {
+        return false;
+    }
+
+    int repeats = (int) (BYTES_PER_RUN / (length + 1));
+    if (repeats < 3) {
+        repeats = 3;
+    }
+
+    bool ok = true;
+    char * expected = NULL;
+    double times[NUM_LOADS];
+    for (int kind = 0; kind < NUM_LOADS && ok; kind++) {
+        KML * doc = load((LoadKind) kind, fileName, contents, length);
+        char * str = doc == NULL ? NULL : KMLToString(doc);
+        deleteKML(doc);
+        if (str == NULL) {
+            ok = false;
+        } else if (expected == NULL) {
+            expected = str;
+        } else {
+            ok = strcmp(str, expected) == 0;
+            free(str);
+        }
+
+        double start = now();
+        for (int r = 0; r < repeats && ok; r++) {
+            deleteKML(load((LoadKind) kind, fileName, contents, length));
+        }
+        times[kind] = (now() - start) / repeats * 1e6;
+    }
+    free(expected);
+    free(contents);
+
+    if (ok) {
+        printf("%-32s %12zu %12.1f %12.1f %12.1f\n", label, length, times[LOAD_FILE], times[LOAD_MEMORY], times[LOAD_MAPPED]);
+    } else {
+        fprintf(stderr, "benchMemory: %s did not load the same way through every function\n", fileName);
+    }
+
+    return ok;
+}
+
+static bool writeDocument(const char * fileName, int numPaths) {
+    FILE * fp = fopen(fileName, "w");
+    if (fp == NULL) {
+        return false;
+    }
+
+    fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<kml xmlns=\"http://www.opengis.net/kml/2.2\"><Document><name>benchMemory</name>\n");
+    for (int i = 0; i < numPaths; i++) {
+        fprintf(fp, "<Placemark><name>Path %d</name><LineString><coordinates>", i);
+        double longitude = randomIn(-80, -79);
+        double latitude = randomIn(43, 44);
+        for (int j = 0; j < 40; j++) {
+            fprintf(fp, "%.7f,%.7f,%.1f ", longitude, latitude, randomIn(0, 300));
+            longitude += randomIn(-0.001, 0.001);
+            latitude += randomIn(-0.001, 0.001);
+        }
+        fprintf(fp, "</coordinates></LineString></Placemark>\n");
+    }
+    fprintf(fp, "</Document></kml>\n");
+
+    return fclose(fp) == 0;
+}
+
+int main(int argc, char ** argv) {
+    const char * dirName = argc > 1 ? argv[1] : "test-files";
+    int numPaths = argc > 2 ? atoi(argv[2]) : 20000;
+    if (numPaths < 1) {
+        fprintf(stderr, "usage: %s [corpusDir] [numPaths]\n", argv[0]);
+        return 1;
+    }
+
+    DIR * dir = opendir(dirName);
+    if (dir == NULL) {
+        fprintf(stderr, "benchMemory: could not open %s\n", dirName);
+        return 1;
+    }
+
+    kmlInit();
+    printf("%-32s %12s %12s %12s %12s\n", "file", "bytes", "file (us)", "memory (us)", "mapped (us)");
+
+    bool ok = true;
+    struct dirent * entry;
+    while ((entry = readdir(dir)) != NULL && ok) {
+        size_t nameLength = strlen(entry->d_name);
+        if (nameLength < 4 || strcmp(entry->d_name + nameLength - 4, ".kml") != 0) {
+            continue;
+        }
+
+        char fileName[1024];
+        snprintf(fileName, sizeof(fileName), "%s/%s", dirName, entry->d_name);
+        ok = compare(entry->d_name, fileName);
+    }
+    closedir(dir);
+
+    char generated[] = "/tmp/benchMemoryXXXXXX";
+    int fd = ok ? mkstemp(generated) : -1;
+    if (fd >= 0) {
+        close(fd);
+        srand(1);
+        char label[64];
+        snprintf(label, sizeof(label), "generated, %d paths", numPaths);
+        ok = writeDocument(generated, numPaths) && compare(label, generated);
+        remove(generated);
+    } else if (ok) {
+        fprintf(stderr, "benchMemory: could not create a file to generate\n");
+        ok = false;
+    }
+
+    kmlCleanup();
+    return ok ? 0 : 1;
+}
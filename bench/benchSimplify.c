@@ -0,0 +1,122 @@
+/*
+ * simplifyPath on long tracks that are almost straight, where every point but the ends can go and the
+ * spans checked against the tolerance grow to the whole path. Each shape is timed at numPoints / 10 and
+ * at numPoints points; ten times the points must take well under a hundred times as long, or the
+ * algorithm has gone quadratic. The shapes are a straight line along a meridian and a random walk with
+ * a drift, which keeps a share of its points.
+ *
+ * Usage: benchSimplify [numPoints] [toleranceMeters]     (defaults: 1000000 5)
+*/
+
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+#include "benchHelpers.h"
+
+// Ten times the points may take at most this many times as long. n log n gives about 12.
+#define MAX_GROWTH 30
+
+typedef enum {
+    SHAPE_STRAIGHT,
+    SHAPE_DRIFT,
+    NUM_SHAPES
+} Shape;
+
+static const char * shapeNames[NUM_SHAPES] = {"straight", "drift"};
+
+static KML * makeDocument(Shape shape, int numPoints) {
+    char * contents = NULL;
+    size_t length = 0;
+    FILE * fp = open_memstream(&contents, &length);
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<kml xmlns=\"http://www.opengis.net/kml/2.2\"><Document><Placemark><LineString><coordinates>");
+    double longitude = -80;
+    double latitude = 43;
+    for (int i = 0; i < numPoints; i++) {
+        fprintf(fp, "%.7f,%.7f ", longitude, latitude);
+        latitude += 1e-5;
+        if (shape == SHAPE_DRIFT) {
+            longitude += randomIn(-2e-6, 4e-6);
+        }
+    }
+    fprintf(fp, "</coordinates></LineString></Placemark></Document></kml>\n");
+    fclose(fp);
+
+    KML * doc = createKMLFromMemory(contents, length);
+    free(contents);
+
+    return doc;
+}
+
+// Simplifies a fresh track, and returns the time taken in milliseconds, or -1 on failure.
+static double timeSimplify(Shape shape, int numPoints, double tolerance, KMLSimplifyAlgorithm algorithm, int * kept) {
+    srand(1);
+    KML * doc = makeDocument(shape, numPoints);
+    PathPlacemark * path = doc == NULL ? NULL : getFromFront(doc->pathPlacemarks);
+    if (path == NULL) {
+        deleteKML(doc);
+        return -1;
+    }
+
+    double start = now();
+    bool ok = simplifyPath(path, tolerance, algorithm, NULL);
+    double elapsed = (now() - start) * 1e3;
+    *kept = getNumCoordinates(path->pathData);
+    deleteKML(doc);
+
+    return ok ? elapsed : -1;
+}
+
+int main(int argc, char ** argv) {
+    int numPoints = argc > 1 ? atoi(argv[1]) : 1000000;
+    double tolerance = argc > 2 ? atof(argv[2]) : 5;
+    if (numPoints < 30 || tolerance <= 0) {
+        fprintf(stderr, "usage: %s [numPoints] [toleranceMeters]\n", argv[0]);
+        return 1;
+    }
+
+    const struct {
+        const char * name;
+        KMLSimplifyAlgorithm algorithm;
+    } algorithms[] = {
+        {"Douglas-Peucker", KML_SIMPLIFY_DOUGLAS_PEUCKER},
+        {"Visvalingam", KML_SIMPLIFY_VISVALINGAM},
+    };
+
+    kmlInit();
+    printf("tolerance %.1f m\n", tolerance);
+    printf("%-16s %-10s %10s %10s %10s %10s %10s %8s\n", "", "shape", "points", "ms", "kept", "points", "ms", "kept");
+
+    bool ok = true;
+    for (size_t a = 0; a < sizeof(algorithms) / sizeof(algorithms[0]) && ok; a++) {
+        for (int shape = 0; shape < NUM_SHAPES && ok; shape++) {
+            int smallKept;
+            int largeKept;
+            double small = timeSimplify((Shape) shape, numPoints / 10, tolerance, algorithms[a].algorithm, &smallKept);
+            double large = timeSimplify((Shape) shape, numPoints, tolerance, algorithms[a].algorithm, &largeKept);
+            if (small < 0 || large < 0) {
+                fprintf(stderr, "benchSimplify: %s failed\n", algorithms[a].name);
+                ok = false;
+                break;
+            }
+            printf("%-16s %-10s %10d %10.1f %10d %10d %10.1f %8d\n", algorithms[a].name, shapeNames[shape],
+                numPoints / 10, small, smallKept, numPoints, large, largeKept);
+
+            // Below a millisecond the timer says little about the growth.
+            if (large > 1 && large > MAX_GROWTH * fmax(small, 0.1)) {
+                fprintf(stderr, "benchSimplify: %s took %.0fx as long for 10x the points\n", algorithms[a].name, large / small);
+                ok = false;
+            }
+            if (shape == SHAPE_STRAIGHT && largeKept != 2) {
+                fprintf(stderr, "benchSimplify: %s kept %d points of a straight line\n", algorithms[a].name, largeKept);
+                ok = false;
+            }
+        }
+    }
+    kmlCleanup();
+
+    return ok ? 0 : 1;
+}
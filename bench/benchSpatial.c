@@ -0,0 +1,221 @@
+/*
+ * Bounding box queries through the R-tree against a linear scan of every placemark, at 10^3 to 10^7
+ * features. Nine in ten features are points, the rest short paths, spread uniformly over a 10 x 10
+ * degree square. Each query is a random 0.1 x 0.1 degree viewport. The first query builds the index,
+ * and is timed on its own. At each size a point is then inserted by hand and removed again, and the
+ * query after each must see the change.
+ *
+ * Usage: benchSpatial [maxExponent]     (default 7)
+*/
+
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+#include "benchHelpers.h"
+
+#define SPAN 10.0
+#define VIEWPORT 0.1
+
+static const char baseDocument[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<kml xmlns=\"http://www.opengis.net/kml/2.2\"><Document><name>benchSpatial</name></Document></kml>\n";
+
+static bool countPlacemark(void * placemark, bool isPath, void * userData) {
+    return true;
+}
+
+// The placemarks live in arrays owned by the benchmark, so the lists must not free them.
+static void keepData(void * data) {
+}
+
+typedef struct {
+    PointPlacemark * pointPlacemarks;
+    Point * points;
+    Coordinate * coordinates;
+    PathPlacemark * pathPlacemarks;
+    Line * lines;
+    int numPoints;
+    int numPaths;
+} Features;
+
+static bool addFeatures(KML * doc, Features * features, int count) {
+    features->numPaths = count / 10;
+    features->numPoints = count - features->numPaths;
+    features->pointPlacemarks = calloc(features->numPoints, sizeof(PointPlacemark));
+    features->points = calloc(features->numPoints, sizeof(Point));
+    features->coordinates = calloc(features->numPoints, sizeof(Coordinate));
+    features->pathPlacemarks = calloc(features->numPaths + 1, sizeof(PathPlacemark));
+    features->lines = calloc(features->numPaths + 1, sizeof(Line));
+    if (features->pointPlacemarks == NULL || features->points == NULL || features->coordinates == NULL
+        || features->pathPlacemarks == NULL || features->lines == NULL) {
+        return false;
+    }
+
+    doc->pointPlacemarks->deleteData = &keepData;
+    doc->pathPlacemarks->deleteData = &keepData;
+
+    for (int i = 0; i < features->numPoints; i++) {
+        Coordinate * c = &features->coordinates[i];
+        c->longitude = randomIn(0, SPAN);
+        c->latitude = randomIn(0, SPAN);
+        c->altitude = DBL_MAX;
+        features->points[i].coordinate = c;
+        features->pointPlacemarks[i].point = &features->points[i];
+        insertBack(doc->pointPlacemarks, &features->pointPlacemarks[i]);
+    }
+
+    // Paths of four coordinates within about 0.01 degrees of each other, stored straight into their buffers.
+    for (int i = 0; i < features->numPaths; i++) {
+        Line * line = &features->lines[i];
+        initCoordinateBuffer(&line->points, NULL);
+        line->version = 1;
+        double longitude = randomIn(0, SPAN);
+        double latitude = randomIn(0, SPAN);
+        for (int j = 0; j < 4; j++) {
+            if (!appendCoordinate(&line->points, longitude, latitude, DBL_MAX)) {
+                return false;
+            }
+            longitude += randomIn(-0.005, 0.005);
+            latitude += randomIn(-0.005, 0.005);
+        }
+        features->pathPlacemarks[i].pathData = line;
+        insertBack(doc->pathPlacemarks, &features->pathPlacemarks[i]);
+    }
+
+    return true;
+}
+
+static void freeFeatures(Features * features) {
+    for (int i = 0; i < features->numPaths; i++) {
+        freeCoordinateBuffer(&features->lines[i].points);
+    }
+    free(features->pointPlacemarks);
+    free(features->points);
+    free(features->coordinates);
+    free(features->pathPlacemarks);
+    free(features->lines);
+}
+
+static bool inBox(double minX, double minY, double maxX, double maxY, double minLon, double minLat, double maxLon, double maxLat) {
+    return minX <= maxLon && maxX >= minLon && minY <= maxLat && maxY >= minLat;
+}
+
+// What kmlQueryBBox did before it had an index: check every placemark. Returns how many are in the box.
+static int scanQuery(const KML * doc, double minLon, double minLat, double maxLon, double maxLat) {
+    int found = 0;
+
+    void * elem;
+    ListIterator iter = createIterator(doc->pointPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL) {
+        const Coordinate * c = ((PointPlacemark *) elem)->point->coordinate;
+        found += inBox(c->longitude, c->latitude, c->longitude, c->latitude, minLon, minLat, maxLon, maxLat);
+    }
+
+    iter = createIterator(doc->pathPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL) {
+        PathMetrics metrics = getPathMetrics((PathPlacemark *) elem);
+        found += inBox(metrics.minLongitude, metrics.minLatitude, metrics.maxLongitude, metrics.maxLatitude, minLon, minLat, maxLon, maxLat);
+    }
+
+    return found;
+}
+
+// Runs numQueries random viewport queries, and returns the time per query in microseconds.
+static double runQueries(const KML * doc, bool scan, int numQueries, unsigned int seed, long * found) {
+    srand(seed);
+    *found = 0;
+
+    double start = now();
+    for (int q = 0; q < numQueries; q++) {
+        double minLon = randomIn(0, SPAN - VIEWPORT);
+        double minLat = randomIn(0, SPAN - VIEWPORT);
+        if (scan) {
+            *found += scanQuery(doc, minLon, minLat, minLon + VIEWPORT, minLat + VIEWPORT);
+        } else {
+            *found += kmlQueryBBox(doc, minLon, minLat, minLon + VIEWPORT, minLat + VIEWPORT, &countPlacemark, NULL);
+        }
+    }
+
+    return (now() - start) / numQueries * 1e6;
+}
+
+// Inserts a point by hand into an empty corner and removes it again, and checks that queries follow.
+static bool checkChanges(KML * doc) {
+    static Coordinate coordinate = {SPAN + 1, SPAN + 1, DBL_MAX};
+    static Point point = {&coordinate};
+    static PointPlacemark placemark = {NULL, &point};
+
+    if (kmlQueryBBox(doc, SPAN, SPAN, SPAN + 2, SPAN + 2, &countPlacemark, NULL) != 0) {
+        return false;
+    }
+
+    // comparePointPlacemarks finds every placemark equal, so deleteDataFromList takes the one at the front.
+    insertFront(doc->pointPlacemarks, &placemark);
+    bool found = kmlQueryBBox(doc, SPAN, SPAN, SPAN + 2, SPAN + 2, &countPlacemark, NULL) == 1;
+    deleteDataFromList(doc->pointPlacemarks, &placemark);
+
+    return found && kmlQueryBBox(doc, SPAN, SPAN, SPAN + 2, SPAN + 2, &countPlacemark, NULL) == 0;
+}
+
+int main(int argc, char ** argv) {
+    int maxExponent = argc > 1 ? atoi(argv[1]) : 7;
+
+    kmlInit();
+    printf("%10s %14s %16s %14s %10s\n", "features", "scan (us/q)", "first query (ms)", "rtree (us/q)", "speedup");
+
+    int count = 1000;
+    for (int exponent = 3; exponent <= maxExponent; exponent++, count *= 10) {
+        KML * doc = createKMLFromMemory(baseDocument, sizeof(baseDocument) - 1);
+        if (doc == NULL) {
+            fprintf(stderr, "benchSpatial: could not create a document\n");
+            return 1;
+        }
+
+        Features features;
+        srand(exponent);
+        if (!addFeatures(doc, &features, count)) {
+            fprintf(stderr, "benchSpatial: out of memory at %d features\n", count);
+            return 1;
+        }
+
+        // The path metrics are computed once, so that neither side of the comparison pays for them.
+        void * elem;
+        ListIterator iter = createIterator(doc->pathPlacemarks);
+        while ((elem = nextElement(&iter)) != NULL) {
+            getPathMetrics((PathPlacemark *) elem);
+        }
+
+        // About 10^8 features are visited by the scan at every size, and never fewer than 5 queries.
+        int scanQueries = 100000000 / count;
+        if (scanQueries < 5) {
+            scanQueries = 5;
+        }
+        if (scanQueries > 1000) {
+            scanQueries = 1000;
+        }
+
+        long scanFound;
+        double scanTime = runQueries(doc, true, scanQueries, 42, &scanFound);
+
+        long indexFound;
+        double firstTime = runQueries(doc, false, 1, 41, &indexFound) * 1e-3;
+        runQueries(doc, false, scanQueries, 42, &indexFound);
+        if (indexFound != scanFound) {
+            fprintf(stderr, "benchSpatial: the index found %ld placemarks, the scan %ld\n", indexFound, scanFound);
+            return 1;
+        }
+        double indexTime = runQueries(doc, false, 10000, 43, &indexFound);
+
+        printf("%10d %14.1f %16.1f %14.2f %9.0fx\n", count, scanTime, firstTime, indexTime, scanTime / indexTime);
+        fflush(stdout);
+
+        if (!checkChanges(doc)) {
+            fprintf(stderr, "benchSpatial: a query did not follow a placemark inserted or removed by hand\n");
+            return 1;
+        }
+
+        deleteKML(doc);
+        freeFeatures(&features);
+    }
+
+    kmlCleanup();
+    return 0;
+}
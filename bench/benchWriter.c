@@ -0,0 +1,141 @@
+/*
+ * Saving a document with writeKML, which emits it straight from the structs, against the old way of
+ * building a libxml2 tree with convertToTree and saving that with xmlSaveFormatFileEnc. The document
+ * has numPaths paths of 20 points and as many points. Both outputs must be byte for byte the same.
+ * The growth of the peak resident set is reported for each, the streaming writer first, since
+ * ru_maxrss only ever grows. The document is written to a file and loaded with KML_PARSE_STREAM, so
+ * that loading it does not build a tree and raise the peak before either writer runs.
+ *
+ * Usage: benchWriter [numPaths] [passes]     (defaults: 40000 3)
+*/
+
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+#include "benchHelpers.h"
+
+#define POINTS_PER_PATH 20
+
+static void makeDocument(FILE * fp, int numPaths) {
+    fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<kml xmlns=\"http://www.opengis.net/kml/2.2\"><Document><name>benchWriter</name>\n");
+    for (int i = 0; i < numPaths; i++) {
+        fprintf(fp, "<Placemark><name>Path %d</name><LineString><tessellate>1</tessellate><coordinates>", i);
+        double longitude = randomIn(-80, -79);
+        double latitude = randomIn(43, 44);
+        for (int j = 0; j < POINTS_PER_PATH; j++) {
+            fprintf(fp, "%.7f,%.7f,%.1f ", longitude, latitude, randomIn(0, 300));
+            longitude += randomIn(-0.001, 0.001);
+            latitude += randomIn(-0.001, 0.001);
+        }
+        fprintf(fp, "</coordinates></LineString></Placemark>\n");
+        fprintf(fp, "<Placemark><name>Point %d</name><Point><coordinates>%.7f,%.7f</coordinates></Point></Placemark>\n",
+            i, randomIn(-80, -79), randomIn(43, 44));
+    }
+    fprintf(fp, "</Document></kml>\n");
+}
+
+static bool writeWithTree(const KML * doc, const char * fileName) {
+    xmlDoc * tree = convertToTree(doc);
+    if (tree == NULL) {
+        return false;
+    }
+
+    int status = xmlSaveFormatFileEnc(fileName, tree, "UTF-8", 1);
+    xmlFreeDoc(tree);
+
+    return status != -1;
+}
+
+static bool writeWithEmitter(const KML * doc, const char * fileName) {
+    return writeKML(doc, fileName);
+}
+
+// Writes the document passes times, and returns the best time of a pass in milliseconds, or -1 on failure.
+static double timeWriter(bool (*write)(const KML *, const char *), const KML * doc, const char * fileName, int passes, double * growth) {
+    double peak = peakMegabytes();
+    double best = -1;
+    for (int pass = 0; pass < passes; pass++) {
+        double start = now();
+        if (!write(doc, fileName)) {
+            return -1;
+        }
+        double elapsed = (now() - start) * 1e3;
+        if (best < 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    *growth = peakMegabytes() - peak;
+
+    return best;
+}
+
+int main(int argc, char ** argv) {
+    int numPaths = argc > 1 ? atoi(argv[1]) : 40000;
+    int passes = argc > 2 ? atoi(argv[2]) : 3;
+    if (numPaths < 1 || passes < 1) {
+        fprintf(stderr, "usage: %s [numPaths] [passes]\n", argv[0]);
+        return 1;
+    }
+
+    kmlInit();
+
+    char inputFile[] = "/tmp/benchWriterInputXXXXXX";
+    char streamFile[] = "/tmp/benchWriterStreamXXXXXX";
+    char treeFile[] = "/tmp/benchWriterTreeXXXXXX";
+    int inputFd = mkstemp(inputFile);
+    int streamFd = mkstemp(streamFile);
+    int treeFd = mkstemp(treeFile);
+    if (inputFd < 0 || streamFd < 0 || treeFd < 0) {
+        fprintf(stderr, "benchWriter: could not create the files\n");
+        return 1;
+    }
+    close(streamFd);
+    close(treeFd);
+
+    srand(1);
+    FILE * fp = fdopen(inputFd, "w");
+    makeDocument(fp, numPaths);
+    fclose(fp);
+    KML * doc = createKMLWithFlags(inputFile, KML_PARSE_STREAM);
+    remove(inputFile);
+    if (doc == NULL) {
+        fprintf(stderr, "benchWriter: could not load the document\n");
+        return 1;
+    }
+
+    double streamGrowth;
+    double treeGrowth;
+    double streamTime = timeWriter(&writeWithEmitter, doc, streamFile, passes, &streamGrowth);
+    double treeTime = timeWriter(&writeWithTree, doc, treeFile, passes, &treeGrowth);
+
+    size_t streamLength = 0;
+    size_t treeLength = 0;
+    char * streamOutput = readFile(streamFile, &streamLength);
+    char * treeOutput = readFile(treeFile, &treeLength);
+    bool same = streamOutput != NULL && treeOutput != NULL && streamLength == treeLength
+        && memcmp(streamOutput, treeOutput, streamLength) == 0;
+    free(streamOutput);
+    free(treeOutput);
+    remove(streamFile);
+    remove(treeFile);
+    deleteKML(doc);
+    kmlCleanup();
+
+    if (streamTime < 0 || treeTime < 0) {
+        fprintf(stderr, "benchWriter: a writer failed\n");
+        return 1;
+    }
+    if (!same) {
+        fprintf(stderr, "benchWriter: writeKML and the tree writer wrote different files\n");
+        return 1;
+    }
+
+    double megabytes = streamLength / 1e6;
+    printf("%d paths and %d points, %.1f MB of output, best of %d passes\n", numPaths, numPaths, megabytes, passes);
+    printf("%30s %10s %10s %16s\n", "", "ms", "MB/s", "peak RSS +MB");
+    printf("%30s %10.1f %10.0f %16.1f\n", "writeKML", streamTime, megabytes / streamTime * 1e3, streamGrowth);
+    printf("%30s %10.1f %10.0f %16.1f\n", "convertToTree + xmlSaveFormat", treeTime, megabytes / treeTime * 1e3, treeGrowth);
+    printf("speedup %.1fx, identical output\n", treeTime / streamTime);
+
+    return 0;
+}
@@ -10,6 +10,17 @@
 #define LIBXML_SCHEMAS_ENABLED
 #include "KMLParser.h"
 #include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libxml/xmlreader.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 void treeStepper(xmlNode * node);
 
@@ -32,24 +43,115 @@ PointPlacemark * initPointPlacemark(xmlNode * node, KML * kml);
 /**
  * Initialize a Point struct.
 */
-Point * initPoint(xmlNode * node);
+Point * initPoint(xmlNode * node, KML * kml);
 
 /**
  * Initialize a Coordinate struct.
 */
-Coordinate * initCoordinate(xmlNode * node);
+Coordinate * initCoordinate(xmlNode * node, KML * kml);
+
+/**
+ * Return a copy of the text content of an element, allocated from arena
+ * (or with malloc if arena is NULL).
+*/
+char * copyNodeText(xmlNode * node, KMLArena * arena);
+
+/**
+ * Return the text content of an element. When the element has a single text
+ * child its content is returned in place and copy is set to NULL, otherwise
+ * the text is assembled into a new string that is returned in copy and must be freed.
+*/
+const char * getNodeText(xmlNode * node, char ** copy);
+
+/**
+ * Convert the decimal number at the start of str exactly as atof/strtod would,
+ * and point end at the first character after it. Plain decimals with up to
+ * 15 significant digits are converted without calling strtod.
+*/
+double parseDouble(const char * str, const char ** end);
+
+/**
+ * Parse the next whitespace separated "lon,lat[,alt]" tuple in [str, end) into c.
+ * Missing values are left at -1 (longitude, latitude) or DBL_MAX (altitude).
+ * Returns a pointer just past the tuple, or NULL if only whitespace remains.
+*/
+const char * scanCoordinate(const char * str, const char * end, Coordinate * c);
 
 /**
  * Takes a namespace node, populates a namespace struct,
  * and returns it.
 */
-XMLNamespace * initNameSpace(xmlNs * ns);
+XMLNamespace * initNameSpace(xmlNs * ns, KML * kml);
 
 PathPlacemark * initPathPlacemark(xmlNode * node, KML * kml);
-Line * initPath(xmlNode * node);
+Line * initPath(xmlNode * node, KML * kml);
 char * lineToString(void * data);
 void deleteLine(void * data);
 
+/**
+ * Set up an empty coordinate buffer whose arrays will be allocated from arena
+ * (or with malloc if arena is NULL). No memory is allocated until the first append.
+*/
+void initCoordinateBuffer(CoordinateBuffer * buffer, KMLArena * arena);
+
+/**
+ * Append a coordinate to the buffer, growing its arrays geometrically.
+ * Returns false if memory could not be allocated.
+*/
+bool appendCoordinate(CoordinateBuffer * buffer, double longitude, double latitude, double altitude);
+
+/**
+ * Release the unused capacity of a buffer once it has been filled. If arena is not NULL,
+ * the arrays of a malloc'd buffer are moved into the arena.
+*/
+void shrinkCoordinateBuffer(CoordinateBuffer * buffer, KMLArena * arena);
+
+/**
+ * Copy the coordinates of a KML_COORDINATES_DOUBLE buffer into a new buffer whose arrays are exactly as long,
+ * allocated from arena (or with malloc if arena is NULL). Returns false if memory could not be allocated.
+*/
+bool copyCoordinateBuffer(const CoordinateBuffer * source, KMLArena * arena, CoordinateBuffer * copy);
+
+/**
+ * Free the arrays of a buffer and leave it empty. Arena arrays are left to the arena.
+*/
+void freeCoordinateBuffer(CoordinateBuffer * buffer);
+
+/* Compact coordinates - see KMLCompact.c */
+
+/**
+ * Re-encode the coordinates of a buffer as encoding, which must not be KML_COORDINATES_DOUBLE, with the
+ * packed bytes allocated from arena. Returns false, leaving the buffer unchanged, if a coordinate is out
+ * of range or memory could not be allocated.
+*/
+bool packCoordinateBuffer(CoordinateBuffer * buffer, KMLCoordinateEncoding encoding, KMLArena * arena);
+
+/**
+ * Encode the coordinates of a KML_COORDINATES_DOUBLE buffer into a new buffer, as packCoordinateBuffer does,
+ * leaving source untouched.
+*/
+bool encodeCoordinateBuffer(const CoordinateBuffer * source, KMLCoordinateEncoding encoding, KMLArena * arena, CoordinateBuffer * encoded);
+
+/**
+ * Convert a compact buffer back to double arrays allocated the same way as its packed bytes.
+*/
+bool unpackCoordinateBuffer(CoordinateBuffer * buffer);
+
+/**
+ * Decode any buffer into a new buffer of malloc'd double arrays, which the caller frees with freeCoordinateBuffer.
+*/
+bool decodeCoordinateBuffer(const CoordinateBuffer * buffer, CoordinateBuffer * decoded);
+
+/**
+ * Decode the coordinate at index, which must be in range.
+*/
+Coordinate decodeCoordinate(const CoordinateBuffer * buffer, int index);
+
+/**
+ * Set up an iterator over a buffer rather than a Line, as initCoordinateIterator does.
+*/
+void initBufferIterator(KMLCoordinateIterator * iter, const CoordinateBuffer * buffer);
+
 // From https://www.delftstack.com/howto/c/trim-string-in-c/
 char * trimString(char *str);
 
@@ -57,26 +159,569 @@ char * trimString(char *str);
 /// Style struct with its data.
 /// @param node A Style XML node.
 /// @return A Style struct.
-Style * initStyle(xmlNode * node);
+Style * initStyle(xmlNode * node, KML * kml);
 
-StyleMap * initStyleMap(xmlNode * node);
+StyleMap * initStyleMap(xmlNode * node, KML * kml);
 
 /// @brief Takes a KML element node, parses it, populates a KMLElement
 /// struct with its data, and returns it.
 /// @param node A KMLElement XML node
 /// @return A populated KMLElement struct
-KMLElement * initKMLElement(xmlNode * node);
+KMLElement * initKMLElement(xmlNode * node, KML * kml);
+
+/**
+ * Allocate a KML struct with all of its lists initialized and empty.
+ * With KML_PARSE_ARENA in flags the struct gets an arena for its contents, the spare one of ctx if it has one.
+ * ctx may be NULL.
+*/
+KML * initKML(int flags, KMLParserCtx * ctx);
+
+/**
+ * Add the namespace(s) of a kml element node to the KML struct.
+*/
+void addNameSpaces(xmlNode * node, KML * kml);
 
+/**
+ * Convert a Placemark, Style or StyleMap element node and add it to
+ * the matching list of the KML struct. Other elements are ignored.
+*/
+void addKMLElement(xmlNode * node, KML * kml);
+
+/**
+ * Map KML_PARSE_* flags to the matching libxml2 parser options.
+*/
+int getXMLParseOptions(int flags);
+
+/**
+ * Walk a parsed XML tree and build a KML struct from it.
+*/
+KML * convertFromTree(xmlDoc * doc, int flags, KMLParserCtx * ctx);
+
+/**
+ * Pull events from a text reader and build a KML struct from them, expanding
+ * one top level element at a time. Returns NULL if the document is not well formed,
+ * or, when validating is true, as soon as the reader reports a schema error.
+*/
+KML * convertFromReader(xmlTextReader * reader, int flags, bool validating, KMLParserCtx * ctx);
+
+/**
+ * Parse a file into a tree, validate it against schema and convert it.
+ * Returns NULL if the file cannot be parsed or is not valid.
+*/
+KML * createValidKMLFromFile(const char * fileName, const KMLSchema * schema, int flags);
+
+/**
+ * Validate a tree against the schema file, compiling the schema only
+ * the first time that file name is used. Returns 0 if the tree is valid.
+*/
 int validateTree(xmlDoc * doc, const char * schemaFile);
+
+/**
+ * Read, validate and convert a file in a single pass with a text reader.
+ * Returns NULL if the file cannot be parsed or is not valid.
+*/
+KML * createValidKMLFromReader(const char * fileName, const KMLSchema * schema, int flags);
+
+/* In-memory input - see KMLMemory.c */
+
+/**
+ * Build a KML struct from a document held in memory, validating it against schema if schema is not NULL.
+ * url is used to resolve relative references and in error messages, and may be NULL.
+ * Returns NULL if the document cannot be parsed or is not valid.
+*/
+KML * convertFromMemory(const char * buffer, size_t length, const char * url, const KMLSchema * schema, int flags);
+
+/**
+ * Map a file into memory and build a KML struct from it with convertFromMemory.
+*/
+KML * convertFromMappedFile(const char * fileName, const KMLSchema * schema, int flags);
+
 xmlDoc * convertToTree(const KML * kml);
 bool convertStyleMaps(xmlNode * node, const KML * kml);
 bool convertStyles(xmlNode * node, const KML * kml);
 bool convertPointPlacemarks(xmlNode * node, const KML * kml);
 bool convertPathPlacemarks(xmlNode * node, const KML * kml);
 
+/* Output - see KMLWriter.c */
+
+// Growable string, or a fixed size buffer that passes its contents to drain whenever it fills up.
+typedef struct {
+    // Contents not yet drained, always followed by a NUL.
+    char * data;
+    size_t length;
+    size_t capacity;
+    // NULL to grow the buffer instead of draining it. Returns false if the output could not be written.
+    bool (*drain)(void * target, const char * data, size_t length);
+    void * target;
+    // Set once an allocation or a drain fails. Later appends are ignored.
+    bool failed;
+} KMLStringBuilder;
+
+void initStringBuilder(KMLStringBuilder * sb, size_t capacity, bool (*drain)(void * target, const char * data, size_t length), void * target);
+void freeStringBuilder(KMLStringBuilder * sb);
+
+/**
+ * Pass the buffered contents of a draining builder to its drain function. Returns false if anything
+ * appended so far could not be written.
+*/
+bool flushStringBuilder(KMLStringBuilder * sb);
+
+/**
+ * Hand the contents of a growing builder to the caller, who frees them. Returns NULL, having freed the
+ * builder, if any append failed.
+*/
+char * takeStringBuilder(KMLStringBuilder * sb);
+
+bool appendBytes(KMLStringBuilder * sb, const char * bytes, size_t length);
+bool appendString(KMLStringBuilder * sb, const char * str);
+bool appendFormat(KMLStringBuilder * sb, const char * format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Append text with the characters XML requires to be escaped, in element content or, if attribute
+ * is true, in a double quoted attribute value, replaced by references.
+*/
+bool appendEscaped(KMLStringBuilder * sb, const char * text, bool attribute);
+
+// Room needed by formatDouble and formatCoordinate, including the terminating NUL.
+#define KML_NUMBER_LENGTH 32
+#define KML_COORDINATE_LENGTH (3 * KML_NUMBER_LENGTH)
+
+/**
+ * Write the shortest decimal that reads back as exactly value, such as "-79.3956" or "0", and return its
+ * length. Locale independent. Falls back to %.17g style only for values with more than 15 digits or far
+ * from 1, which coordinates do not have.
+*/
+int formatDouble(char * buffer, double value);
+
+/**
+ * Write a coordinate as it appears in a <coordinates> element: longitude,latitude and, unless it is
+ * DBL_MAX, ,altitude. Returns the length.
+*/
+int formatCoordinate(char * buffer, double longitude, double latitude, double altitude);
+
+/**
+ * Whether convertToTree can convert a KML struct. Checked up front by the writers, so that nothing is
+ * written for a document that cannot be.
+*/
+bool isWritableKML(const KML * kml);
+
+/**
+ * Write a KML struct, which must pass isWritableKML, as a KML file straight from the structs, formatted
+ * byte for byte as xmlSaveFormatFileEnc formats the tree built by convertToTree. Text containing '&' is
+ * the exception: it is escaped, where xmlNewChild would parse it for entity references. Returns false if
+ * the builder fails.
+*/
+bool emitKML(const KML * kml, KMLStringBuilder * sb);
+bool emitKMLToFd(const KML * kml, int fd);
+bool emitKMLToBuffer(const KML * kml, char ** buffer, size_t * length);
+
+/* String representations - see KMLParser.c */
+
+/**
+ * Append what KMLToString and the *ToString functions return. Those are built on these, so that a whole
+ * document goes into one builder rather than a string per element.
+*/
+bool appendKMLString(KMLStringBuilder * sb, const KML * doc);
+bool appendKMLElementString(KMLStringBuilder * sb, const KMLElement * element);
+bool appendXMLNamespaceString(KMLStringBuilder * sb, const XMLNamespace * ns);
+bool appendStyleString(KMLStringBuilder * sb, const Style * style);
+bool appendStyleMapString(KMLStringBuilder * sb, const StyleMap * map);
+bool appendCoordinateString(KMLStringBuilder * sb, const Coordinate * coordinate);
+bool appendPointString(KMLStringBuilder * sb, const Point * point);
+bool appendPointPlacemarkString(KMLStringBuilder * sb, const PointPlacemark * placemark);
+bool appendPathPlacemarkString(KMLStringBuilder * sb, const PathPlacemark * placemark);
+// See KMLHelpers.c.
+bool appendLineString(KMLStringBuilder * sb, const Line * line);
+
+/* Line coordinate lists - see KMLParser.c */
+
+/**
+ * Bring a Line in step after its points buffer was changed, as markLineChanged does, but without touching the
+ * indexes of its document. Used by the functions that change many Lines at once, or from several threads.
+*/
+void syncLine(Line * line);
+
+/**
+ * Bring line->coordinates in step with the points buffer, reusing its nodes, and mark it as filled. Returns
+ * false if memory could not be allocated for new ones.
+*/
+bool fillCoordinateList(Line * line);
+
+/**
+ * Empty line->coordinates and stop keeping it in step, freeing its Coordinates and nodes unless they are in an
+ * arena. Used once the list is no longer worth its memory, such as when a Line is compacted.
+*/
+void dropCoordinateList(Line * line);
+
+/**
+ * If line->coordinates was changed since it was last in step with the points buffer, replace the buffer with
+ * its coordinates and bump the version of the Line. Every library function that reads or changes the
+ * coordinates of a Line calls this first.
+*/
+void adoptCoordinateList(const Line * line);
+
+/* Compiled schemas - see KMLSchema.c */
+
+struct KMLSchema {
+    // Compiled schema, shared read-only by all validations.
+    xmlSchemaPtr schema;
+    // File the schema was compiled from.
+    char * fileName;
+    double compileSeconds;
+    // Protects the validation statistics below.
+    pthread_mutex_t lock;
+    double validateSeconds;
+    int validations;
+    // Next schema in the validateTree cache.
+    struct KMLSchema * next;
+};
+
+/**
+ * Return the schema compiled from schemaFile, compiling and caching it on
+ * first use. Returns NULL if the schema could not be compiled.
+*/
+KMLSchema * getCachedSchema(const char * schemaFile);
+
+/**
+ * Free every schema getCachedSchema has compiled. Only safe while nothing else uses them.
+*/
+void clearSchemaCache(void);
+
+/**
+ * Validate a tree against a compiled schema. Returns 0 if the tree is valid.
+*/
+int validateTreeWithSchema(xmlDoc * doc, const KMLSchema * schema);
+
+/**
+ * Validate a KML struct against a compiled schema without building a tree. The output of emitKML is
+ * pushed through a parser whose only SAX handlers are the schema validator's, so memory use does not
+ * grow with the document. Returns 0 if the struct is valid, and -1 if it cannot be written at all.
+*/
+int validateKMLStream(const KML * kml, const KMLSchema * schema);
+
+/**
+ * Add one validation taking the given time to the schema's statistics.
+*/
+void recordValidation(KMLSchema * schema, double seconds);
+
+/**
+ * Monotonic wall clock time in seconds.
+*/
+double getSeconds(void);
+
+/* Parser contexts - see KMLContext.c */
+
+struct KMLParserCtx {
+    // Schema documents are validated against, or NULL. Owned by the caller.
+    const KMLSchema * schema;
+    // KML_PARSE_* flags every document is loaded with.
+    int flags;
+    xmlParserCtxtPtr parser;
+    // NULL if schema is NULL.
+    xmlSchemaValidCtxtPtr validator;
+    // Malloc'd buffer lent to each document while it is converted. See KML.scratch.
+    CoordinateBuffer scratch;
+    // Emptied arena of a document passed to recycleKML, used by the next document loaded with KML_PARSE_ARENA.
+    KMLArena * spareArena;
+};
+
+/**
+ * Hand over the spare arena of ctx, leaving it with none. Returns NULL if ctx is NULL or has no spare arena.
+*/
+KMLArena * takeSpareArena(KMLParserCtx * ctx);
+
+/* Name and id indexes - see KMLIndex.c */
+
+typedef struct {
+    // Copy of the name or id, owned by the table. NULL for an empty slot.
+    const char * key;
+    void * value;
+    // Position of value in its list, used to keep "first match wins" on updates.
+    int position;
+} KMLHashEntry;
+
+struct KMLHashTable {
+    // Open addressing with linear probing. capacity is a power of two.
+    KMLHashEntry * entries;
+    int capacity;
+    // Live entries.
+    int count;
+    // Live entries plus tombstones.
+    int used;
+    // Modification count of the list when it was indexed. Any insertion or deletion changes it.
+    unsigned long listModifications;
+};
+
+KMLHashTable * initHashTable(int expected);
+void freeHashTable(KMLHashTable * table);
+KMLHashEntry * hashTableFind(const KMLHashTable * table, const char * key);
+bool hashTableInsert(KMLHashTable * table, const char * key, void * value, int position);
+bool hashTableRemove(KMLHashTable * table, const char * key);
+
+/**
+ * Return true if table is not NULL and list has not been modified since table was built over it.
+*/
+bool hashTableCurrent(const KMLHashTable * table, const List * list);
+
+/**
+ * Index the structs in a list by the key getKey returns for them, keeping the first of any duplicates.
+*/
+KMLHashTable * buildIndex(List * list, const char * (*getKey)(void * data));
+
+/**
+ * Index a list of PointPlacemarks or PathPlacemarks by name, keeping the first of any duplicates.
+*/
+KMLHashTable * buildNameIndex(List * placemarks);
+
+/**
+ * Update a name index after the placemark at position in placemarks was renamed from oldName.
+*/
+void renameInIndex(KMLHashTable * table, List * placemarks, void * placemark, int position, const char * oldName);
+
+/**
+ * Return the value of a PathPlacemark's styleUrl element, or NULL if it has none.
+*/
+const char * getStyleUrl(const PathPlacemark * ppm);
+
+/**
+ * Return true if the style links and id indexes of doc are current.
+*/
+bool stylesLinked(const KML * doc);
+
+/**
+ * Return the first StyleMap / Style whose id matches url (with or without a leading '#'),
+ * using the id indexes when they are current. Neither function allocates.
+*/
+StyleMap * findStyleMap(const KML * doc, const char * url);
+Style * findStyle(const KML * doc, const char * url);
+
+typedef struct {
+    double length;
+    PathPlacemark * path;
+    // Position of path in the pathPlacemarks list.
+    int position;
+} KMLLengthEntry;
+
+struct KMLLengthIndex {
+    // Sorted by length, then by position.
+    KMLLengthEntry * entries;
+    int count;
+    // Modification count of pathPlacemarks when the index was built. Positions are only valid while it matches.
+    unsigned long listModifications;
+};
+
+/**
+ * Build a length index over every PathPlacemark of doc. Returns NULL if memory could not be allocated.
+*/
+KMLLengthIndex * buildLengthIndex(const KML * doc);
+void freeLengthIndex(KMLLengthIndex * index);
+
+/**
+ * Return true if doc has a length index and no path was inserted or deleted since it was built.
+*/
+bool lengthIndexCurrent(const KML * doc);
+
+/**
+ * Find the entries of a length index whose length is between minLength and maxLength. Returns how many there
+ * are, and stores the position of the first one in first.
+*/
+int findLengthRange(const KMLLengthIndex * index, double minLength, double maxLength, int * first);
+
+/**
+ * Record a change to the coordinates of one Line of doc, of every Line of doc, or of one Point of doc. Each
+ * bumps doc->modifications and drops the spatial index, and the first two bring the length index up
+ * to date: recordPathChange moves the one entry in O(n) time, recordPathsChange re-sorts the whole index.
+ * doc may be NULL for the first and last, as it is for structs built by hand.
+*/
+void recordPathChange(KML * doc, const Line * line);
+void recordPathsChange(KML * doc);
+void recordPointChange(KML * doc);
+
+/* Spatial index - see KMLSpatial.c */
+
+typedef struct {
+    double minX;
+    double minY;
+    double maxX;
+    double maxY;
+} KMLBox;
+
+typedef struct {
+    // Must come first, see strSort in KMLSpatial.c.
+    KMLBox box;
+    void * placemark;
+    bool isPath;
+} KMLSpatialItem;
+
+typedef struct {
+    // Must come first, see strSort in KMLSpatial.c.
+    KMLBox box;
+    // Children are the items [first, first + count) if leaf is true, and the nodes [first, first + count) otherwise.
+    int first;
+    int count;
+    bool leaf;
+} KMLSpatialNode;
+
+struct KMLSpatialIndex {
+    // Items in leaf order.
+    KMLSpatialItem * items;
+    int numItems;
+    // Nodes level by level, leaves first and the root last.
+    KMLSpatialNode * nodes;
+    int numNodes;
+    // Height of the tree, to size the query stack.
+    int height;
+    // Modification counts of the document and of its placemark lists when the index was built.
+    unsigned long modifications;
+    unsigned long pointListModifications;
+    unsigned long pathListModifications;
+    // Stale index this one replaced while queries could still be reading it, freed together with this one.
+    KMLSpatialIndex * retired;
+};
+
+/**
+ * Build an R-tree over every placemark of doc. Returns NULL if memory could not be allocated.
+*/
+KMLSpatialIndex * buildSpatialIndex(const KML * doc);
+void freeSpatialIndex(KMLSpatialIndex * index);
+
+/**
+ * Free the spatial index of doc and any it retired. Called whenever placemarks change through the library,
+ * which never runs concurrently with queries, so that the next query builds a new index.
+*/
+void dropSpatialIndex(KML * doc);
+
+/* Path simplification - see KMLSimplify.c */
+
+/**
+ * Run Douglas-Peucker over the coordinates of buffer selected by indices, and store the indices of the
+ * coordinates it keeps in kept, which may be the same array as indices. Returns how many were kept,
+ * or -1 if memory could not be allocated.
+*/
+int simplifyIndices(const CoordinateBuffer * buffer, const int * indices, int count, double tolerance, int * kept);
+
+/* Level of detail pyramids - see KMLLod.c */
+
+// Tolerance of level 1, in meters. Level 0 holds every coordinate, and each level after 1 doubles the tolerance.
+#define KML_LOD_BASE_TOLERANCE 0.5
+#define KML_LOD_MAX_LEVELS 32
+
+struct KMLLodPyramid {
+    // Version of the Line the pyramid was built from.
+    unsigned int version;
+    // Stale pyramid this one replaced while readers could still hold its levels, freed together with this one.
+    KMLLodPyramid * retired;
+    int numLevels;
+    // Level i is indices[levelStart[i]] to indices[levelStart[i + 1] - 1]. Both arrays follow the struct in one allocation.
+    int * levelStart;
+    int * indices;
+};
+
+typedef struct {
+    pthread_t thread;
+    KML * doc;
+    // Set to stop the thread early.
+    int cancel;
+    // Set if a pyramid could not be built.
+    bool failed;
+} KMLLodBuilder;
+
+void freeLodPyramid(KMLLodPyramid * pyramid);
+
+/**
+ * Free the pyramid of a Line and any it retired. Called by the functions that change the coordinates of a
+ * Line, which never run concurrently with lookups.
+*/
+void dropLodPyramid(Line * line);
+
+/**
+ * Stop a background build started by buildKMLLod as soon as possible and wait for it.
+*/
+void stopKMLLod(KML * doc);
+
+/* Nearest neighbour search - see KMLNearest.c */
+
+typedef struct {
+    // Position on the unit sphere.
+    double xyz[3];
+    PointPlacemark * placemark;
+    // Axis this node splits its subtree on.
+    int axis;
+} KMLPointNode;
+
+struct KMLPointTree {
+    // Implicit balanced tree: the subtree over [low, high) has its root at (low + high) / 2,
+    // its left subtree over [low, root) and its right subtree over (root, high).
+    KMLPointNode * nodes;
+    int count;
+};
+
+/**
+ * Free a KML struct and everything in it except its arena, which is returned so that it can be freed or reused.
+*/
+KMLArena * deleteKMLContents(KML * doc);
+
+/**
+ * Build the parts of a freshly converted KML struct that depend on the whole document,
+ * as requested by the KML_PARSE_* flags.
+*/
+void finishKML(KML * kml, int flags);
+
+/* Arena allocation - see KMLArena.c */
+
+typedef struct ArenaChunk {
+    struct ArenaChunk * next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(16)));
+} ArenaChunk;
+
+struct KMLArena {
+    // Chunks in use, the one with the most free space first.
+    ArenaChunk * chunks;
+    // Empty chunks kept by resetArena, used before allocating new ones.
+    ArenaChunk * spare;
+    // Size of a regular chunk.
+    size_t chunkSize;
+};
+
+#define KML_ARENA_CHUNK_SIZE (64 * 1024)
+
+KMLArena * initArena(size_t chunkSize);
+void * arenaAlloc(KMLArena * arena, size_t size);
+
+/**
+ * Release everything allocated from an arena at once, keeping its regular chunks for later allocations.
+*/
+void resetArena(KMLArena * arena);
+void freeArena(KMLArena * arena);
+
+/// @brief The kml* functions below allocate from the given arena, or fall back
+/// to malloc/free and the LinkedListAPI when arena is NULL, so that the same
+/// code can build a document either way.
+void * kmlMalloc(KMLArena * arena, size_t size);
+char * kmlStrdup(KMLArena * arena, const char * str);
+void kmlFree(KMLArena * arena, void * p);
+List * kmlInitializeList(KMLArena * arena, char* (*printFunction)(void* toBePrinted), void (*deleteFunction)(void* toBeDeleted), int (*compareFunction)(const void* first, const void* second));
+void kmlInsertBack(KMLArena * arena, List * list, void * toBeAdded);
+void kmlClearList(KMLArena * arena, List * list);
+
 // From https://rosettacode.org/wiki/Haversine_formula#C
 double dist(double th1, double ph1, double th2, double ph2);
 
+/**
+ * Batch versions of dist() that measure every segment of a path at once using SIMD, see KMLDistance.c.
+ * segmentDistances stores the length of segment i (from point i to point i + 1) in distances[i], so
+ * distances must have room for length - 1 values. pathDistance returns the sum of the segment lengths.
+*/
+void segmentDistances(const double * latitudes, const double * longitudes, int length, double * distances);
+double pathDistance(const double * latitudes, const double * longitudes, int length);
+
+/**
+ * Recompute the cached metrics of a PathPlacemark if its Line has changed since they were computed, and return them.
+*/
+const PathMetrics * updatePathMetrics(PathPlacemark * ppm);
+
 int updatePoint(char * newName, int i, KML * kml);
 int updatePath(char * newName, int i, KML * kml);
 int updateStyle(char * newColour, int newWidth, int i, KML * kml);
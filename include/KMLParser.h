@@ -79,6 +79,11 @@ typedef struct {
     //URL of the second Pair. May be NULL.
     char *url2;
 
+    //Styles referenced by url1 and url2, as resolved by linkStyles. Only valid while
+    //styleGeneration matches the styleGeneration of the KML struct - use getStyleFromMap.
+    Style *styles[2];
+    unsigned int styleGeneration;
+
 } StyleMap;
 
 //Represents a single coordinate - i.e. a single entry in list stored in the <coordinates> element of a Point or LineString element 
@@ -108,14 +113,86 @@ typedef struct {
     All objects in the list will be of type KMLElement.  It must not be NULL.  It may be empty.
     */
     List        *otherElements;
+
+    //Document the Point was parsed into, whose spatial index is marked stale when the coordinate changes
+    //through the library. Must be NULL for a Point built by hand.
+    struct KML  *document;
 } Point;
 
 
+//Bump allocator that owns the memory of a KML struct created with KML_PARSE_ARENA. Defined in KMLHelpers.h.
+typedef struct KMLArena KMLArena;
+
+//Hash table from names or ids to the structs that have them. Defined in KMLHelpers.h.
+typedef struct KMLHashTable KMLHashTable;
+
+//PathPlacemarks sorted by length, for length range queries. Defined in KMLHelpers.h.
+typedef struct KMLLengthIndex KMLLengthIndex;
+
+//R-tree over the placemarks of a document, for bounding box queries. Defined in KMLHelpers.h.
+typedef struct KMLSpatialIndex KMLSpatialIndex;
+
+//Nested subsets of the coordinates of a Line at increasing tolerances. Defined in KMLHelpers.h.
+typedef struct KMLLodPyramid KMLLodPyramid;
+
+//How the coordinates of a CoordinateBuffer are stored. See compactLine.
+typedef enum {
+    //Three parallel arrays of doubles.
+    KML_COORDINATES_DOUBLE,
+
+    //Longitude and latitude as int32 multiples of 1e-7 degrees, altitude as int32 millimetres.
+    KML_COORDINATES_FIXED,
+
+    //The FIXED values as variable length deltas from the previous coordinate, in independent blocks.
+    KML_COORDINATES_DELTA
+} KMLCoordinateEncoding;
+
+//Packed storage for the coordinates of a path. The three arrays are parallel - entry i of each array
+//belongs to the i-th coordinate - so path computations can walk them sequentially.
+typedef struct {
+    //Coordinate longitudes. May be NULL if length is 0, and is NULL if the coordinates are compact.
+    double      *longitudes;
+
+    //Coordinate latitudes. May be NULL if length is 0, and is NULL if the coordinates are compact.
+    double      *latitudes;
+
+    //Coordinate altitudes. As in Coordinate, DBL_MAX indicates that the altitude was not provided.
+    //May be NULL if length is 0, and is NULL if the coordinates are compact.
+    double      *altitudes;
+
+    //Number of coordinates stored.
+    int         length;
+
+    //Number of coordinates the arrays have room for.
+    int         capacity;
+
+    //Arena the arrays were allocated from, or NULL if they were allocated with malloc.
+    KMLArena    *arena;
+
+    //How the coordinates are stored. For anything but KML_COORDINATES_DOUBLE the three arrays are NULL
+    //and the coordinates are encoded in the packedSize bytes at packed, which are read with
+    //getLineCoordinate or a KMLCoordinateIterator.
+    KMLCoordinateEncoding encoding;
+    unsigned char *packed;
+    size_t      packedSize;
+
+    //Whether the compact encoding stores altitudes. False if no coordinate had one.
+    bool        hasAltitudes;
+} CoordinateBuffer;
+
 //Represents a simplified KML LineString element.
 typedef struct {
     
     //List of coordinates that make up the path. All objects in the list will be of type Coordinate. 
-    //Must not me NULL. Must have the minimum length of 2.
+    //Must not me NULL.
+    //The library works on the points buffer below. The list is left empty when a path is parsed, so that a
+    //long track costs no Coordinate or node per point; getLineCoordinates fills it, and from then on the
+    //library keeps it in step with the buffer. Coordinates may still be
+    //added to or removed from the list directly, for instance to build a Line by hand: the next library call
+    //that uses the Line sees that the list changed and adopts it as the coordinates of the path. That call must
+    //not run concurrently with others on the same Line. A Coordinate already in the list that is modified in
+    //place is not noticed - use setLineCoordinate instead. The indexes of the document only see a list changed
+    //by hand once markLineChanged is called.
     List        *coordinates;
 
     /* Additional point data - i.e. XML elements that are children of the KML LineString other than <coordinates> (extrude, altitudeMode, tesselate).  
@@ -126,8 +203,52 @@ typedef struct {
     All objects in the list will be of type KMLElement.  It must not be NULL.  It may be empty.
     */
     List        *otherElements;
+
+    //Coordinates that make up the path. Must have the minimum length of 2.
+    CoordinateBuffer points;
+
+    //Incremented whenever the coordinates change, so that cached PathMetrics can tell they are stale.
+    //Never 0. Code that writes to the points buffer directly must call markLineChanged() afterwards.
+    unsigned int version;
+
+    //Level of detail pyramid of the coordinates, or NULL if it has not been built. Use getPathLOD.
+    KMLLodPyramid *lod;
+
+    //Modification count of the coordinates list when it was last in step with the points buffer. 0 for a
+    //Line built by hand, whose fields other than the two lists must be zero-initialized.
+    unsigned long listModifications;
+
+    //Whether the coordinates list holds every coordinate of the path, because getLineCoordinates filled it or
+    //a list filled by hand was adopted. While it is false, the list is empty and left alone by the library.
+    bool        listFilled;
+
+    //Document the Line was parsed into, whose indexes are updated when the coordinates change through the
+    //library. NULL for a Line built by hand.
+    struct KML  *document;
 } Line;
 
+//Metrics of a path that are costly to compute, cached on its PathPlacemark. Use getPathMetrics.
+typedef struct {
+    //Length of the path in meters, as returned by getPathLen.
+    double      length;
+
+    //Distance in meters between the first and last coordinates. A path with at least 4 coordinates
+    //is a loop at a given delta if this is at most delta - see isLoopPath.
+    double      endpointDistance;
+
+    //Bounding box of the coordinates, in degrees. All 0 if the path has no coordinates.
+    double      minLongitude;
+    double      minLatitude;
+    double      maxLongitude;
+    double      maxLatitude;
+
+    //Number of coordinates in the path.
+    int         numPoints;
+
+    //Version of the Line the metrics were computed from, or 0 if they have not been computed.
+    unsigned int version;
+} PathMetrics;
+
 
 //For placemarks, all Geometry elements other that LineString and Point are ignored
 
@@ -184,10 +305,18 @@ typedef struct {
     All objects in the list will be of type KMLElement.  It must not be NULL.  It may be empty.
     */
     List        *otherElements;
+
+    //StyleMap referenced by the styleUrl element, as resolved by linkStyles. Only valid while
+    //styleGeneration matches the styleGeneration of the KML struct - use getMapFromPath.
+    StyleMap    *styleMap;
+    unsigned int styleGeneration;
+
+    //Cached metrics of pathData. Only valid while their version matches the version of pathData - use getPathMetrics.
+    PathMetrics metrics;
 } PathPlacemark;
 
 
-typedef struct {
+typedef struct KML {
     
     //Namespaces associated with our KML doc.  Must not be NULL or empty. Since a KML KML doc might have
     //multiple namespaces associated with it, we place them in a list
@@ -204,9 +333,61 @@ typedef struct {
 
     //Style Maps in a KML file. All objects in the list will be of type StyleMap.  It must not be NULL.  It may be empty.
     List        *styleMaps;
+
+    //Arena that every string, struct, list and coordinate array of the document was allocated from,
+    //or NULL if they were allocated individually with malloc. When it is not NULL, the lists above
+    //must only be modified through the library functions, and deleteKML releases everything at once.
+    KMLArena    *arena;
+
+    //Indexes from placemark name to the first PointPlacemark / PathPlacemark with that name, or NULL if the
+    //document was not indexed. See indexKMLNames.
+    KMLHashTable *pointIndex;
+    KMLHashTable *pathIndex;
+
+    //Indexes from id to the first Style / StyleMap with that id, and the generation of the style links
+    //resolved from them. See linkStyles.
+    KMLHashTable *styleIndex;
+    KMLHashTable *styleMapIndex;
+    unsigned int styleGeneration;
+
+    //PathPlacemarks sorted by length, built when the document is loaded. See indexKMLLengths.
+    KMLLengthIndex *lengthIndex;
+
+    //R-tree over the placemarks, or NULL until the first kmlQueryBBox or indexKMLSpatial builds it.
+    KMLSpatialIndex *spatialIndex;
+
+    //Incremented whenever the coordinates of a placemark change through the library.
+    unsigned long modifications;
+
+    //Thread building level of detail pyramids in the background, or NULL. See buildKMLLod.
+    void *lodBuilder;
+
+    //Encoding the coordinates of paths are stored in when they are parsed. See KML_PARSE_COMPACT.
+    KMLCoordinateEncoding coordinateEncoding;
+
+    //Buffer the coordinates of each path are collected in while the document is parsed, lent by the
+    //KMLParserCtx loading it. NULL once loading has finished.
+    CoordinateBuffer *scratch;
     
 } KML;
 
+/* Public API - library setup */
+
+/** Function to set up the library before it is used.
+ * Every function of the library may then be called from several threads at once, on different KML structs.
+ * Parsing, validation and writing only use state of their own, and never tear down libxml2's global state.
+ *@pre No other function of the library is running
+ *@post libxml2 has been initialized
+**/
+void kmlInit(void);
+
+/** Function to release everything the library holds on to between calls, such as the schemas validateKML and
+ * createValidKML compile and cache, and libxml2's global state. Call it once, when the library is no longer used.
+ *@pre No other function of the library is running. kmlInit has been called
+ *@post Cached schemas have been freed and libxml2 has been cleaned up
+**/
+void kmlCleanup(void);
+
 /* Public API - read/write/delete/toString */
 
 /** Function to create an KML object based on the contents of an KML file.
@@ -296,6 +477,39 @@ PointPlacemark* getPointPlacemark(const KML* doc, char* name);
 // Return NULL if the PathPlacemark does not exist 
 PathPlacemark* getPathPlacemark(const KML* doc, char* name);
 
+/** Function to build hash indexes of the placemark names in a KML struct. Once indexed, getPointPlacemark and
+ * getPathPlacemark take constant time instead of scanning their list, and still return the first placemark with
+ * the name. updatePoint and updatePath keep the indexes current. Once a placemark is inserted into or deleted
+ * from a list, lookups in that list fall back to scanning until this function is called again. A name changed
+ * by hand is noticed when the index leads to the renamed placemark, but another placemark that took the name
+ * over is only found after reindexing - rename placemarks with updatePoint and updatePath.
+ *@pre KML object exists, is not NULL, and has not been freed
+ *@post the name indexes of the KML struct have been (re)built
+ *@return true on success, false if memory could not be allocated
+ *@param doc - a pointer to a KML struct
+**/
+bool indexKMLNames(KML* doc);
+
+/** Function to resolve the style links of a KML struct: every PathPlacemark's styleUrl to its StyleMap, and
+ * every StyleMap's urls to their Styles. This is done when a file is loaded, after which getMapFromPath and
+ * getStyleFromMap return the stored pointers without searching or allocating.
+ * Adding or removing a Style or StyleMap is detected automatically and the getters go back to searching.
+ * After changing an id, a url or a styleUrl, call invalidateStyleLinks or linkStyles.
+ *@pre KML object exists, is not NULL, and has not been freed
+ *@post the style links of the KML struct have been resolved
+ *@return true on success, false if memory could not be allocated
+ *@param doc - a pointer to a KML struct
+**/
+bool linkStyles(KML* doc);
+
+/** Function to discard the style links resolved by linkStyles
+ *@pre KML object exists, is not NULL, and has not been freed
+ *@post getMapFromPath and getStyleFromMap search the document until linkStyles is called again
+ *@return none
+ *@param doc - a pointer to a KML struct
+**/
+void invalidateStyleLinks(KML* doc);
+
 /** Function that returns a StyelMap associated with the provided PathPlacemark.  If more than one exists, return the first one.  
  *@pre 
     - KML object exists, is not NULL, and has not been freed
@@ -335,7 +549,8 @@ Style* getStyleFromMap(const KML *doc, const StyleMap *map, int index);
 /* ******************************* A2 functions *************************** */
 /** Function to create a KML struct based on the contents of an KML file.
  * This function must validate the XML tree generated by libxml against a KML schema file
- * before attempting to traverse the tree and create a KML struct
+ * before attempting to traverse the tree and create a KML struct.
+ * The schema is compiled the first time a schema file name is used and reused by later calls.
  *@pre File name cannot be an empty string or NULL.
        File represented by this name must exist and must be readable.
        Schema file name is not NULL/empty, and represents a valid schema file
@@ -349,7 +564,82 @@ Style* getStyleFromMap(const KML *doc, const StyleMap *map, int index);
 KML* createValidKML(const char *fileName, const char* schemaFile);
 
 
+/* ******************************* Streaming ingest *************************** */
+
+//Flags accepted by createKMLStream, createKMLWithFlags, createValidKMLWithFlags and createKMLBatch.
+//They may be combined with a bitwise OR.
+#define KML_PARSE_DEFAULT   0
+
+//Lift libxml2's built-in limits on the size of a single text node, which a <coordinates> element
+//of a very long track can exceed
+#define KML_PARSE_HUGE      (1 << 0)
+
+//Allocate the whole document from large chunks owned by the KML struct instead of one malloc per
+//string, struct, list node and coordinate array. deleteKML then only has to free the chunks.
+#define KML_PARSE_ARENA     (1 << 1)
+
+//Read the file a single time with libxml2's streaming reader instead of building the complete XML tree.
+//createKMLWithFlags then behaves like createKMLStream. createValidKMLWithFlags validates against the schema
+//while it reads and builds the KML struct from the same pass, so the file is never parsed twice; if the
+//file turns out to be invalid partway through, everything built so far is freed and NULL is returned.
+#define KML_PARSE_STREAM    (1 << 2)
+
+//Index placemark names while parsing, so that getPointPlacemark and getPathPlacemark are hash lookups.
+//Equivalent to calling indexKMLNames on the result.
+#define KML_PARSE_INDEX_NAMES (1 << 3)
+
+//Store the coordinates of paths as KML_COORDINATES_FIXED, or as KML_COORDINATES_DELTA with
+//KML_PARSE_COMPACT_DELTA, instead of doubles. Equivalent to calling compactKML on the result, except
+//that the double arrays are never kept. See compactLine for what this costs in precision.
+#define KML_PARSE_COMPACT   (1 << 4)
+#define KML_PARSE_COMPACT_DELTA (1 << 5)
+
+/** Function to create a KML struct by streaming through a KML file instead of building the
+ * complete XML tree first. Only the Placemark, Style or StyleMap element currently being converted
+ * is held in memory, so peak memory is bounded by the largest single element rather than the file size.
+ *@pre File name cannot be an empty string or NULL.
+       File represented by this name must exist and must be readable.
+ *@post Either:
+        A valid KML struct, identical to the one createKML would return, has been created and its address was returned
+		or 
+		An error occurred, or the file was not well formed, and NULL was returned
+ *@return the pinter to the new struct or NULL
+ *@param fileName - a string containing the name of the KML file
+ *@param flags - a combination of the KML_PARSE_* flags
+**/
+KML* createKMLStream(const char *fileName, int flags);
+
+/** Function to create a KML struct in the same way as createKML, with the KML_PARSE_* flags applied.
+ *@pre File name cannot be an empty string or NULL.
+       File represented by this name must exist and must be readable.
+ *@post Either:
+        A valid KML struct has been created and its address was returned
+		or 
+		An error occurred, and NULL was returned
+ *@return the pinter to the new struct or NULL
+ *@param fileName - a string containing the name of the KML file
+ *@param flags - a combination of the KML_PARSE_* flags
+**/
+KML* createKMLWithFlags(const char *fileName, int flags);
+
+/** Function to create a KML struct in the same way as createValidKML, with the KML_PARSE_* flags applied.
+ *@pre File name cannot be an empty string or NULL.
+       File represented by this name must exist and must be readable.
+       Schema file name is not NULL/empty, and represents a valid schema file
+ *@post Either:
+        A valid KML struct has been created and its address was returned
+		or 
+		An error occurred, or KML file was invalid, and NULL was returned
+ *@return the pinter to the new struct or NULL
+ *@param fileName - a string containing the name of the KML file
+ *@param schemaFile - a string containing the name of the schema file
+ *@param flags - a combination of the KML_PARSE_* flags
+**/
+KML* createValidKMLWithFlags(const char *fileName, const char *schemaFile, int flags);
+
+
 /** Function to validating an existing a KML struct against a KML schema file
+ * The struct is validated as it is serialized, without building a tree, and the schema is compiled once per file name.
  *@pre 
     KML struct exists and is not NULL
     schema file name is not NULL/empty, and represents a valid schema file
@@ -361,7 +651,81 @@ KML* createValidKML(const char *fileName, const char* schemaFile);
 bool validateKML(const KML *doc, const char* schemaFile);
 
 
+/* ******************************* Compiled schemas *************************** */
+
+//A KML schema that has been loaded and compiled once, so that it can be reused for any number of validations.
+//A single KMLSchema may be used by several threads at the same time.
+typedef struct KMLSchema KMLSchema;
+
+//Time spent compiling a KMLSchema, and the total time spent validating against it
+typedef struct {
+    //Time taken to load and compile the schema, in seconds
+    double compileSeconds;
+
+    //Total time spent in validation with the schema, in seconds. Loads made with KML_PARSE_STREAM
+    //validate while reading, so for those this includes reading the file and building the KML struct.
+    double validateSeconds;
+
+    //Number of validations performed with the schema
+    int validations;
+} KMLSchemaStats;
+
+/** Function to load and compile a KML schema file
+ *@pre schema file name is not NULL/empty, and represents a valid schema file
+ *@post Either:
+        The compiled schema has been created and its address was returned
+		or 
+		The schema could not be loaded or compiled, and NULL was returned
+ *@return the pointer to the new schema or NULL
+ *@param schemaFile - the name of a schema file
+**/
+KMLSchema* loadKMLSchema(const char *schemaFile);
+
+/** Function to delete a compiled schema and free all the memory.
+ *@pre schema exists, is not NULL, has not been freed, and is no longer being used by any thread
+ *@post schema has been freed
+ *@return none
+ *@param schema - a pointer to a KMLSchema struct
+**/
+void deleteKMLSchema(KMLSchema *schema);
+
+/** Function that returns the compilation and validation timings of a schema
+ *@pre schema exists and is not NULL
+ *@post schema has not been modified in any way
+ *@return the timings collected so far
+ *@param schema - a pointer to a KMLSchema struct
+**/
+KMLSchemaStats getKMLSchemaStats(const KMLSchema *schema);
+
+/** Function to create a KML struct in the same way as createValidKML, using a schema that has already been compiled
+ *@pre File name cannot be an empty string or NULL.
+       File represented by this name must exist and must be readable.
+       schema exists and is not NULL
+ *@post Either:
+        A valid KML struct has been created and its address was returned
+		or 
+		An error occurred, or KML file was invalid, and NULL was returned
+ *@return the pinter to the new struct or NULL
+ *@param fileName - a string containing the name of the KML file
+ *@param schema - the compiled schema to validate against
+**/
+KML* createValidKMLWithSchema(const char *fileName, const KMLSchema *schema);
+
+/** Function to validate an existing KML struct in the same way as validateKML, using a schema that has already been compiled
+ *@pre 
+    KML struct exists and is not NULL
+    schema exists and is not NULL
+ *@post KML struct has not been modified in any way
+ *@return the boolean and indicating whether the KML struct is valid
+ *@param doc - a pointer to a KML struct
+ *@param schema - the compiled schema to validate against
+ **/
+bool validateKMLWithSchema(const KML *doc, const KMLSchema *schema);
+
+
 /** Function to writing a KML struct into a file in KML format.
+ * The file is written straight from the structs through a fixed size buffer, so memory use does not grow with
+ * the size of the document. If the document cannot be written, the file is not touched.
  *@pre
     KML object exists, is valid, and and is not NULL.
     fileName is not NULL, has the correct extension
@@ -376,6 +740,35 @@ bool validateKML(const KML *doc, const char* schemaFile);
  **/
 bool writeKML(const KML* doc, const char* fileName);
 
+/** Function to write a KML struct into memory, formatted exactly as writeKML writes it to a file.
+ * The document is written straight from the structs into one growing buffer.
+ *@pre KML object exists, is valid, and is not NULL. buffer and length are not NULL
+ *@post
+    - KML has not been modified in any way
+    - on success, *buffer is a NUL terminated string of *length bytes, which the caller must free
+    - on failure, *buffer is NULL and *length is 0
+ *@return a boolean value indicating success or failure of the write
+ *@param
+    - doc - a pointer to a KML struct
+    - buffer - receives the written document
+    - length - receives the length of the written document, without the terminating NUL
+ **/
+bool writeKMLToBuffer(const KML* doc, char** buffer, size_t* length);
+
+/** Function to write a KML struct to an open file descriptor, such as a pipe or socket, formatted exactly as
+ * writeKML writes it to a file. The document is written straight from the structs in large batches.
+ *@pre KML object exists, is valid, and is not NULL. fd is open for writing
+ *@post
+    - KML has not been modified in any way
+    - fd has not been closed. If the document cannot be written, nothing is written to fd. If a write fails
+      part way, what was written before it stays written
+ *@return a boolean value indicating success or failure of the write
+ *@param
+    - doc - a pointer to a KML struct
+    - fd - the file descriptor to write to
+ **/
+bool writeKMLToFd(const KML* doc, int fd);
+
 
 /** Function that returns the length of the path in a PathPlacemark
  *@pre PathPlacemark object exists, is not null, and has not been freed
@@ -385,6 +778,18 @@ bool writeKML(const KML* doc, const char* fileName);
 **/
 double getPathLen(const PathPlacemark *ppm);
 
+/** Function that returns the length, endpoint distance, bounding box and number of coordinates of a path.
+ * The metrics are computed when a file is loaded and cached on the PathPlacemark. They are recomputed on the
+ * next call after the coordinates change through addLineCoordinate, setLineCoordinate or markLineChanged.
+ * Since a recomputation updates the cache, concurrent calls on the same PathPlacemark are only safe while
+ * its coordinates are not being changed.
+ *@pre PathPlacemark object exists, is not null, and has not been freed
+ *@post the cached metrics of the PathPlacemark are up to date
+ *@return the metrics of the path, or all 0 if ppm is NULL
+ *@param ppm - a pointer to a PathPlacemark struct
+**/
+PathMetrics getPathMetrics(const PathPlacemark *ppm);
+
 
 /** Function that checks if the current path is a loop
  *@pre PathPlacemark object exists, is not null
@@ -397,16 +802,525 @@ bool isLoopPath(const PathPlacemark* ppm, double delta);
 
 
 /** Function that returns the the list of paths with the specified length, using the provided tolerance 
- * to compare path lengths
+ * to compare path lengths. A path matches if its length is between len - delta and len + delta.
  *@pre KML struct exists, is not null
  *@post KML struct exists, is not null, has not been modified
- *@return the list of PathPlacemark with the specified length
+ *@return the list of PathPlacemark with the specified length, in document order
  *@param doc - a pointer to a KML struct
  *@param len - search track length
  *@param delta - the tolerance used for comparing track lengths
 **/
 List* getPathsWithLength(const KML *doc, double len, double delta);
 
+/** Function that finds the paths with the specified length without allocating, using the length index of the
+ * document. A path matches if its length is between len - delta and len + delta. The index is kept sorted by
+ * length, so a query takes O(log n + k) time for k matches. Queries never modify the index, so several threads
+ * may run them at once. While the index is not current (see indexKMLLengths), every path is checked instead.
+ *@pre KML struct exists, is not null
+ *@post paths holds the first min(k, maxPaths) matches, from shortest to longest, or in document order if the
+ *      index is not current
+ *@return the number of matching paths k, which may be larger than maxPaths, or -1 if the arguments are invalid
+ *@param doc - a pointer to a KML struct
+ *@param len - search track length
+ *@param delta - the tolerance used for comparing track lengths
+ *@param paths - an array with room for maxPaths pointers. May be NULL if maxPaths is 0.
+ *@param maxPaths - the number of matches to store in paths
+**/
+int findPathsWithLength(const KML *doc, double len, double delta, PathPlacemark **paths, int maxPaths);
+
+/** Function to build the length index used by getPathsWithLength and findPathsWithLength. This is done when a
+ * file is loaded. Changing the coordinates of a path through the library moves its entry to its new place,
+ * in O(n) time. Once a path is inserted into or deleted from doc->pathPlacemarks, queries check every path
+ * until this function is called again.
+ *@pre KML object exists, is not NULL, and has not been freed
+ *@post the length index of the KML struct has been (re)built
+ *@return true on success, false if memory could not be allocated
+ *@param doc - a pointer to a KML struct
+**/
+bool indexKMLLengths(KML *doc);
+
+/* Public API - spatial queries */
+
+/** Callback for kmlQueryBBox. placemark is a PointPlacemark if isPath is false, and a PathPlacemark otherwise.
+ * Return true to continue the query, or false to stop it.
+**/
+typedef bool (*KMLBBoxCallback)(void *placemark, bool isPath, void *userData);
+
+/** Function that calls callback for every placemark in the given bounding box: every PointPlacemark whose
+ * coordinate lies in the box, and every PathPlacemark whose bounding box (see getPathMetrics) intersects it.
+ * Boxes are in degrees and do not wrap around the antimeridian; the edges of the box are included.
+ * The query uses an R-tree bulk loaded with Sort-Tile-Recursive. The first query builds it in O(n log n) time,
+ * and so does the first query after placemarks were inserted, deleted or moved; later queries take about
+ * O(log n) plus the placemarks found. Several threads may query at once: a thread that finds the index stale
+ * builds a new one and publishes it atomically, and the stale one is kept until the document next changes
+ * through the library, since other threads may still be reading it. If memory for the index cannot be
+ * allocated, the query checks every placemark instead, in O(n) time. Placemarks are visited in no
+ * particular order.
+ *@pre KML struct exists, is not null
+ *@post KML struct has not been modified
+ *@return the number of placemarks passed to callback, or -1 if the arguments are invalid
+ *@param doc - a pointer to a KML struct
+ *@param minLon, minLat, maxLon, maxLat - the bounding box
+ *@param callback - the function to call for each placemark in the box
+ *@param userData - passed to callback unchanged
+**/
+int kmlQueryBBox(const KML *doc, double minLon, double minLat, double maxLon, double maxLat, KMLBBoxCallback callback, void *userData);
+
+/** Function to build the spatial index used by kmlQueryBBox, in O(n log n) time, so that the first query does not
+ * pay for it. It must not run concurrently with queries on the same document.
+ *@pre KML object exists, is not NULL, and has not been freed
+ *@post the spatial index of the KML struct has been (re)built
+ *@return true on success, false if memory could not be allocated
+ *@param doc - a pointer to a KML struct
+**/
+bool indexKMLSpatial(KML *doc);
+
+/** Function that moves the Point of a placemark, so that spatial queries see the new position
+ *@pre Point object exists, is not null, and has a coordinate
+ *@post the coordinate of the Point has been replaced
+ *@return true on success, false if point is NULL or has no coordinate
+ *@param point - a pointer to a Point struct
+ *@param longitude, latitude - the new position of the Point
+ *@param altitude - the new altitude of the Point, or DBL_MAX if it has none
+**/
+bool setPointCoordinate(Point *point, double longitude, double latitude, double altitude);
+
+/** Function that marks a Point as changed after its coordinate was modified directly, so that spatial
+ * queries see the new position
+ *@pre Point object exists, is not null
+ *@post the spatial index of the document of the Point has been dropped, and the next query builds it again
+ *@return none
+ *@param point - a pointer to a Point struct
+**/
+void markPointChanged(Point *point);
+
+/* Public API - nearest neighbour search */
+
+//KD-tree over the PointPlacemarks of a document, for nearest neighbour queries. Defined in KMLHelpers.h.
+typedef struct KMLPointTree KMLPointTree;
+
+//A PointPlacemark found by findNearestPoints, and its distance from the query position
+typedef struct {
+    PointPlacemark *placemark;
+
+    //Distance in meters, computed the same way as getPathLen computes the length of a segment
+    double distance;
+} KMLNeighbour;
+
+/** Function to build a KD-tree over the PointPlacemarks of a KML struct. Each point is placed on the unit
+ * sphere, so that neighbours are found by straight-line distance in 3D, which orders points the same way as
+ * their distance along the surface and has no trouble with the poles or the antimeridian.
+ * The tree is a snapshot: it refers to the placemarks but is not updated when they change, and the KML struct
+ * must not be deleted while the tree is in use. Once built, the tree is never modified, so any number of
+ * threads can query it at once.
+ *@pre KML object exists, is not NULL, and has not been freed
+ *@post Either:
+        The tree has been created and its address was returned
+		or 
+		Memory could not be allocated, and NULL was returned
+ *@return the pointer to the new tree or NULL
+ *@param doc - a pointer to a KML struct
+**/
+KMLPointTree* buildKMLPointTree(const KML *doc);
+
+/** Function to delete a KD-tree and free all the memory.
+ *@pre tree exists, is not NULL, has not been freed, and is no longer being used by any thread
+ *@post tree has been freed
+ *@return none
+ *@param tree - a pointer to a KMLPointTree struct
+**/
+void deleteKMLPointTree(KMLPointTree *tree);
+
+/** Function that finds the k PointPlacemarks closest to a position. A query visits O(log n + k) nodes on
+ * typical data and does not allocate.
+ *@pre tree exists and is not NULL
+ *@post results holds the closest min(k, number of points in the tree) PointPlacemarks, nearest first
+ *@return the number of results stored, or -1 if the arguments are invalid
+ *@param tree - a pointer to a KMLPointTree struct
+ *@param longitude, latitude - the query position in degrees
+ *@param k - the number of PointPlacemarks to find
+ *@param results - an array with room for k results
+**/
+int findNearestPoints(const KMLPointTree *tree, double longitude, double latitude, int k, KMLNeighbour *results);
+
+/* Public API - path simplification */
+
+//Algorithms for simplifyPath and simplifyKML
+typedef enum {
+    //Keeps the point farthest from the simplified path until every removed point is within the tolerance
+    KML_SIMPLIFY_DOUGLAS_PEUCKER,
+
+    //Removes the point spanning the smallest triangle with its neighbours while every removed point stays
+    //within the tolerance. Tends to keep the overall shape of a path better at the same tolerance.
+    KML_SIMPLIFY_VISVALINGAM
+} KMLSimplifyAlgorithm;
+
+//What a simplification changed
+typedef struct {
+    //Number of coordinates removed
+    int pointsRemoved;
+
+    //New length of the path(s) minus the old length, in meters. Never positive, up to rounding.
+    double lengthChange;
+} KMLSimplifyResult;
+
+/** Function that removes redundant coordinates from a path. Every removed coordinate is within toleranceMeters
+ * of the simplified path, measured along the surface of the earth, and the first and last coordinates are always
+ * kept. Both algorithms work without recursion, so paths of any length can be simplified.
+ *@pre PathPlacemark object exists, is not null, and has not been freed
+ *@post the coordinates of the path have been reduced and its Line has been marked as changed
+ *@return true on success, false if the arguments are invalid or memory could not be allocated
+ *@param ppm - a pointer to a PathPlacemark struct
+ *@param toleranceMeters - the largest distance a removed coordinate may have from the simplified path
+ *@param algorithm - the simplification algorithm
+ *@param result - receives the number of coordinates removed and the change in length. May be NULL.
+**/
+bool simplifyPath(PathPlacemark *ppm, double toleranceMeters, KMLSimplifyAlgorithm algorithm, KMLSimplifyResult *result);
+
+/** Function that simplifies every path of a KML struct as simplifyPath does, spreading the paths over several
+ * threads. No other thread may use the KML struct while this runs. A document created with KML_PARSE_ARENA
+ * whose paths are compact (see compactLine) is simplified on one thread, since encoding the result allocates
+ * from the arena.
+ *@pre KML object exists, is not NULL, and has not been freed
+ *@post the coordinates of every path have been reduced
+ *@return true on success, false if the arguments are invalid or memory could not be allocated for some path
+ *@param doc - a pointer to a KML struct
+ *@param toleranceMeters - the largest distance a removed coordinate may have from its simplified path
+ *@param algorithm - the simplification algorithm
+ *@param numThreads - the number of threads to use, or 0 to use one per processor
+ *@param result - receives the totals over all paths. May be NULL.
+**/
+bool simplifyKML(KML *doc, double toleranceMeters, KMLSimplifyAlgorithm algorithm, int numThreads, KMLSimplifyResult *result);
+
+/* Public API - level of detail */
+
+/** Function that returns the coordinates of a path to draw at a given ground resolution. Each path has a
+ * pyramid of levels: level 0 holds every coordinate, and level i > 0 holds the coordinates Douglas-Peucker
+ * keeps from level i - 1 at a tolerance of 0.5 * 2^(i - 1) meters, so each level is a subset of the one
+ * below and lies within twice its tolerance of the full path. The coarsest level whose tolerance is at most
+ * metersPerPixel is returned, picked in constant time.
+ * The pyramid is built on the first call for a path, or by buildKMLLod, and rebuilt after its coordinates
+ * change. Calls for the same path may run concurrently with each other and with a background build, but
+ * not with changes to the path.
+ *@pre PathPlacemark object exists, is not null, and has not been freed
+ *@post the pyramid of the path has been built if it was missing or stale
+ *@return the indices of the coordinates in the level, in path order, or NULL if ppm is NULL or memory could
+ *        not be allocated. The array belongs to the Line and is valid until the path changes or is deleted.
+ *        A change through the library frees it at once. After a change the library does not see, such as a
+ *        hand-edited coordinates list, the next lookup builds a new pyramid but keeps the stale array alive
+ *        until the next change through the library or deleteKML.
+ *@param ppm - a pointer to a PathPlacemark struct
+ *@param metersPerPixel - the ground resolution the path is drawn at
+ *@param count - receives the number of indices in the level
+**/
+const int* getPathLOD(const PathPlacemark *ppm, double metersPerPixel, int *count);
+
+/** Function that builds the level of detail pyramid of every path in a KML struct, either before returning
+ * or on a background thread. While a background build runs, getPathLOD can be called from any thread, but
+ * the paths must not be changed until waitKMLLod has returned. deleteKML stops a background build itself.
+ *@pre KML object exists, is not NULL, and has not been freed
+ *@post the pyramids have been built, or are being built
+ *@return true on success, false if the build could not be started or memory could not be allocated
+ *@param doc - a pointer to a KML struct
+ *@param background - true to build on a new thread and return at once
+**/
+bool buildKMLLod(KML *doc, bool background);
+
+/** Function that waits for a background build started by buildKMLLod to finish
+ *@pre KML object exists, is not NULL, and has not been freed
+ *@post no background build is running for the KML struct
+ *@return none
+ *@param doc - a pointer to a KML struct
+**/
+void waitKMLLod(KML *doc);
+
+/* Public API - Line coordinate access */
+
+/** Function that returns the number of coordinates in a Line
+ *@pre Line object exists, is not null
+ *@post Line object has not been modified in any way
+ *@return the number of coordinates in the path
+ *@param line - a pointer to a Line struct
+**/
+int getNumCoordinates(const Line *line);
+
+/** Function that returns the coordinate at the specified index in a Line
+ *@pre Line object exists, is not null, and index is between 0 and getNumCoordinates(line) - 1
+ *@post Line object has not been modified in any way
+ *@return a copy of the coordinate, or a coordinate at -1, -1 with no altitude (as for an unreadable
+ *        <coordinates> element) if line is NULL or index is out of range
+ *@param line - a pointer to a Line struct
+ *@param index - the index of the coordinate
+**/
+Coordinate getLineCoordinate(const Line *line, int index);
+
+/** Function that appends a coordinate to the end of a Line
+ *@pre Line object exists, is not null
+ *@post the coordinate has been added to the end of the path
+ *@return true on success, false if memory could not be allocated
+ *@param line - a pointer to a Line struct
+ *@param longitude, latitude - the position of the new coordinate
+ *@param altitude - the altitude of the new coordinate, or DBL_MAX if it has none
+**/
+bool addLineCoordinate(Line *line, double longitude, double latitude, double altitude);
+
+/** Function that replaces the coordinate at the specified index in a Line
+ *@pre Line object exists, is not null
+ *@post the coordinate at index has been replaced and the Line has been marked as changed
+ *@return true on success, false if index is not between 0 and getNumCoordinates(line) - 1
+ *@param line - a pointer to a Line struct
+ *@param index - the index of the coordinate to replace
+ *@param longitude, latitude - the new position of the coordinate
+ *@param altitude - the new altitude of the coordinate, or DBL_MAX if it has none
+**/
+bool setLineCoordinate(Line *line, int index, double longitude, double latitude, double altitude);
+
+/** Function that marks a Line as changed after its points buffer was modified directly, so that cached
+ * PathMetrics are recomputed, line->coordinates is brought back in step and the path moves to its new place
+ * in the length index of its document. Only the arrays of a buffer stored
+ * as KML_COORDINATES_DOUBLE may be modified directly; convert compact Lines back with compactLine first.
+ * If line->coordinates was changed as well, the list wins and is adopted as the coordinates of the path.
+ *@pre Line object exists, is not null
+ *@post the version of the Line has been incremented
+ *@return none
+ *@param line - a pointer to a Line struct
+**/
+void markLineChanged(Line *line);
+
+/** Function that returns the coordinates of a Line as a List of Coordinate structs, for code written
+ * against the List representation. This is line->coordinates, filled with a Coordinate and a list node per
+ * point on the first call, and kept in step with the packed coordinates from then on. compactLine empties it again.
+ *@pre Line object exists, is not null
+ *@post line->coordinates holds one Coordinate for every coordinate in the path
+ *@return line->coordinates. The list is owned by the Line and must not be freed by the caller.
+ *@param line - a pointer to a Line struct
+**/
+List* getLineCoordinates(Line *line);
+
+/* Public API - compact coordinates */
+
+//Number of coordinates a KMLCoordinateIterator decodes at a time.
+#define KML_COORDINATE_BLOCK 256
+
+//Reads the coordinates of a Line in order, whatever their encoding. Set up with initCoordinateIterator.
+typedef struct {
+    //The block returned by the last call to nextCoordinateBlock. These point into the Line for
+    //KML_COORDINATES_DOUBLE, and into the arrays below otherwise.
+    const double *longitudes;
+    const double *latitudes;
+    const double *altitudes;
+
+    //Number of coordinates in the block, and how many of them nextCoordinate has returned.
+    int count;
+    int position;
+
+    //The rest is private to the iterator.
+    const CoordinateBuffer *buffer;
+    int next;
+    double blockLongitudes[KML_COORDINATE_BLOCK];
+    double blockLatitudes[KML_COORDINATE_BLOCK];
+    double blockAltitudes[KML_COORDINATE_BLOCK];
+} KMLCoordinateIterator;
+
+/** Function that converts the coordinates of a Line to another encoding.
+ * KML_COORDINATES_FIXED stores a coordinate in 8 bytes, or 12 if the path has altitudes, instead of 24. Longitude
+ * and latitude are rounded to the nearest 1e-7 degrees (at most 5.6 mm on the ground) and altitudes to the nearest
+ * millimetre, so coordinates written with at most 7 and 3 decimals come back as exactly the doubles they were
+ * parsed to. KML_COORDINATES_DELTA stores the same values as zigzag varint deltas from the previous coordinate,
+ * which takes 2 to 4 bytes per coordinate for a typical GPS track. It restarts every KML_COORDINATE_BLOCK
+ * coordinates, so getLineCoordinate decodes at most one block, but is meant for paths that are mostly read in
+ * order. Compact paths are read through the same functions as others; addLineCoordinate and setLineCoordinate
+ * convert them back to KML_COORDINATES_DOUBLE first, and simplifyPath keeps their encoding.
+ *@pre Line object exists, is not null
+ *@post the coordinates are stored in the given encoding. Converting to a compact encoding empties the list
+ *      getLineCoordinates filled, which it fills again if called, and converting from KML_COORDINATES_DOUBLE
+ *      marks the Line as changed, since it rounds the coordinates.
+ *@return true on success, false if a coordinate is outside the range of the encoding (longitude or latitude
+ *        beyond +-214 degrees, altitude beyond +-2147 km, or not finite) or memory could not be allocated,
+ *        in which case the Line is left unchanged
+ *@param line - a pointer to a Line struct
+ *@param encoding - the new encoding
+**/
+bool compactLine(Line *line, KMLCoordinateEncoding encoding);
+
+/** Function that converts the coordinates of every path in a KML struct to another encoding, as compactLine
+ *@pre KML object exists, is not NULL, and has not been freed
+ *@post every path that could be converted has been
+ *@return true if every path was converted
+ *@param doc - a pointer to a KML struct
+ *@param encoding - the new encoding
+**/
+bool compactKML(KML *doc, KMLCoordinateEncoding encoding);
+
+/** Function that returns the number of bytes used to store the coordinates of a Line, counting the Coordinates
+ * and nodes of the line->coordinates list once getLineCoordinates has filled it
+ *@pre Line object exists, is not null
+ *@post Line object has not been modified in any way
+ *@return the size of the coordinate storage in bytes
+ *@param line - a pointer to a Line struct
+**/
+size_t getLineCoordinateBytes(const Line *line);
+
+/** Function that sets up an iterator over the coordinates of a Line. The Line must not be modified while
+ * the iterator is in use.
+ *@pre Line object exists, is not null
+ *@post iter is positioned before the first coordinate
+ *@return none
+ *@param iter - a pointer to the iterator
+ *@param line - a pointer to a Line struct
+**/
+void initCoordinateIterator(KMLCoordinateIterator *iter, const Line *line);
+
+/** Function that decodes the next block of coordinates, for code that processes whole arrays at a time such as
+ * path kernels. A Line stored as KML_COORDINATES_DOUBLE is returned as a single block without copying; compact
+ * ones are decoded KML_COORDINATE_BLOCK coordinates at a time. Do not mix with nextCoordinate.
+ *@pre iter was set up with initCoordinateIterator
+ *@post iter->longitudes, iter->latitudes and iter->altitudes hold the block
+ *@return the number of coordinates in the block, or 0 once every coordinate has been returned
+ *@param iter - a pointer to the iterator
+**/
+int nextCoordinateBlock(KMLCoordinateIterator *iter);
+
+/** Function that returns the next coordinate of a Line
+ *@pre iter was set up with initCoordinateIterator
+ *@post iter has moved past the coordinate
+ *@return true if a coordinate was stored in coordinate, false once every coordinate has been returned
+ *@param iter - a pointer to the iterator
+ *@param coordinate - receives the coordinate
+**/
+bool nextCoordinate(KMLCoordinateIterator *iter, Coordinate *coordinate);
+
+/* Public API - in-memory and mapped input */
+
+/** Function to create a KML struct in the same way as createKML, from a KML document held in memory.
+ * The buffer does not need to be null terminated.
+ *@pre buffer is not NULL and holds length bytes. length is at most INT_MAX
+ *@post The buffer has not been modified in any way
+        Also, either:
+        A valid KML struct has been created and its address was returned
+		or 
+		An error occurred, and NULL was returned
+ *@return the pointer to the new struct or NULL
+ *@param buffer - the contents of a KML file
+ *@param length - the number of bytes in buffer
+**/
+KML* createKMLFromMemory(const char *buffer, size_t length);
+
+/** Function to create a KML struct in the same way as createValidKML, from a KML document held in memory.
+ *@pre buffer is not NULL and holds length bytes. length is at most INT_MAX.
+       Schema file name is not NULL/empty, and represents a valid schema file
+ *@post Either:
+        A valid KML struct has been created and its address was returned
+		or 
+		An error occurred, or the document was invalid, and NULL was returned
+ *@return the pointer to the new struct or NULL
+ *@param buffer - the contents of a KML file
+ *@param length - the number of bytes in buffer
+ *@param schemaFile - the name of a schema file
+**/
+KML* createValidKMLFromMemory(const char *buffer, size_t length, const char *schemaFile);
+
+/** Function to create a KML struct in the same way as createKML, parsing the file straight from a read-only
+ * memory mapping of it instead of reading it through a buffer. Files too large to map in one piece are read as
+ * createKML does.
+ *@pre File name cannot be an empty string or NULL.
+       File represented by this name must exist and must be readable.
+ *@post Either:
+        A valid KML struct has been created and its address was returned
+		or 
+		An error occurred, and NULL was returned
+ *@return the pointer to the new struct or NULL
+ *@param fileName - a string containing the name of the KML file
+**/
+KML* createKMLMapped(const char *fileName);
+
+/** Function to create a KML struct in the same way as createValidKML, from a memory mapping of the file.
+ *@pre File name cannot be an empty string or NULL.
+       File represented by this name must exist and must be readable.
+       Schema file name is not NULL/empty, and represents a valid schema file
+ *@post Either:
+        A valid KML struct has been created and its address was returned
+		or 
+		An error occurred, or KML file was invalid, and NULL was returned
+ *@return the pointer to the new struct or NULL
+ *@param fileName - a string containing the name of the KML file
+ *@param schemaFile - the name of a schema file
+**/
+KML* createValidKMLMapped(const char *fileName, const char *schemaFile);
+
+/* Public API - parser contexts */
+
+//State kept between loads, so that loading many files one after another only resets it instead of setting it up
+//again: a libxml2 parser context, a schema validation context, a scratch buffer for coordinates and a spare arena.
+//A KMLParserCtx must only be used by one thread at a time.
+typedef struct KMLParserCtx KMLParserCtx;
+
+/** Function to create a parser context
+ *@pre schema is NULL, or exists and stays alive as long as the context
+ *@post Either:
+        The context has been created and its address was returned
+		or 
+		Memory could not be allocated, and NULL was returned
+ *@return the pointer to the new context or NULL
+ *@param schema - the compiled schema to validate against as createValidKMLWithSchema does, or NULL to load as createKML does
+ *@param flags - a combination of the KML_PARSE_* flags, used for every file loaded with the context
+**/
+KMLParserCtx* createKMLParserCtx(const KMLSchema *schema, int flags);
+
+/** Function to delete a parser context and free all the memory. KML structs loaded with it are not affected.
+ *@pre ctx is NULL, or exists and has not been freed
+ *@post ctx has been freed
+ *@return none
+ *@param ctx - a pointer to a KMLParserCtx
+**/
+void deleteKMLParserCtx(KMLParserCtx *ctx);
+
+/** Function to create a KML struct from a file with a parser context. The result is the same as that of
+ * createKMLWithFlags, or of createValidKMLWithSchema if the context has a schema, and is deleted with deleteKML
+ * or recycleKML. With KML_PARSE_STREAM only the schema is reused.
+ *@pre ctx exists and is not NULL. File name cannot be an empty string or NULL
+ *@post Either:
+        A valid KML struct has been created and its address was returned
+		or 
+		An error occurred, or KML file was invalid, and NULL was returned
+ *@return the pointer to the new struct or NULL
+ *@param ctx - a pointer to a KMLParserCtx
+ *@param fileName - a string containing the name of the KML file
+**/
+KML* createKMLWithCtx(KMLParserCtx *ctx, const char *fileName);
+
+/** Function to delete a KML struct like deleteKML, keeping the memory of its arena in ctx for the next load.
+ * Documents loaded without KML_PARSE_ARENA are simply deleted.
+ *@pre doc is NULL, or exists and is not used by any thread. ctx is NULL, or is not being used by another thread
+ *@post doc has been freed
+ *@return none
+ *@param ctx - the context to keep the arena in, or NULL to delete doc as deleteKML does
+ *@param doc - a pointer to a KML struct
+**/
+void recycleKML(KMLParserCtx *ctx, KML *doc);
+
+/* Public API - batch loading */
+
+//Called by createKMLBatch once for every file, on whichever thread loaded it. doc is the new KML struct, which the
+//callback takes ownership of, or NULL if the file could not be loaded or was invalid.
+typedef void (*KMLBatchCallback)(int index, const char *fileName, KML *doc, void *userData);
+
+/** Function that loads many KML files at once, spreading them over several threads. Each thread takes the next
+ * file as soon as it is done with the previous one, and keeps its libxml2 parser and validation contexts from
+ * one file to the next. Files are validated against the one compiled schema shared by all threads.
+ *@pre fileNames holds numFiles file names. If schema is not NULL, it stays alive until this returns
+ *@post callback has been called exactly once for every file, from several threads at once, in no particular order
+ *@return the number of files loaded, or -1 if the arguments are invalid
+ *@param fileNames - the names of the KML files
+ *@param numFiles - the number of files
+ *@param schema - the compiled schema to validate against as createValidKMLWithSchema does, or NULL to load as createKML does
+ *@param flags - a combination of the KML_PARSE_* flags
+ *@param numThreads - the number of threads to use, or 0 to use one per processor
+ *@param callback - receives each KML struct, or NULL for each file that failed. Must be thread safe
+ *@param userData - passed to callback
+**/
+int createKMLBatch(const char * const *fileNames, int numFiles, const KMLSchema *schema, int flags, int numThreads, KMLBatchCallback callback, void *userData);
+
 void deleteKMLElement( void* data);
 char* KMLElementToString( void* data);
 int compareKMLElements(const void *first, const void *second);
@@ -34,6 +34,9 @@ typedef struct listHead{
     Node* head;
     Node* tail;
     int length;
+    //Incremented by every function that adds or removes nodes, so that code caching information about the
+    //list can tell whether it has changed
+    unsigned long modifications;
     void (*deleteData)(void* toBeDeleted);
     int (*compare)(const void* first,const void* second);
     char* (*printData)(void* toBePrinted);
@@ -0,0 +1,179 @@
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+
+// Every allocation is rounded up to this many bytes so that any struct can be placed in a chunk.
+#define ARENA_ALIGNMENT 16
+
+KMLArena * initArena(size_t chunkSize) {
+    KMLArena * arena = malloc(sizeof(KMLArena));
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    arena->chunks = NULL;
+    arena->spare = NULL;
+    arena->chunkSize = chunkSize;
+
+    return arena;
+}
+
+void * arenaAlloc(KMLArena * arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+
+    // Bump the pointer in the current chunk if there is room.
+    ArenaChunk * chunk = arena->chunks;
+    if (chunk != NULL && chunk->size - chunk->used >= size) {
+        void * p = chunk->data + chunk->used;
+        chunk->used += size;
+        return p;
+    }
+
+    // Otherwise start a new chunk, reusing one kept by resetArena if it is large enough. Requests larger
+    // than a chunk get a chunk of their own.
+    size_t chunkSize = size > arena->chunkSize ? size : arena->chunkSize;
+    if (arena->spare != NULL && arena->spare->size >= size) {
+        chunk = arena->spare;
+        arena->spare = chunk->next;
+        chunkSize = chunk->size;
+    } else {
+        chunk = malloc(sizeof(ArenaChunk) + chunkSize);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->size = chunkSize;
+    }
+    chunk->used = size;
+
+    // Keep the chunk with the most free space at the front, so that one oversized
+    // request does not strand the rest of the current chunk.
+    if (arena->chunks != NULL && chunkSize - size < arena->chunks->size - arena->chunks->used) {
+        chunk->next = arena->chunks->next;
+        arena->chunks->next = chunk;
+    } else {
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    return chunk->data;
+}
+
+static void freeChunks(ArenaChunk * chunk) {
+    while (chunk != NULL) {
+        ArenaChunk * next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+void resetArena(KMLArena * arena) {
+    // Regular chunks are kept for reuse. Oversized ones were sized for one request and are released.
+    ArenaChunk * chunk = arena->chunks;
+    while (chunk != NULL) {
+        ArenaChunk * next = chunk->next;
+        if (chunk->size == arena->chunkSize) {
+            chunk->next = arena->spare;
+            arena->spare = chunk;
+        } else {
+            free(chunk);
+        }
+        chunk = next;
+    }
+    arena->chunks = NULL;
+}
+
+void freeArena(KMLArena * arena) {
+    if (arena == NULL) {
+        return;
+    }
+
+    freeChunks(arena->chunks);
+    freeChunks(arena->spare);
+    free(arena);
+}
+
+void * kmlMalloc(KMLArena * arena, size_t size) {
+    if (arena == NULL) {
+        return malloc(size);
+    }
+
+    return arenaAlloc(arena, size);
+}
+
+char * kmlStrdup(KMLArena * arena, const char * str) {
+    size_t len = strlen(str) + 1;
+    char * copy = kmlMalloc(arena, len);
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+    }
+
+    return copy;
+}
+
+void kmlFree(KMLArena * arena, void * p) {
+    // Arena memory is only released with the whole arena.
+    if (arena == NULL) {
+        free(p);
+    }
+}
+
+List * kmlInitializeList(KMLArena * arena, char* (*printFunction)(void* toBePrinted), void (*deleteFunction)(void* toBeDeleted), int (*compareFunction)(const void* first, const void* second)) {
+    if (arena == NULL) {
+        return initializeList(printFunction, deleteFunction, compareFunction);
+    }
+
+    List * list = arenaAlloc(arena, sizeof(List));
+    if (list == NULL) {
+        return NULL;
+    }
+
+    list->head = NULL;
+    list->tail = NULL;
+    list->length = 0;
+    list->modifications = 0;
+    list->deleteData = deleteFunction;
+    list->compare = compareFunction;
+    list->printData = printFunction;
+
+    return list;
+}
+
+void kmlInsertBack(KMLArena * arena, List * list, void * toBeAdded) {
+    if (arena == NULL) {
+        insertBack(list, toBeAdded);
+        return;
+    }
+
+    if (list == NULL || toBeAdded == NULL) {
+        return;
+    }
+
+    Node * node = arenaAlloc(arena, sizeof(Node));
+    if (node == NULL) {
+        return;
+    }
+    node->data = toBeAdded;
+    node->next = NULL;
+    node->previous = list->tail;
+
+    if (list->tail == NULL) {
+        list->head = node;
+    } else {
+        list->tail->next = node;
+    }
+    list->tail = node;
+    list->length++;
+    list->modifications++;
+}
+
+void kmlClearList(KMLArena * arena, List * list) {
+    if (arena == NULL) {
+        clearList(list);
+        return;
+    }
+
+    // The nodes and their data stay in the arena until the document is deleted.
+    list->head = NULL;
+    list->tail = NULL;
+    list->length = 0;
+    list->modifications++;
+}
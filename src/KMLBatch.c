@@ -0,0 +1,108 @@
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+
+// Work shared by the threads of createKMLBatch. Each thread takes the next file until none are left.
+typedef struct {
+    const char * const * fileNames;
+    int numFiles;
+    int next;
+    const KMLSchema * schema;
+    int flags;
+    KMLBatchCallback callback;
+    void * userData;
+} BatchJob;
+
+// State a thread keeps from one file to the next, so that each load only resets it.
+typedef struct {
+    BatchJob * job;
+    KMLParserCtx * ctx;
+    int loaded;
+} BatchWorker;
+
+static void * loadBatchFiles(void * data) {
+    BatchWorker * worker = (BatchWorker *) data;
+    BatchJob * job = worker->job;
+
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->numFiles) {
+        KML * kml = NULL;
+        if (job->fileNames[i] != NULL && worker->ctx != NULL) {
+            kml = createKMLWithCtx(worker->ctx, job->fileNames[i]);
+        }
+        if (kml != NULL) {
+            worker->loaded++;
+        }
+        job->callback(i, job->fileNames[i], kml, job->userData);
+    }
+
+    return NULL;
+}
+
+static void initBatchWorker(BatchWorker * worker, BatchJob * job) {
+    worker->job = job;
+    worker->loaded = 0;
+    worker->ctx = createKMLParserCtx(job->schema, job->flags);
+}
+
+static void freeBatchWorker(BatchWorker * worker) {
+    deleteKMLParserCtx(worker->ctx);
+}
+
+int createKMLBatch(const char * const * fileNames, int numFiles, const KMLSchema * schema, int flags, int numThreads, KMLBatchCallback callback, void * userData) {
+    if (fileNames == NULL || numFiles < 0 || callback == NULL) {
+        return -1;
+    }
+
+    if (numThreads <= 0) {
+        numThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (numThreads > numFiles) {
+        numThreads = numFiles;
+    }
+    if (numThreads < 1) {
+        numThreads = 1;
+    }
+
+    BatchWorker * workers = calloc(numThreads, sizeof(BatchWorker));
+    pthread_t * threads = malloc(numThreads * sizeof(pthread_t));
+    if (workers == NULL || threads == NULL) {
+        free(workers);
+        free(threads);
+        return -1;
+    }
+
+    BatchJob job;
+    job.fileNames = fileNames;
+    job.numFiles = numFiles;
+    job.next = 0;
+    job.schema = schema;
+    job.flags = flags;
+    job.callback = callback;
+    job.userData = userData;
+
+    // The calling thread is the first worker. If a thread cannot be started, the others pick up its share.
+    int started = 1;
+    initBatchWorker(&workers[0], &job);
+    for (int t = 1; t < numThreads; t++) {
+        initBatchWorker(&workers[started], &job);
+        if (pthread_create(&threads[started], NULL, &loadBatchFiles, &workers[started]) != 0) {
+            freeBatchWorker(&workers[started]);
+            break;
+        }
+        started++;
+    }
+    loadBatchFiles(&workers[0]);
+
+    int loaded = workers[0].loaded;
+    freeBatchWorker(&workers[0]);
+    for (int t = 1; t < started; t++) {
+        pthread_join(threads[t], NULL);
+        loaded += workers[t].loaded;
+        freeBatchWorker(&workers[t]);
+    }
+
+    free(workers);
+    free(threads);
+
+    return loaded;
+}
@@ -0,0 +1,435 @@
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+
+// Fixed point units: 1e-7 degrees for longitude and latitude, millimetres for altitude.
+#define DEGREE_SCALE 1e7
+#define ALTITUDE_SCALE 1e3
+
+// Stored in place of a missing altitude. Real altitudes are never rounded to it.
+#define NO_ALTITUDE INT32_MIN
+
+// A zigzag varint of the difference of two int32 values takes at most 5 bytes.
+#define MAX_VARINT_SIZE 5
+
+/*
+ * KML_COORDINATES_FIXED: int32 longitudes[length], int32 latitudes[length] and, if hasAltitudes,
+ * int32 altitudes[length].
+ *
+ * KML_COORDINATES_DELTA: a uint32 offset into packed for every block of KML_COORDINATE_BLOCK
+ * coordinates, followed by the blocks. A block holds, for each coordinate, the zigzag varint
+ * difference of its longitude, latitude and (if hasAltitudes) altitude from those of the previous
+ * coordinate, where the coordinate before the first one of a block is taken to be 0, 0, 0.
+ * Decoding can then start at any block.
+*/
+
+static int numBlocks(int length) {
+    return (length + KML_COORDINATE_BLOCK - 1) / KML_COORDINATE_BLOCK;
+}
+
+// Rounds value * scale to an int32, or returns false if it does not fit or is not finite.
+static bool quantize(double value, double scale, int32_t * q) {
+    double scaled = round(value * scale);
+    if (!(scaled > INT32_MIN && scaled <= INT32_MAX)) {
+        return false;
+    }
+    *q = (int32_t) scaled;
+
+    return true;
+}
+
+static unsigned char * putVarint(unsigned char * out, int64_t value) {
+    uint64_t zigzag = ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+    while (zigzag >= 0x80) {
+        *out++ = (unsigned char) (zigzag | 0x80);
+        zigzag >>= 7;
+    }
+    *out++ = (unsigned char) zigzag;
+
+    return out;
+}
+
+static const unsigned char * getVarint(const unsigned char * in, int64_t * value) {
+    uint64_t zigzag = 0;
+    int shift = 0;
+    unsigned char byte;
+    do {
+        byte = *in++;
+        zigzag |= (uint64_t) (byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    *value = (int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1);
+
+    return in;
+}
+
+static double toAltitude(int64_t q) {
+    return q == NO_ALTITUDE ? DBL_MAX : q / ALTITUDE_SCALE;
+}
+
+// Decodes count coordinates of a compact buffer starting at start, which must be the start of a block for
+// KML_COORDINATES_DELTA, into the three arrays.
+static void decodeRange(const CoordinateBuffer * buffer, int start, int count, double * longitudes, double * latitudes, double * altitudes) {
+    // Dividing rather than multiplying by 1e-7 gives the double nearest to the decimal value, which is
+    // what strtod returns for it, so coordinates with at most 7 decimals survive compaction exactly.
+    if (buffer->encoding == KML_COORDINATES_FIXED) {
+        const int32_t * q = (const int32_t *) buffer->packed;
+        const int32_t * qLongitudes = q + start;
+        const int32_t * qLatitudes = q + buffer->length + start;
+        for (int i = 0; i < count; i++) {
+            longitudes[i] = qLongitudes[i] / DEGREE_SCALE;
+            latitudes[i] = qLatitudes[i] / DEGREE_SCALE;
+        }
+
+        if (buffer->hasAltitudes) {
+            const int32_t * qAltitudes = q + 2 * buffer->length + start;
+            for (int i = 0; i < count; i++) {
+                altitudes[i] = toAltitude(qAltitudes[i]);
+            }
+        } else {
+            for (int i = 0; i < count; i++) {
+                altitudes[i] = DBL_MAX;
+            }
+        }
+        return;
+    }
+
+    const uint32_t * offsets = (const uint32_t *) buffer->packed;
+    const unsigned char * in = buffer->packed + offsets[start / KML_COORDINATE_BLOCK];
+    int64_t longitude = 0, latitude = 0, altitude = 0;
+    for (int i = 0; i < count; i++) {
+        int64_t delta;
+        in = getVarint(in, &delta);
+        longitude += delta;
+        in = getVarint(in, &delta);
+        latitude += delta;
+        longitudes[i] = longitude / DEGREE_SCALE;
+        latitudes[i] = latitude / DEGREE_SCALE;
+
+        altitudes[i] = DBL_MAX;
+        if (buffer->hasAltitudes) {
+            in = getVarint(in, &delta);
+            altitude += delta;
+            altitudes[i] = toAltitude(altitude);
+        }
+    }
+}
+
+bool decodeCoordinateBuffer(const CoordinateBuffer * buffer, CoordinateBuffer * decoded) {
+    initCoordinateBuffer(decoded, NULL);
+    if (buffer->length == 0) {
+        return true;
+    }
+
+    int length = buffer->length;
+    decoded->longitudes = malloc(length * sizeof(double));
+    decoded->latitudes = malloc(length * sizeof(double));
+    decoded->altitudes = malloc(length * sizeof(double));
+    if (decoded->longitudes == NULL || decoded->latitudes == NULL || decoded->altitudes == NULL) {
+        freeCoordinateBuffer(decoded);
+        return false;
+    }
+    decoded->length = length;
+    decoded->capacity = length;
+
+    if (buffer->encoding == KML_COORDINATES_DOUBLE) {
+        memcpy(decoded->longitudes, buffer->longitudes, length * sizeof(double));
+        memcpy(decoded->latitudes, buffer->latitudes, length * sizeof(double));
+        memcpy(decoded->altitudes, buffer->altitudes, length * sizeof(double));
+        return true;
+    }
+
+    for (int start = 0; start < length; start += KML_COORDINATE_BLOCK) {
+        int count = length - start < KML_COORDINATE_BLOCK ? length - start : KML_COORDINATE_BLOCK;
+        decodeRange(buffer, start, count, decoded->longitudes + start, decoded->latitudes + start, decoded->altitudes + start);
+    }
+
+    return true;
+}
+
+Coordinate decodeCoordinate(const CoordinateBuffer * buffer, int index) {
+    Coordinate c;
+    if (buffer->encoding == KML_COORDINATES_DOUBLE) {
+        c.longitude = buffer->longitudes[index];
+        c.latitude = buffer->latitudes[index];
+        c.altitude = buffer->altitudes[index];
+    } else if (buffer->encoding == KML_COORDINATES_FIXED) {
+        decodeRange(buffer, index, 1, &c.longitude, &c.latitude, &c.altitude);
+    } else {
+        // Decode the block up to index.
+        double longitudes[KML_COORDINATE_BLOCK];
+        double latitudes[KML_COORDINATE_BLOCK];
+        double altitudes[KML_COORDINATE_BLOCK];
+        int start = index - index % KML_COORDINATE_BLOCK;
+        decodeRange(buffer, start, index - start + 1, longitudes, latitudes, altitudes);
+        c.longitude = longitudes[index - start];
+        c.latitude = latitudes[index - start];
+        c.altitude = altitudes[index - start];
+    }
+
+    return c;
+}
+
+// Encodes the quantized values q (longitudes, latitudes and then altitudes, as for KML_COORDINATES_FIXED)
+// as KML_COORDINATES_DELTA into out, which must have room for the worst case. Returns the encoded size.
+static size_t encodeDeltas(const int32_t * q, int length, bool hasAltitudes, unsigned char * out) {
+    uint32_t * offsets = (uint32_t *) out;
+    unsigned char * pos = out + numBlocks(length) * sizeof(uint32_t);
+    for (int i = 0; i < length; i++) {
+        if (i % KML_COORDINATE_BLOCK == 0) {
+            offsets[i / KML_COORDINATE_BLOCK] = (uint32_t) (pos - out);
+        }
+
+        bool first = i % KML_COORDINATE_BLOCK == 0;
+        pos = putVarint(pos, (int64_t) q[i] - (first ? 0 : q[i - 1]));
+        pos = putVarint(pos, (int64_t) q[length + i] - (first ? 0 : q[length + i - 1]));
+        if (hasAltitudes) {
+            pos = putVarint(pos, (int64_t) q[2 * length + i] - (first ? 0 : q[2 * length + i - 1]));
+        }
+    }
+
+    return pos - out;
+}
+
+bool encodeCoordinateBuffer(const CoordinateBuffer * source, KMLCoordinateEncoding encoding, KMLArena * arena, CoordinateBuffer * encoded) {
+    if ((encoding != KML_COORDINATES_FIXED && encoding != KML_COORDINATES_DELTA) || source->encoding != KML_COORDINATES_DOUBLE) {
+        return false;
+    }
+
+    int length = source->length;
+    int32_t * q = malloc(3 * (size_t) length * sizeof(int32_t) + 1);
+    bool ok = q != NULL;
+    bool hasAltitudes = false;
+    for (int i = 0; ok && i < length; i++) {
+        ok = quantize(source->longitudes[i], DEGREE_SCALE, &q[i]) && quantize(source->latitudes[i], DEGREE_SCALE, &q[length + i]);
+
+        q[2 * length + i] = NO_ALTITUDE;
+        if (ok && source->altitudes[i] != DBL_MAX) {
+            ok = quantize(source->altitudes[i], ALTITUDE_SCALE, &q[2 * length + i]);
+            hasAltitudes = true;
+        }
+    }
+
+    // The offsets of the blocks are 32 bits, which limits a DELTA buffer to 4 GB.
+    size_t maxSize = numBlocks(length) * sizeof(uint32_t) + (size_t) length * 3 * MAX_VARINT_SIZE;
+    if (encoding == KML_COORDINATES_DELTA && maxSize > UINT32_MAX) {
+        ok = false;
+    }
+
+    unsigned char * packed = NULL;
+    size_t packedSize = 0;
+    if (ok && length > 0) {
+        if (encoding == KML_COORDINATES_FIXED) {
+            packedSize = (size_t) length * (hasAltitudes ? 3 : 2) * sizeof(int32_t);
+            packed = kmlMalloc(arena, packedSize);
+            if (packed != NULL) {
+                memcpy(packed, q, packedSize);
+            }
+        } else {
+            unsigned char * scratch = malloc(maxSize);
+            if (scratch != NULL) {
+                packedSize = encodeDeltas(q, length, hasAltitudes, scratch);
+                packed = kmlMalloc(arena, packedSize);
+                if (packed != NULL) {
+                    memcpy(packed, scratch, packedSize);
+                }
+            }
+            free(scratch);
+        }
+        ok = packed != NULL;
+    }
+    free(q);
+    if (!ok) {
+        return false;
+    }
+
+    initCoordinateBuffer(encoded, arena);
+    encoded->length = length;
+    encoded->encoding = encoding;
+    encoded->packed = packed;
+    encoded->packedSize = packedSize;
+    encoded->hasAltitudes = hasAltitudes;
+
+    return true;
+}
+
+bool packCoordinateBuffer(CoordinateBuffer * buffer, KMLCoordinateEncoding encoding, KMLArena * arena) {
+    // Quantize from doubles, decoding a compact buffer first.
+    CoordinateBuffer decoded;
+    const CoordinateBuffer * source = buffer;
+    if (buffer->encoding != KML_COORDINATES_DOUBLE) {
+        if (!decodeCoordinateBuffer(buffer, &decoded)) {
+            return false;
+        }
+        source = &decoded;
+    }
+
+    CoordinateBuffer encoded;
+    bool ok = encodeCoordinateBuffer(source, encoding, arena, &encoded);
+    if (source == &decoded) {
+        freeCoordinateBuffer(&decoded);
+    }
+    if (!ok) {
+        return false;
+    }
+
+    freeCoordinateBuffer(buffer);
+    *buffer = encoded;
+
+    return true;
+}
+
+bool unpackCoordinateBuffer(CoordinateBuffer * buffer) {
+    if (buffer->encoding == KML_COORDINATES_DOUBLE) {
+        return true;
+    }
+
+    CoordinateBuffer decoded;
+    if (!decodeCoordinateBuffer(buffer, &decoded)) {
+        return false;
+    }
+
+    // Move the arrays to where the packed bytes came from.
+    KMLArena * arena = buffer->arena;
+    shrinkCoordinateBuffer(&decoded, arena);
+    if (decoded.length > 0 && decoded.longitudes == NULL) {
+        return false;
+    }
+
+    freeCoordinateBuffer(buffer);
+    *buffer = decoded;
+
+    return true;
+}
+
+// compactLine without updating the length index of the document, for compactKML.
+static bool packLine(Line * line, KMLCoordinateEncoding encoding) {
+
+    adoptCoordinateList(line);
+    CoordinateBuffer * buffer = &line->points;
+    if (buffer->encoding == encoding) {
+        return true;
+    }
+    if (encoding == KML_COORDINATES_DOUBLE) {
+        return unpackCoordinateBuffer(buffer);
+    }
+
+    bool rounded = buffer->encoding == KML_COORDINATES_DOUBLE;
+    if (!packCoordinateBuffer(buffer, encoding, buffer->arena)) {
+        return false;
+    }
+
+    // The list would cost more than the packed bytes it mirrors. getLineCoordinates fills it again if asked.
+    dropCoordinateList(line);
+
+    // Converting between compact encodings keeps the same rounded values.
+    if (rounded) {
+        syncLine(line);
+    }
+
+    return true;
+}
+
+bool compactLine(Line * line, KMLCoordinateEncoding encoding) {
+    if (line == NULL) {
+        return false;
+    }
+
+    if (!packLine(line, encoding)) {
+        return false;
+    }
+
+    recordPathChange(line->document, line);
+    return true;
+}
+
+bool compactKML(KML * doc, KMLCoordinateEncoding encoding) {
+    if (doc == NULL) {
+        return false;
+    }
+
+    bool ok = true;
+    void * elem;
+    ListIterator iter = createIterator(doc->pathPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL) {
+        PathPlacemark * p = (PathPlacemark *) elem;
+        if (p->pathData != NULL && !packLine(p->pathData, encoding)) {
+            ok = false;
+        }
+    }
+
+    // Rounding may have changed the lengths of every path.
+    recordPathsChange(doc);
+
+    return ok;
+}
+
+size_t getLineCoordinateBytes(const Line * line) {
+    if (line == NULL) {
+        return 0;
+    }
+
+    adoptCoordinateList(line);
+    const CoordinateBuffer * buffer = &line->points;
+    size_t bytes = buffer->encoding == KML_COORDINATES_DOUBLE ? (size_t) buffer->capacity * 3 * sizeof(double) : buffer->packedSize;
+
+    // A filled list holds a Coordinate and a node for every point on top of the buffer.
+    if (line->listFilled) {
+        bytes += (size_t) getLength(line->coordinates) * (sizeof(Coordinate) + sizeof(Node));
+    }
+
+    return bytes;
+}
+
+void initCoordinateIterator(KMLCoordinateIterator * iter, const Line * line) {
+    adoptCoordinateList(line);
+    initBufferIterator(iter, &line->points);
+}
+
+void initBufferIterator(KMLCoordinateIterator * iter, const CoordinateBuffer * buffer) {
+    iter->longitudes = NULL;
+    iter->latitudes = NULL;
+    iter->altitudes = NULL;
+    iter->count = 0;
+    iter->position = 0;
+    iter->buffer = buffer;
+    iter->next = 0;
+}
+
+int nextCoordinateBlock(KMLCoordinateIterator * iter) {
+    const CoordinateBuffer * buffer = iter->buffer;
+    int start = iter->next;
+    iter->position = 0;
+    iter->count = 0;
+    if (start >= buffer->length) {
+        return 0;
+    }
+
+    if (buffer->encoding == KML_COORDINATES_DOUBLE) {
+        iter->longitudes = buffer->longitudes + start;
+        iter->latitudes = buffer->latitudes + start;
+        iter->altitudes = buffer->altitudes + start;
+        iter->count = buffer->length - start;
+    } else {
+        iter->count = buffer->length - start < KML_COORDINATE_BLOCK ? buffer->length - start : KML_COORDINATE_BLOCK;
+        decodeRange(buffer, start, iter->count, iter->blockLongitudes, iter->blockLatitudes, iter->blockAltitudes);
+        iter->longitudes = iter->blockLongitudes;
+        iter->latitudes = iter->blockLatitudes;
+        iter->altitudes = iter->blockAltitudes;
+    }
+    iter->next = start + iter->count;
+
+    return iter->count;
+}
+
+bool nextCoordinate(KMLCoordinateIterator * iter, Coordinate * coordinate) {
+    if (iter->position == iter->count && nextCoordinateBlock(iter) == 0) {
+        return false;
+    }
+
+    coordinate->longitude = iter->longitudes[iter->position];
+    coordinate->latitude = iter->latitudes[iter->position];
+    coordinate->altitude = iter->altitudes[iter->position];
+    iter->position++;
+
+    return true;
+}
@@ -0,0 +1,108 @@
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+
+KMLParserCtx * createKMLParserCtx(const KMLSchema * schema, int flags) {
+    KMLParserCtx * ctx = malloc(sizeof(KMLParserCtx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    ctx->schema = schema;
+    ctx->flags = flags;
+    ctx->parser = xmlNewParserCtxt();
+    ctx->validator = NULL;
+    initCoordinateBuffer(&ctx->scratch, NULL);
+    ctx->spareArena = NULL;
+    if (ctx->parser == NULL) {
+        free(ctx);
+        return NULL;
+    }
+
+    if (schema != NULL) {
+        ctx->validator = xmlSchemaNewValidCtxt(schema->schema);
+        if (ctx->validator == NULL) {
+            xmlFreeParserCtxt(ctx->parser);
+            free(ctx);
+            return NULL;
+        }
+        xmlSchemaSetValidErrors(ctx->validator, (xmlSchemaValidityErrorFunc) fprintf, (xmlSchemaValidityWarningFunc) fprintf, stderr);
+    }
+
+    return ctx;
+}
+
+void deleteKMLParserCtx(KMLParserCtx * ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+
+    xmlFreeParserCtxt(ctx->parser);
+    xmlSchemaFreeValidCtxt(ctx->validator);
+    freeCoordinateBuffer(&ctx->scratch);
+    freeArena(ctx->spareArena);
+    free(ctx);
+}
+
+KML * createKMLWithCtx(KMLParserCtx * ctx, const char * fileName) {
+    // Null argument check.
+    if (ctx == NULL || fileName == NULL) {
+        return NULL;
+    }
+
+    // A text reader is tied to its file, so streaming loads only share the schema.
+    if (ctx->flags & KML_PARSE_STREAM) {
+        if (ctx->schema != NULL) {
+            return createValidKMLFromReader(fileName, ctx->schema, ctx->flags);
+        }
+        return createKMLStream(fileName, ctx->flags);
+    }
+
+    // libxml2 resets the parser context at the start of every read, keeping its buffers and dictionary.
+    xmlDoc * doc = xmlCtxtReadFile(ctx->parser, fileName, NULL, getXMLParseOptions(ctx->flags));
+    if (doc == NULL) {
+        return NULL;
+    }
+
+    if (ctx->validator != NULL) {
+        double start = getSeconds();
+        int ret = xmlSchemaValidateDoc(ctx->validator, doc);
+        recordValidation((KMLSchema *) ctx->schema, getSeconds() - start);
+        if (ret != 0) {
+            xmlFreeDoc(doc);
+            return NULL;
+        }
+    }
+
+    KML * kml = convertFromTree(doc, ctx->flags, ctx);
+
+    xmlFreeDoc(doc);
+
+    return kml;
+}
+
+void recycleKML(KMLParserCtx * ctx, KML * doc) {
+    if (doc == NULL) {
+        return;
+    }
+
+    // One emptied arena is kept for the next load. Its chunks already have the size that load will need.
+    KMLArena * arena = deleteKMLContents(doc);
+    if (ctx != NULL && arena != NULL && ctx->spareArena == NULL) {
+        resetArena(arena);
+        ctx->spareArena = arena;
+        return;
+    }
+
+    freeArena(arena);
+}
+
+KMLArena * takeSpareArena(KMLParserCtx * ctx) {
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    KMLArena * arena = ctx->spareArena;
+    ctx->spareArena = NULL;
+
+    return arena;
+}
@@ -2,26 +2,241 @@
 #include "KMLParser.h"
 
 int validateTree(xmlDoc * doc, const char * schemaFile) {
-    xmlSchemaPtr schema = NULL;
-    xmlSchemaParserCtxtPtr c1;
+    // The schema is compiled the first time a file name is seen and reused after that.
+    KMLSchema * schema = getCachedSchema(schemaFile);
+    if (schema == NULL) {
+        return -1;
+    }
+
+    return validateTreeWithSchema(doc, schema);
+}
+
+KML * initKML(int flags, KMLParserCtx * ctx) {
+    // Initialize KML struct as well as it's list fields.
+    KML * kml = malloc(sizeof(KML));
+    kml->arena = NULL;
+    if (flags & KML_PARSE_ARENA) {
+        kml->arena = takeSpareArena(ctx);
+        if (kml->arena == NULL) {
+            kml->arena = initArena(KML_ARENA_CHUNK_SIZE);
+        }
+    }
+    kml->scratch = ctx != NULL ? &ctx->scratch : NULL;
+
+    kml->pointIndex = NULL;
+    kml->pathIndex = NULL;
+    kml->styleIndex = NULL;
+    kml->styleMapIndex = NULL;
+    kml->styleGeneration = 0;
+    kml->lengthIndex = NULL;
+    kml->spatialIndex = NULL;
+    kml->modifications = 0;
+    kml->lodBuilder = NULL;
+
+    kml->coordinateEncoding = KML_COORDINATES_DOUBLE;
+    if (flags & KML_PARSE_COMPACT_DELTA) {
+        kml->coordinateEncoding = KML_COORDINATES_DELTA;
+    } else if (flags & KML_PARSE_COMPACT) {
+        kml->coordinateEncoding = KML_COORDINATES_FIXED;
+    }
+
+    KMLArena * arena = kml->arena;
+    kml->namespaces = kmlInitializeList(arena, &XMLNamespaceToString, &deleteXMLNamespace, &compareXMLNamespace);
+    kml->pointPlacemarks = kmlInitializeList(arena, &pointPlacemarkToString, &deletePointPlacemark, &comparePointPlacemarks);
+    kml->pathPlacemarks = kmlInitializeList(arena, &pathPlacemarkToString, &deletePathPlacemark, &comparePathPlacemarks);
+    kml->styles = kmlInitializeList(arena, &styleToString, &deleteStyle, &compareStyles);
+    kml->styleMaps = kmlInitializeList(arena, &styleMapToString, &deleteStyleMap, &compareStyleMaps);
+
+    return kml;
+}
+
+int getXMLParseOptions(int flags) {
+    int options = 0;
+    if (flags & KML_PARSE_HUGE) {
+        options |= XML_PARSE_HUGE;
+    }
+
+    return options;
+}
+
+void addNameSpaces(xmlNode * node, KML * kml) {
+    xmlNs * ns_node = NULL;
+    for (ns_node = node->ns; ns_node != NULL; ns_node = ns_node->next) {
+        XMLNamespace * ns = initNameSpace(ns_node, kml);
+        kmlInsertBack(kml->arena, kml->namespaces, ns);
+    }
+}
+
+void addKMLElement(xmlNode * node, KML * kml) {
+    // Check for Placemark element.
+    if ((strcmp((char *)node->name, "Placemark") == 0)) {
+        // Point or LineString Placemark?
+        int placemark_type = getPlacemarkType(node->children);
+        // Branch for Point Placemark.
+        if (placemark_type == 1) {
+            PointPlacemark * pop = initPointPlacemark(node->children, kml);
+            kmlInsertBack(kml->arena, kml->pointPlacemarks, pop);
+        // Branch for Path Placemark.
+        } else if (placemark_type == 0) {
+            PathPlacemark * pap = initPathPlacemark(node->children, kml);
+            kmlInsertBack(kml->arena, kml->pathPlacemarks, pap);
+        }
+    } 
+    if ((strcmp((char *)node->name, "Style") == 0)) {
+        Style * s = initStyle(node, kml);
+        kmlInsertBack(kml->arena, kml->styles, s);
+    }
+    if ((strcmp((char *)node->name, "StyleMap") == 0)) {
+        StyleMap * sm = initStyleMap(node, kml);
+        kmlInsertBack(kml->arena, kml->styleMaps, sm);
+    }
+}
+
+KML * convertFromTree(xmlDoc * doc, int flags, KMLParserCtx * ctx) {
+    xmlNode * root_node = xmlDocGetRootElement(doc);
+    KML * kml = initKML(flags, ctx);
+
+    // Step through the tree iteratively.
+    xmlNode * node = NULL;
+    for (node = root_node; node != NULL; node = node->next) {
+        if (node->type == XML_ELEMENT_NODE) {
+            // Check for kml element.
+            if ((strcmp((char *)node->name, "kml") == 0)) {
+                // Get namespace(s).
+                addNameSpaces(node, kml);
+                // Go lower.
+                node = node->children;
+            }
+            if ((strcmp((char *)node->name, "Document") == 0)) {
+                // Go lower.
+                node = node->children;
+            }
+            addKMLElement(node, kml);
+        }
+    }
+
+    finishKML(kml, flags);
+    return kml;
+}
+
+void finishKML(KML * kml, int flags) {
+    // The scratch buffer goes back to the context that lent it.
+    kml->scratch = NULL;
+
+    if (flags & KML_PARSE_INDEX_NAMES) {
+        indexKMLNames(kml);
+    }
+
+    linkStyles(kml);
+
+    // Compute the path metrics up front, so that reading them later never writes to the document.
+    void * elem;
+    ListIterator iter = createIterator(kml->pathPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL) {
+        updatePathMetrics((PathPlacemark *) elem);
+    }
 
-    xmlLineNumbersDefault(1);
-    c1 = xmlSchemaNewParserCtxt(schemaFile);
-    xmlSchemaSetParserErrors(c1, (xmlSchemaValidityErrorFunc) fprintf, (xmlSchemaValidityWarningFunc) fprintf, stderr);
-    schema = xmlSchemaParse(c1);
-    xmlSchemaFreeParserCtxt(c1);
+    kml->lengthIndex = buildLengthIndex(kml);
+}
+
+KML * convertFromReader(xmlTextReader * reader, int flags, bool validating, KMLParserCtx * ctx) {
+    KML * kml = initKML(flags, ctx);
+
+    // Placemark, Style and StyleMap elements are only picked up as children of
+    // <kml> or of its <Document>, the same elements convertFromTree visits.
+    int ret = xmlTextReaderRead(reader);
+    while (ret == 1) {
+        if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT) {
+            ret = xmlTextReaderRead(reader);
+            continue;
+        }
 
-    xmlSchemaValidCtxtPtr c2 = xmlSchemaNewValidCtxt(schema);
-    xmlSchemaSetValidErrors(c2, (xmlSchemaValidityErrorFunc) fprintf, (xmlSchemaValidityWarningFunc) fprintf, stderr);
-    int ret = xmlSchemaValidateDoc(c2, doc);
+        char * name = (char *) xmlTextReaderConstLocalName(reader);
+        int depth = xmlTextReaderDepth(reader);
+        if (depth == 0 && strcmp(name, "kml") == 0) {
+            // Namespaces are available as soon as the start tag has been read.
+            addNameSpaces(xmlTextReaderCurrentNode(reader), kml);
+            ret = xmlTextReaderRead(reader);
+        } else if (depth == 1 && strcmp(name, "Document") == 0) {
+            ret = xmlTextReaderRead(reader);
+        } else if (depth == 1 || depth == 2) {
+            // Build just this element's subtree, convert it, then move past it so
+            // the reader can release it before the next sibling is parsed.
+            xmlNode * node = xmlTextReaderExpand(reader);
+            if (node == NULL) {
+                ret = -1;
+                break;
+            }
+            addKMLElement(node, kml);
+            ret = xmlTextReaderNext(reader);
+        } else {
+            ret = xmlTextReaderNext(reader);
+        }
 
-    xmlSchemaFreeValidCtxt(c2);
-    if(schema != NULL) {
-        xmlSchemaFree(schema);
+        // Stop at the first schema error instead of converting the rest of the file.
+        if (validating && xmlTextReaderIsValid(reader) != 1) {
+            ret = -1;
+        }
+    }
+
+    // A negative return means the document was not well formed, or not valid.
+    if (ret == 0 && validating && xmlTextReaderIsValid(reader) != 1) {
+        ret = -1;
+    }
+    if (ret != 0) {
+        deleteKML(kml);
+        return NULL;
     }
-    xmlSchemaCleanupTypes();
 
-    return ret;
+    finishKML(kml, flags);
+    return kml;
+}
+
+KML * createValidKMLFromFile(const char * fileName, const KMLSchema * schema, int flags) {
+    if (flags & KML_PARSE_STREAM) {
+        return createValidKMLFromReader(fileName, schema, flags);
+    }
+
+    xmlDoc * doc = NULL;
+    doc = xmlReadFile(fileName, NULL, getXMLParseOptions(flags));
+    if (doc == NULL) {
+        return NULL;
+    } 
+
+    int ret = validateTreeWithSchema(doc, schema);
+    if (ret != 0) {
+        xmlFreeDoc(doc);
+        return NULL;
+    }
+
+    KML * kml = convertFromTree(doc, flags, NULL);
+
+    xmlFreeDoc(doc);
+
+    return kml;
+}
+
+KML * createValidKMLFromReader(const char * fileName, const KMLSchema * schema, int flags) {
+    double start = getSeconds();
+
+    xmlTextReaderPtr reader = xmlReaderForFile(fileName, NULL, getXMLParseOptions(flags));
+    if (reader == NULL) {
+        return NULL;
+    }
+
+    // The schema is plugged into the reader's parser, so every element is validated
+    // as it is parsed, including the subtrees convertFromReader skips over.
+    if (xmlTextReaderSetSchema(reader, schema->schema) != 0) {
+        xmlFreeTextReader(reader);
+        return NULL;
+    }
+
+    KML * kml = convertFromReader(reader, flags, true, NULL);
+
+    xmlFreeTextReader(reader);
+    recordValidation((KMLSchema *) schema, getSeconds() - start);
+
+    return kml;
 }
 
 xmlDoc * convertToTree(const KML * kml) {
@@ -311,12 +526,9 @@ bool convertPointPlacemarks(xmlNode * node, const KML * kml) {
             return false;
         }
 
-        char * coordinates = malloc(1024);
-        if (pointPlacemark->point->coordinate->altitude == DBL_MAX) {
-            sprintf(coordinates, "%f,%f", pointPlacemark->point->coordinate->longitude, pointPlacemark->point->coordinate->latitude);
-        } else {
-            sprintf(coordinates, "%f,%f,%f", pointPlacemark->point->coordinate->longitude, pointPlacemark->point->coordinate->latitude, pointPlacemark->point->coordinate->altitude);
-        }
+        char coordinates[KML_COORDINATE_LENGTH];
+        const Coordinate * c = pointPlacemark->point->coordinate;
+        formatCoordinate(coordinates, c->longitude, c->latitude, c->altitude);
 
         xmlNewChild(point_node, NULL, (xmlChar *) "coordinates", (xmlChar *) coordinates);
     }
@@ -336,10 +548,8 @@ bool convertPathPlacemarks(xmlNode * node, const KML * kml) {
         if (pathPlacemark->otherElements == NULL) {
             return false;
         }
-        if (pathPlacemark->pathData->coordinates == NULL) {
-            return false;
-        }
-        if (getLength(pathPlacemark->pathData->coordinates) < 2) {
+        adoptCoordinateList(pathPlacemark->pathData);
+        if (pathPlacemark->pathData->points.length < 2) {
             return false;
         }
         if (pathPlacemark->pathData->otherElements == NULL) {
@@ -401,36 +611,32 @@ bool convertPathPlacemarks(xmlNode * node, const KML * kml) {
             }
         }
 
-        char * coordinates = malloc(1024);
-        strcpy(coordinates, "");
-        void * elem2;
-        ListIterator iter2 = createIterator(pathPlacemark->pathData->coordinates);
-        while ((elem2 = nextElement(&iter2)) != NULL) {
-            Coordinate * c = (Coordinate *) elem2;
-
+        // Each coordinate is followed by a space. The builder grows geometrically, so this is linear in the
+        // number of coordinates.
+        KMLStringBuilder coordinates;
+        initStringBuilder(&coordinates, 32 * pathPlacemark->pathData->points.length, NULL, NULL);
+        char coordinate[KML_COORDINATE_LENGTH];
+        Coordinate c;
+        KMLCoordinateIterator coordinateIter;
+        initCoordinateIterator(&coordinateIter, pathPlacemark->pathData);
+        while (nextCoordinate(&coordinateIter, &c)) {
             // Validity checks.
-            if (c->longitude == -1) {
-                return false;
-            }
-            if (c->latitude == -1) {
+            if (c.longitude == -1 || c.latitude == -1) {
+                freeStringBuilder(&coordinates);
                 return false;
             }
 
-            char * coordinate = malloc(1024);
-            if (c->altitude == DBL_MAX) {
-                sprintf(coordinate, "%f,%f", c->longitude, c->latitude);
-            } else {
-                sprintf(coordinate, "%f,%f,%f", c->longitude, c->latitude, c->altitude);
-            }
-
-            strcat(coordinates, coordinate);
-            strcat(coordinates, " ");
-            coordinates = realloc(coordinates, 1024);
-            free(coordinate);
+            int length = formatCoordinate(coordinate, c.longitude, c.latitude, c.altitude);
+            coordinate[length++] = ' ';
+            appendBytes(&coordinates, coordinate, length);
+        }
+        if (coordinates.failed) {
+            freeStringBuilder(&coordinates);
+            return false;
         }
 
-        xmlNewChild(path_node, NULL, (xmlChar *) "coordinates", (xmlChar *) coordinates);
-        free(coordinates);
+        xmlNewChild(path_node, NULL, (xmlChar *) "coordinates", (xmlChar *) coordinates.data);
+        freeStringBuilder(&coordinates);
     }
 
     return true;
@@ -457,25 +663,22 @@ int getPlacemarkType(xmlNode * node) {
 }
 
 PointPlacemark * initPointPlacemark(xmlNode * node, KML * kml) {
-    PointPlacemark * pl = malloc(sizeof(PointPlacemark));
+    PointPlacemark * pl = kmlMalloc(kml->arena, sizeof(PointPlacemark));
     pl->name = NULL;
-    pl->otherElements = initializeList(&KMLElementToString, &deleteKMLElement, &compareKMLElements);
+    pl->otherElements = kmlInitializeList(kml->arena, &KMLElementToString, &deleteKMLElement, &compareKMLElements);
 
     xmlNode * curr_node = NULL;
     for (curr_node = node; curr_node != NULL; curr_node = curr_node->next) {
         if (curr_node->type == XML_ELEMENT_NODE) {
             // Branch for name node..
             if (strcmp((char *) curr_node->name, "name") == 0) {
-                char * c = (char *) xmlNodeGetContent(curr_node);
-                pl->name = malloc(strlen(c) + 1);
-                strcpy(pl->name, c);
-                free(c);
+                pl->name = copyNodeText(curr_node, kml->arena);
             } else if (strcmp((char *) curr_node->name, "Point") == 0) {
-                Point * point = initPoint(curr_node->children);
+                Point * point = initPoint(curr_node->children, kml);
                 pl->point = point;
             } else {
-                KMLElement * k = initKMLElement(curr_node);
-                insertBack(pl->otherElements, k);
+                KMLElement * k = initKMLElement(curr_node, kml);
+                kmlInsertBack(kml->arena, pl->otherElements, k);
             }
         }
     }
@@ -484,25 +687,25 @@ PointPlacemark * initPointPlacemark(xmlNode * node, KML * kml) {
 }
 
 PathPlacemark * initPathPlacemark(xmlNode * node, KML * kml) {
-    PathPlacemark * pa = malloc(sizeof(PathPlacemark));
+    PathPlacemark * pa = kmlMalloc(kml->arena, sizeof(PathPlacemark));
     pa->name = NULL;
-    pa->otherElements = initializeList(&KMLElementToString, &deleteKMLElement, &compareKMLElements);
+    pa->styleMap = NULL;
+    pa->styleGeneration = 0;
+    pa->metrics.version = 0;
+    pa->otherElements = kmlInitializeList(kml->arena, &KMLElementToString, &deleteKMLElement, &compareKMLElements);
 
     xmlNode * curr_node = NULL;
     for (curr_node = node; curr_node != NULL; curr_node = curr_node->next) {
         if (curr_node->type == XML_ELEMENT_NODE) {
             // Branch for name node.
             if (strcmp((char *) curr_node->name, "name") == 0) {
-                char * c = (char *) xmlNodeGetContent(curr_node);
-                pa->name = malloc(strlen(c) + 1);
-                strcpy(pa->name, c);
-                free(c);
+                pa->name = copyNodeText(curr_node, kml->arena);
             } else if (strcmp((char *) curr_node->name, "LineString") == 0) {
-                Line * line = initPath(curr_node->children);
+                Line * line = initPath(curr_node->children, kml);
                 pa->pathData = line;
             } else {
-                KMLElement * k = initKMLElement(curr_node);
-                insertBack(pa->otherElements, k);
+                KMLElement * k = initKMLElement(curr_node, kml);
+                kmlInsertBack(kml->arena, pa->otherElements, k);
             }
         }
     }
@@ -510,19 +713,20 @@ PathPlacemark * initPathPlacemark(xmlNode * node, KML * kml) {
     return pa;
 }
 
-Point * initPoint(xmlNode * node) {
-    Point * point = malloc(sizeof(Point));
-    point->otherElements = initializeList(&KMLElementToString, &deleteKMLElement, &compareKMLElements);
+Point * initPoint(xmlNode * node, KML * kml) {
+    Point * point = kmlMalloc(kml->arena, sizeof(Point));
+    point->otherElements = kmlInitializeList(kml->arena, &KMLElementToString, &deleteKMLElement, &compareKMLElements);
+    point->document = kml;
 
     xmlNode * curr_node = NULL;
     for (curr_node = node; curr_node != NULL; curr_node = curr_node->next) {
         if (curr_node->type == XML_ELEMENT_NODE) {
             if (strcmp((char *) curr_node->name, "coordinates") == 0) {
-                Coordinate * coordinate = initCoordinate(curr_node);
+                Coordinate * coordinate = initCoordinate(curr_node, kml);
                 point->coordinate = coordinate;
             } else {
-                KMLElement * k = initKMLElement(curr_node);
-                insertBack(point->otherElements, k);
+                KMLElement * k = initKMLElement(curr_node, kml);
+                kmlInsertBack(kml->arena, point->otherElements, k);
             }
         } 
     }
@@ -530,96 +734,248 @@ Point * initPoint(xmlNode * node) {
     return point;
 }
 
-Line * initPath(xmlNode * node) {
-    Line * path = malloc(sizeof(Line));
-    path->otherElements = initializeList(&KMLElementToString, &deleteKMLElement, &compareKMLElements);
-    path->coordinates = initializeList(&coordinateToString, &deleteCoordinate, &compareCoordinates);
+Line * initPath(xmlNode * node, KML * kml) {
+    Line * path = kmlMalloc(kml->arena, sizeof(Line));
+    path->otherElements = kmlInitializeList(kml->arena, &KMLElementToString, &deleteKMLElement, &compareKMLElements);
+    path->coordinates = kmlInitializeList(kml->arena, &coordinateToString, &deleteCoordinate, &compareCoordinates);
+    path->version = 1;
+    path->lod = NULL;
+    path->listModifications = 0;
+    path->listFilled = false;
+    path->document = kml;
+
+    // Coordinates are collected in malloc'd arrays, since the final count is only known
+    // at the end, and then trimmed or moved into the arena in one step.
+    initCoordinateBuffer(&path->points, NULL);
 
     xmlNode * curr_node = NULL;
     for (curr_node = node; curr_node != NULL; curr_node = curr_node->next) {
         if (curr_node->type == XML_ELEMENT_NODE) {
             if (strcmp((char *) curr_node->name, "coordinates") == 0) {
-                char * nodeContent = (char *) xmlNodeGetContent(curr_node);
-                char * coordinates = malloc(strlen(nodeContent) + 1);
-                char * coordinatesCpy = coordinates;
-                strcpy(coordinates, nodeContent);
-                coordinates = trimString(coordinates);
-                char * token = strtok_r(coordinates, " ", &coordinates);
-                do {
-                    char * subtoken = strtok_r(token, ",", &token);
-                    int pos = 0;
-                    Coordinate * c = malloc(sizeof(Coordinate));
-                    do {
-                        if (pos == 0) {
-                            c->longitude = atof(subtoken);
-                        } else if (pos == 1) {
-                            c->latitude = atof(subtoken);
-                        } else if (pos == 2) {
-                            c->altitude = atof(subtoken);
-                        }
-                        subtoken = strtok_r(token, ",", &token);
-                        pos++;
-                    } while (subtoken != NULL);
-                    insertBack(path->coordinates, c);
-                    token = strtok_r(coordinates, " ", &coordinates);
-                } while (token != NULL);
-                free(nodeContent);
-                free(coordinatesCpy);
+                char * copy = NULL;
+                const char * text = getNodeText(curr_node, &copy);
+                const char * end = text + strlen(text);
+
+                // Only a second <coordinates> element could find the buffer compact already.
+                unpackCoordinateBuffer(&path->points);
+
+                // A parser context lends its scratch buffer, which keeps its capacity from path to path, so that
+                // only the final arrays are allocated. A second <coordinates> element appends to the path itself.
+                CoordinateBuffer * points = &path->points;
+                if (kml->scratch != NULL && path->points.length == 0) {
+                    points = kml->scratch;
+                    points->length = 0;
+                }
+
+                // Tuples are separated by whitespace, the values inside a tuple by commas.
+                Coordinate tuple;
+                const char * pos = scanCoordinate(text, end, &tuple);
+                while (pos != NULL) {
+                    appendCoordinate(points, tuple.longitude, tuple.latitude, tuple.altitude);
+                    pos = scanCoordinate(pos, end, &tuple);
+                }
+                free(copy);
+
+                // Compact coordinates are encoded straight into the arena, so the double arrays are never moved
+                // there. Paths the encoding cannot hold are kept as doubles.
+                if (points == kml->scratch) {
+                    if (kml->coordinateEncoding == KML_COORDINATES_DOUBLE || !encodeCoordinateBuffer(points, kml->coordinateEncoding, kml->arena, &path->points)) {
+                        copyCoordinateBuffer(points, kml->arena, &path->points);
+                    }
+                } else if (kml->coordinateEncoding == KML_COORDINATES_DOUBLE || !packCoordinateBuffer(&path->points, kml->coordinateEncoding, kml->arena)) {
+                    shrinkCoordinateBuffer(&path->points, kml->arena);
+                }
             } else {
-                KMLElement * k = initKMLElement(curr_node);
-                insertBack(path->otherElements, k);
+                KMLElement * k = initKMLElement(curr_node, kml);
+                kmlInsertBack(kml->arena, path->otherElements, k);
             }
         } 
     }
 
+    // A path without <coordinates> still has to belong to the arena, or arrays grown later
+    // by setLineCoordinate and addLineCoordinate are never freed.
+    shrinkCoordinateBuffer(&path->points, kml->arena);
+
     return path;
 }
 
-Coordinate * initCoordinate(xmlNode * node) {
-    // Initialize Coordinate struct.
-    Coordinate * coordinate = malloc(sizeof(Coordinate));
-    coordinate->longitude = -1;
-    coordinate->latitude = -1;
-    coordinate->altitude = DBL_MAX;
+Coordinate * initCoordinate(xmlNode * node, KML * kml) {
+    // Initialize Coordinate struct. scanCoordinate leaves these defaults in
+    // place for any value missing from the coordinate string.
+    Coordinate * coordinate = kmlMalloc(kml->arena, sizeof(Coordinate));
+
+    // Get the coordinate string and parse the first tuple in it.
+    char * copy = NULL;
+    const char * text = getNodeText(node, &copy);
+    if (scanCoordinate(text, text + strlen(text), coordinate) == NULL) {
+        coordinate->longitude = -1;
+        coordinate->latitude = -1;
+        coordinate->altitude = DBL_MAX;
+    }
+
+    free(copy);
+    return coordinate;
+}
+
+char * copyNodeText(xmlNode * node, KMLArena * arena) {
+    char * copy = NULL;
+    const char * text = getNodeText(node, &copy);
+    char * str = kmlStrdup(arena, text);
+    free(copy);
+
+    return str;
+}
 
-    // Get the coordinate string.
-    char * c = (char *) xmlNodeGetContent(node);
-    char * content = malloc(strlen(c) + 1);
-    strcpy(content, c);
+const char * getNodeText(xmlNode * node, char ** copy) {
+    *copy = NULL;
 
-    // Parse the coordinate string and assign to struct fields.
-    char delim[] = ",";
-    char * coordinateStr = strtok(content, delim);  
+    // The common case is a single text child, whose content can be used in place.
+    xmlNode * child = node->children;
+    if (child == NULL) {
+        return "";
+    }
+    if (child->next == NULL && (child->type == XML_TEXT_NODE || child->type == XML_CDATA_SECTION_NODE)) {
+        return (const char *) child->content;
+    }
+
+    *copy = (char *) xmlNodeGetContent(node);
+    return *copy;
+}
+
+// Powers of ten that are exactly representable as a double.
+static const double exactPowers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+double parseDouble(const char * str, const char ** end) {
+    const char * p = str;
+    bool negative = false;
+    if (*p == '-' || *p == '+') {
+        negative = (*p == '-');
+        p++;
+    }
+
+    // Collect up to 15 significant digits, which always fit exactly in a double's mantissa.
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    int total = 0;
+    while (*p >= '0' && *p <= '9') {
+        if (mantissa != 0 || *p != '0') {
+            digits++;
+        }
+        mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+        total++;
+        p++;
+    }
+    if (*p == '.') {
+        p++;
+        while (*p >= '0' && *p <= '9') {
+            if (mantissa != 0 || *p != '0') {
+                digits++;
+            }
+            mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+            exponent--;
+            total++;
+            p++;
+        }
+    }
+
+#if FLT_EVAL_METHOD == 0
+    // With both operands exact, a single IEEE multiply or divide is correctly
+    // rounded, which is exactly what strtod guarantees. Anything else - exponents,
+    // hex, inf/nan, long mantissas, stray characters - is left to strtod.
+    if (total > 0 && digits <= 15 && exponent >= -22 && *p != 'e' && *p != 'E' && *p != 'x' && *p != 'X') {
+        double value = (double) mantissa;
+        if (exponent < 0) {
+            value /= exactPowers[-exponent];
+        }
+        *end = p;
+        return negative ? -value : value;
+    }
+#endif
+
+    char * strtodEnd;
+    double value = strtod(str, &strtodEnd);
+    *end = strtodEnd;
+    return value;
+}
+
+static bool isCoordinateSpace(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+// Skip the run of whitespace between two tuples, 16 bytes at a time where SSE2 is available.
+static const char * skipCoordinateSpace(const char * p, const char * end) {
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i cr = _mm_set1_epi8('\r');
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) p);
+        __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, newline)),
+                                  _mm_or_si128(_mm_cmpeq_epi8(chunk, tab), _mm_cmpeq_epi8(chunk, cr)));
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(ws) ^ 0xFFFF;
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && isCoordinateSpace(*p)) {
+        p++;
+    }
+    return p;
+}
+
+const char * scanCoordinate(const char * str, const char * end, Coordinate * c) {
+    const char * p = skipCoordinateSpace(str, end);
+    if (p >= end) {
+        return NULL;
+    }
+
+    c->longitude = -1;
+    c->latitude = -1;
+    c->altitude = DBL_MAX;
+
+    // Empty values are skipped, and anything after the third value is ignored.
     int pos = 0;
-    while (coordinateStr != NULL) {
+    while (p < end && !isCoordinateSpace(*p)) {
+        if (*p == ',') {
+            p++;
+            continue;
+        }
+
+        const char * next;
+        double value = parseDouble(p, &next);
         if (pos == 0) {
-            coordinate->longitude = atof(coordinateStr);
+            c->longitude = value;
         } else if (pos == 1) {
-            coordinate->latitude = atof(coordinateStr);
+            c->latitude = value;
         } else if (pos == 2) {
-            coordinate->altitude = atof(coordinateStr);
+            c->altitude = value;
         }
-        coordinateStr = strtok(NULL, delim);
         pos++;
+
+        // Trailing characters that are not part of the number are ignored, like atof does.
+        p = next;
+        while (p < end && *p != ',' && !isCoordinateSpace(*p)) {
+            p++;
+        }
     }
 
-    free(c);
-    free(content);
-    return coordinate;
+    return p;
 }
 
-XMLNamespace * initNameSpace(xmlNs * nsNode) {
-    XMLNamespace * ns = malloc(sizeof(XMLNamespace));
+XMLNamespace * initNameSpace(xmlNs * nsNode, KML * kml) {
+    XMLNamespace * ns = kmlMalloc(kml->arena, sizeof(XMLNamespace));
 
-    char * href = (char *) nsNode->href;
-    ns->value = malloc(strlen(href) + 1);
-    strcpy(ns->value, href);
+    ns->value = kmlStrdup(kml->arena, (char *) nsNode->href);
 
-    char * prefix;
     if (nsNode->prefix != NULL) {
-        prefix = (char *) nsNode->prefix;
-        ns->prefix = malloc(strlen(prefix) + 1);
-        strcpy(ns->prefix, prefix);
+        ns->prefix = kmlStrdup(kml->arena, (char *) nsNode->prefix);
     } else {
         ns->prefix = NULL;
     }
@@ -627,35 +983,27 @@ XMLNamespace * initNameSpace(xmlNs * nsNode) {
     return ns;
 }
 
+bool appendLineString(KMLStringBuilder * sb, const Line * line) {
+    Coordinate coordinate;
+    KMLCoordinateIterator iter;
+    initCoordinateIterator(&iter, line);
+    while (nextCoordinate(&iter, &coordinate)) {
+        appendCoordinateString(sb, &coordinate);
+        appendString(sb, "\n");
+    }
+
+    return !sb->failed;
+}
+
 char * lineToString(void * data) {
     Line * l = (Line *) data;
 
-    char * tmpStr = malloc(100000);
-    strcpy(tmpStr, "");
+    KMLStringBuilder sb;
+    adoptCoordinateList(l);
+    initStringBuilder(&sb, 32 * l->points.length, NULL, NULL);
+    appendLineString(&sb, l);
 
-    if (getLength(l->coordinates) > 0) {
-        ListIterator iter = createIterator(l->coordinates);
-        void * elem;
-        while ((elem = nextElement(&iter)) != NULL) {
-            char * c = coordinateToString(elem);
-            strcat(tmpStr, c);
-            strcat(tmpStr, "\n");
-            free(c);
-	    }
-    }
-    
-    // if (getLength(l->otherElements) > 0) {
-    //     strcat(tmpStr, "\n    LineStyle elements\n");
-    //     ListIterator iter = createIterator(l->otherElements);
-    //     void * elem;
-    //     while ((elem = nextElement(&iter)) != NULL) {
-    //         char * k = KMLElementToString(elem);
-    //         strcat(tmpStr, k);
-    //         free(k);
-	//     }
-    // }
-
-    return tmpStr;
+    return takeStringBuilder(&sb);
 }
 
 void deleteLine(void * data) {
@@ -663,26 +1011,156 @@ void deleteLine(void * data) {
 
     freeList(l->otherElements);
     freeList(l->coordinates);
+    freeCoordinateBuffer(&l->points);
+    freeLodPyramid(l->lod);
 
     free(l);
 }
 
-Style * initStyle(xmlNode * node) {
-    Style * s = malloc(sizeof(Style));
+void initCoordinateBuffer(CoordinateBuffer * buffer, KMLArena * arena) {
+    buffer->longitudes = NULL;
+    buffer->latitudes = NULL;
+    buffer->altitudes = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+    buffer->arena = arena;
+    buffer->encoding = KML_COORDINATES_DOUBLE;
+    buffer->packed = NULL;
+    buffer->packedSize = 0;
+    buffer->hasAltitudes = false;
+}
+
+static double * copyToArena(KMLArena * arena, const double * values, int length, int capacity) {
+    double * copy = arenaAlloc(arena, capacity * sizeof(double));
+    if (copy != NULL && length > 0) {
+        memcpy(copy, values, length * sizeof(double));
+    }
+
+    return copy;
+}
+
+static bool resizeCoordinateBuffer(CoordinateBuffer * buffer, int capacity) {
+    // Arena arrays cannot be reallocated in place, so they are copied to fresh
+    // arena arrays. The old ones are released with the arena.
+    if (buffer->arena != NULL) {
+        double * longitudes = copyToArena(buffer->arena, buffer->longitudes, buffer->length, capacity);
+        double * latitudes = copyToArena(buffer->arena, buffer->latitudes, buffer->length, capacity);
+        double * altitudes = copyToArena(buffer->arena, buffer->altitudes, buffer->length, capacity);
+        if (longitudes == NULL || latitudes == NULL || altitudes == NULL) {
+            return false;
+        }
+        buffer->longitudes = longitudes;
+        buffer->latitudes = latitudes;
+        buffer->altitudes = altitudes;
+        buffer->capacity = capacity;
+        return true;
+    }
+
+    double * longitudes = realloc(buffer->longitudes, capacity * sizeof(double));
+    if (longitudes == NULL) {
+        return false;
+    }
+    buffer->longitudes = longitudes;
+
+    double * latitudes = realloc(buffer->latitudes, capacity * sizeof(double));
+    if (latitudes == NULL) {
+        return false;
+    }
+    buffer->latitudes = latitudes;
+
+    double * altitudes = realloc(buffer->altitudes, capacity * sizeof(double));
+    if (altitudes == NULL) {
+        return false;
+    }
+    buffer->altitudes = altitudes;
+
+    buffer->capacity = capacity;
+    return true;
+}
+
+bool appendCoordinate(CoordinateBuffer * buffer, double longitude, double latitude, double altitude) {
+    // Grow geometrically so that appending n coordinates costs O(n) overall.
+    if (buffer->length == buffer->capacity) {
+        int capacity = buffer->capacity == 0 ? 16 : buffer->capacity * 2;
+        if (!resizeCoordinateBuffer(buffer, capacity)) {
+            return false;
+        }
+    }
+
+    buffer->longitudes[buffer->length] = longitude;
+    buffer->latitudes[buffer->length] = latitude;
+    buffer->altitudes[buffer->length] = altitude;
+    buffer->length++;
+
+    return true;
+}
+
+void shrinkCoordinateBuffer(CoordinateBuffer * buffer, KMLArena * arena) {
+    if (arena != NULL && buffer->arena == NULL) {
+        CoordinateBuffer moved;
+        initCoordinateBuffer(&moved, arena);
+        if (buffer->length > 0) {
+            moved.longitudes = copyToArena(arena, buffer->longitudes, buffer->length, buffer->length);
+            moved.latitudes = copyToArena(arena, buffer->latitudes, buffer->length, buffer->length);
+            moved.altitudes = copyToArena(arena, buffer->altitudes, buffer->length, buffer->length);
+            moved.length = buffer->length;
+            moved.capacity = buffer->length;
+        }
+        freeCoordinateBuffer(buffer);
+        *buffer = moved;
+        return;
+    }
+
+    if (buffer->length > 0 && buffer->length < buffer->capacity) {
+        resizeCoordinateBuffer(buffer, buffer->length);
+    }
+}
+
+bool copyCoordinateBuffer(const CoordinateBuffer * source, KMLArena * arena, CoordinateBuffer * copy) {
+    initCoordinateBuffer(copy, arena);
+    if (source->length == 0) {
+        return true;
+    }
+
+    size_t size = source->length * sizeof(double);
+    copy->longitudes = kmlMalloc(arena, size);
+    copy->latitudes = kmlMalloc(arena, size);
+    copy->altitudes = kmlMalloc(arena, size);
+    if (copy->longitudes == NULL || copy->latitudes == NULL || copy->altitudes == NULL) {
+        freeCoordinateBuffer(copy);
+        return false;
+    }
+    memcpy(copy->longitudes, source->longitudes, size);
+    memcpy(copy->latitudes, source->latitudes, size);
+    memcpy(copy->altitudes, source->altitudes, size);
+    copy->length = source->length;
+    copy->capacity = source->length;
+
+    return true;
+}
+
+void freeCoordinateBuffer(CoordinateBuffer * buffer) {
+    if (buffer->arena == NULL) {
+        free(buffer->longitudes);
+        free(buffer->latitudes);
+        free(buffer->altitudes);
+        free(buffer->packed);
+    }
+    initCoordinateBuffer(buffer, buffer->arena);
+}
+
+Style * initStyle(xmlNode * node, KML * kml) {
+    Style * s = kmlMalloc(kml->arena, sizeof(Style));
     s->fill = -1;
     s->width = -1;
 
     // KML spec states: "Color and opacity (alpha) values are expressed in hexadecimal notation. The range of values for any one color is 0 to 255 (00 to ff)."
-    // So colour may be of maximum 8 bytes. Colour is initialized to a default value.
-    s->colour = malloc(64);
-    strcpy(s->colour, "#ffffffff");
+    // Colour is initialized to a default value.
+    s->colour = NULL;
 
     // Get style id from Style element properties.
     xmlAttr * attr = node->properties;
-    char * id = (char *) xmlNodeGetContent(attr->children);
-    s->id = malloc(strlen(id) + 1);
-    strcpy(s->id, id);
-    free(id);
+    s->id = copyNodeText((xmlNode *) attr, kml->arena);
 
     // Get children of Style element.
     xmlNode * style_node;
@@ -694,14 +1172,12 @@ Style * initStyle(xmlNode * node) {
                 for (linestyle_node = style_node->children; linestyle_node != NULL; linestyle_node = linestyle_node->next) {
                     if (linestyle_node->type == XML_ELEMENT_NODE) {
                         if (((strcmp((char *)linestyle_node->name, "width") == 0))) {
-                            char * width = (char *) xmlNodeGetContent(linestyle_node);
-                            s->width = atoi(width);
-                            free(width);
+                            char * copy = NULL;
+                            s->width = atoi(getNodeText(linestyle_node, &copy));
+                            free(copy);
                         } else if (((strcmp((char *)linestyle_node->name, "color") == 0))) {
-                            char * colour = (char *) xmlNodeGetContent(linestyle_node);
-                            // s->colour = malloc(strlen(colour) + 1);
-                            strcpy(s->colour, colour);
-                            free(colour);
+                            kmlFree(kml->arena, s->colour);
+                            s->colour = copyNodeText(linestyle_node, kml->arena);
                         }
                     }
                 }
@@ -711,9 +1187,9 @@ Style * initStyle(xmlNode * node) {
                 for (polystyle_node = style_node->children; polystyle_node != NULL; polystyle_node = polystyle_node->next) {
                     if (polystyle_node->type == XML_ELEMENT_NODE) {
                         if (((strcmp((char *)polystyle_node->name, "fill") == 0))) {
-                            char * fill = (char *) xmlNodeGetContent(polystyle_node);
-                            s->fill = atoi(fill);
-                            free(fill);
+                            char * copy = NULL;
+                            s->fill = atoi(getNodeText(polystyle_node, &copy));
+                            free(copy);
                         }
                     }
                 }
@@ -721,18 +1197,26 @@ Style * initStyle(xmlNode * node) {
         }
     }
 
+    if (s->colour == NULL) {
+        s->colour = kmlStrdup(kml->arena, "#ffffffff");
+    }
+
     return s;
 }
 
-StyleMap * initStyleMap(xmlNode * node) {
-    StyleMap * sm = malloc(sizeof(StyleMap));
+StyleMap * initStyleMap(xmlNode * node, KML * kml) {
+    StyleMap * sm = kmlMalloc(kml->arena, sizeof(StyleMap));
+    sm->key1 = NULL;
+    sm->url1 = NULL;
+    sm->key2 = NULL;
+    sm->url2 = NULL;
+    sm->styles[0] = NULL;
+    sm->styles[1] = NULL;
+    sm->styleGeneration = 0;
 
     // Get style id from StyleMap element properties.
     xmlAttr * attr = node->properties;
-    char * id = (char *) xmlNodeGetContent(attr->children);
-    sm->id = malloc(strlen(id) + 1);
-    strcpy(sm->id, id);
-    free(id);
+    sm->id = copyNodeText((xmlNode *) attr, kml->arena);
 
     // Get children of StyleMap element.
     xmlNode * mapNode;
@@ -744,26 +1228,18 @@ StyleMap * initStyleMap(xmlNode * node) {
                 for (pairNode = mapNode->children; pairNode != NULL; pairNode = pairNode->next) {
                     if (pairNode->type == XML_ELEMENT_NODE) {
                         if (((strcmp((char *)pairNode->name, "key") == 0))) {
-                            char * key = (char *) xmlNodeGetContent(pairNode);
                             if (index == 0) {
-                                sm->key1 = malloc(strlen(key) + 1);
-                                strcpy(sm->key1, key);
+                                sm->key1 = copyNodeText(pairNode, kml->arena);
                             } else if (index == 1) {
-                                sm->key2 = malloc(strlen(key) + 1);
-                                strcpy(sm->key2, key);
+                                sm->key2 = copyNodeText(pairNode, kml->arena);
                             }
-                            free(key);
                         }
                         if (((strcmp((char *)pairNode->name, "styleUrl") == 0))) {
-                            char * url = (char *) xmlNodeGetContent(pairNode);
                             if (index == 0) {
-                                sm->url1 = malloc(strlen(url) + 1);
-                                strcpy(sm->url1, url);
+                                sm->url1 = copyNodeText(pairNode, kml->arena);
                             } else if (index == 1) {
-                                sm->url2 = malloc(strlen(url) + 1);
-                                strcpy(sm->url2, url);
+                                sm->url2 = copyNodeText(pairNode, kml->arena);
                             }
-                            free(url);
                         }
                     }
                 }
@@ -775,14 +1251,10 @@ StyleMap * initStyleMap(xmlNode * node) {
     return sm;
 }
 
-KMLElement * initKMLElement(xmlNode * node) {
-        KMLElement * k = malloc(sizeof(KMLElement));
-        k->name = malloc(strlen((char *) node->name) + 1);
-        strcpy(k->name, (char *) node->name);
-        char * c = (char *) xmlNodeGetContent(node);
-        k->value = malloc(strlen(c) + 1);
-        strcpy(k->value, c);
-        free(c);
+KMLElement * initKMLElement(xmlNode * node, KML * kml) {
+        KMLElement * k = kmlMalloc(kml->arena, sizeof(KMLElement));
+        k->name = kmlStrdup(kml->arena, (char *) node->name);
+        k->value = copyNodeText(node, kml->arena);
 
         return k;
 }
@@ -817,15 +1289,72 @@ double dist(double th1, double ph1, double th2, double ph2) {
 	return asin(sqrt(dx * dx + dy * dy + dz * dz) / 2) * 2 * R;
 }
 
+const PathMetrics * updatePathMetrics(PathPlacemark * ppm) {
+    PathMetrics * metrics = &ppm->metrics;
+    const Line * line = ppm->pathData;
+    adoptCoordinateList(line);
+    // A Line built by hand may have a version of 0, so metrics are never treated as current at 0.
+    if (metrics->version != 0 && metrics->version == line->version) {
+        return metrics;
+    }
+
+    metrics->numPoints = line->points.length;
+    metrics->length = 0;
+    metrics->endpointDistance = 0;
+    metrics->minLongitude = metrics->minLatitude = 0;
+    metrics->maxLongitude = metrics->maxLatitude = 0;
+
+    // Uncompressed coordinates come as one block. Compact ones are measured a decoded block at a time,
+    // with the segment joining two blocks measured separately.
+    KMLCoordinateIterator iter;
+    initCoordinateIterator(&iter, line);
+    double firstLongitude = 0, firstLatitude = 0, lastLongitude = 0, lastLatitude = 0;
+    bool first = true;
+    int count;
+    while ((count = nextCoordinateBlock(&iter)) > 0) {
+        if (first) {
+            first = false;
+            firstLongitude = iter.longitudes[0];
+            firstLatitude = iter.latitudes[0];
+            metrics->minLongitude = metrics->maxLongitude = firstLongitude;
+            metrics->minLatitude = metrics->maxLatitude = firstLatitude;
+        } else {
+            metrics->length += dist(lastLatitude, lastLongitude, iter.latitudes[0], iter.longitudes[0]);
+        }
+        metrics->length += pathDistance(iter.latitudes, iter.longitudes, count);
+
+        for (int i = 0; i < count; i++) {
+            metrics->minLongitude = fmin(metrics->minLongitude, iter.longitudes[i]);
+            metrics->maxLongitude = fmax(metrics->maxLongitude, iter.longitudes[i]);
+            metrics->minLatitude = fmin(metrics->minLatitude, iter.latitudes[i]);
+            metrics->maxLatitude = fmax(metrics->maxLatitude, iter.latitudes[i]);
+        }
+        lastLongitude = iter.longitudes[count - 1];
+        lastLatitude = iter.latitudes[count - 1];
+    }
+
+    if (metrics->numPoints > 0) {
+        metrics->endpointDistance = dist(firstLatitude, firstLongitude, lastLatitude, lastLongitude);
+    }
+
+    metrics->version = line->version;
+    return metrics;
+}
+
 int updatePoint(char * newName, int i, KML * kml) {
     ListIterator iter = createIterator(kml->pointPlacemarks);
     int index = 0;
     void * elem;
     while ((elem = nextElement(&iter)) != NULL) {
         if (index == i) {
+            // In arena mode the new name comes from the arena as well, so deleteKML still releases it.
             PointPlacemark * p = (PointPlacemark *) elem;
-            p->name = malloc(strlen(newName) + 1);
-            strcpy(p->name, newName);
+            char * oldName = p->name;
+            p->name = kmlStrdup(kml->arena, newName);
+            if (hashTableCurrent(kml->pointIndex, kml->pointPlacemarks)) {
+                renameInIndex(kml->pointIndex, kml->pointPlacemarks, p, index, oldName);
+            }
+            kmlFree(kml->arena, oldName);
             return 1;
         }
         index++;
@@ -840,8 +1369,12 @@ int updatePath(char * newName, int i, KML * kml) {
     while ((elem = nextElement(&iter)) != NULL) {
         if (index == i) {
             PathPlacemark * p = (PathPlacemark *) elem;
-            p->name = malloc(strlen(newName) + 1);
-            strcpy(p->name, newName);
+            char * oldName = p->name;
+            p->name = kmlStrdup(kml->arena, newName);
+            if (hashTableCurrent(kml->pathIndex, kml->pathPlacemarks)) {
+                renameInIndex(kml->pathIndex, kml->pathPlacemarks, p, index, oldName);
+            }
+            kmlFree(kml->arena, oldName);
             return 1;
         }
         index++;
@@ -855,13 +1388,14 @@ int updateStyle(char * newColour, int newWidth, int i, KML * kml) {
     void * elem;
     while ((elem = nextElement(&iter)) != NULL) {
         if (index == i) {
+            // The id is unchanged, so the style links stay valid.
             Style * s = (Style *) elem;
-            s->colour = malloc(strlen(newColour) + 1);
-            strcpy(s->colour, newColour);
+            kmlFree(kml->arena, s->colour);
+            s->colour = kmlStrdup(kml->arena, newColour);
             s->width = newWidth;
             return 1;
         }
         index++;
     }
     return 0;
-}
\ No newline at end of file
+}
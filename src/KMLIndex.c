@@ -0,0 +1,512 @@
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+
+// Marks a slot whose entry was removed, so that probing continues past it.
+static const char tombstone[] = "";
+
+static uint64_t hashString(const char * str) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    while (*str != '\0') {
+        hash ^= (unsigned char) *str;
+        hash *= 1099511628211ULL;
+        str++;
+    }
+
+    return hash;
+}
+
+KMLHashTable * initHashTable(int expected) {
+    KMLHashTable * table = malloc(sizeof(KMLHashTable));
+    if (table == NULL) {
+        return NULL;
+    }
+
+    // Keep the load factor at or below one half.
+    int capacity = 16;
+    while (capacity < expected * 2) {
+        capacity *= 2;
+    }
+
+    table->entries = calloc(capacity, sizeof(KMLHashEntry));
+    if (table->entries == NULL) {
+        free(table);
+        return NULL;
+    }
+    table->capacity = capacity;
+    table->count = 0;
+    table->used = 0;
+    table->listModifications = 0;
+
+    return table;
+}
+
+void freeHashTable(KMLHashTable * table) {
+    if (table == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key != NULL && table->entries[i].key != tombstone) {
+            free((char *) table->entries[i].key);
+        }
+    }
+    free(table->entries);
+    free(table);
+}
+
+KMLHashEntry * hashTableFind(const KMLHashTable * table, const char * key) {
+    size_t mask = table->capacity - 1;
+    size_t i = hashString(key) & mask;
+
+    // Linear probing; an empty slot ends the search, a tombstone does not.
+    while (table->entries[i].key != NULL) {
+        if (table->entries[i].key != tombstone && strcmp(table->entries[i].key, key) == 0) {
+            return &table->entries[i];
+        }
+        i = (i + 1) & mask;
+    }
+
+    return NULL;
+}
+
+// Stores an entry whose key is known to be missing, in a table known to have room for it.
+static void placeEntry(KMLHashTable * table, const char * key, void * value, int position) {
+    size_t mask = table->capacity - 1;
+    size_t i = hashString(key) & mask;
+    while (table->entries[i].key != NULL && table->entries[i].key != tombstone) {
+        i = (i + 1) & mask;
+    }
+
+    if (table->entries[i].key == NULL) {
+        table->used++;
+    }
+    table->entries[i].key = key;
+    table->entries[i].value = value;
+    table->entries[i].position = position;
+    table->count++;
+}
+
+static bool growHashTable(KMLHashTable * table) {
+    KMLHashEntry * old = table->entries;
+    int oldCapacity = table->capacity;
+
+    // Double only if live entries need it, otherwise rehashing just clears the tombstones.
+    int capacity = table->count * 2 >= oldCapacity / 2 ? oldCapacity * 2 : oldCapacity;
+    table->entries = calloc(capacity, sizeof(KMLHashEntry));
+    if (table->entries == NULL) {
+        table->entries = old;
+        return false;
+    }
+    table->capacity = capacity;
+    table->count = 0;
+    table->used = 0;
+
+    // The keys are moved, not copied again.
+    for (int i = 0; i < oldCapacity; i++) {
+        if (old[i].key != NULL && old[i].key != tombstone) {
+            placeEntry(table, old[i].key, old[i].value, old[i].position);
+        }
+    }
+
+    free(old);
+    return true;
+}
+
+bool hashTableInsert(KMLHashTable * table, const char * key, void * value, int position) {
+    KMLHashEntry * existing = hashTableFind(table, key);
+    if (existing != NULL) {
+        existing->value = value;
+        existing->position = position;
+        return true;
+    }
+
+    if ((table->used + 1) * 2 > table->capacity) {
+        if (!growHashTable(table)) {
+            return false;
+        }
+    }
+
+    // The table keeps its own copy, so that it never points into a struct that was renamed or freed.
+    char * copy = strdup(key);
+    if (copy == NULL) {
+        return false;
+    }
+    placeEntry(table, copy, value, position);
+
+    return true;
+}
+
+bool hashTableRemove(KMLHashTable * table, const char * key) {
+    KMLHashEntry * entry = hashTableFind(table, key);
+    if (entry == NULL) {
+        return false;
+    }
+
+    free((char *) entry->key);
+    entry->key = tombstone;
+    entry->value = NULL;
+    table->count--;
+
+    return true;
+}
+
+// Both placemark structs start with their name.
+static const char * getPlacemarkName(void * placemark) {
+    return ((PointPlacemark *) placemark)->name;
+}
+
+static const char * getStyleId(void * style) {
+    return ((Style *) style)->id;
+}
+
+static const char * getStyleMapId(void * map) {
+    return ((StyleMap *) map)->id;
+}
+
+KMLHashTable * buildIndex(List * list, const char * (*getKey)(void * data)) {
+    KMLHashTable * table = initHashTable(getLength(list));
+    if (table == NULL) {
+        return NULL;
+    }
+
+    // Only the first struct with a given key is indexed, matching a linear search.
+    int position = 0;
+    void * elem;
+    ListIterator iter = createIterator(list);
+    while ((elem = nextElement(&iter)) != NULL) {
+        const char * key = getKey(elem);
+        if (key != NULL && hashTableFind(table, key) == NULL) {
+            if (!hashTableInsert(table, key, elem, position)) {
+                freeHashTable(table);
+                return NULL;
+            }
+        }
+        position++;
+    }
+    table->listModifications = list->modifications;
+
+    return table;
+}
+
+bool hashTableCurrent(const KMLHashTable * table, const List * list) {
+    return table != NULL && table->listModifications == list->modifications;
+}
+
+KMLHashTable * buildNameIndex(List * placemarks) {
+    return buildIndex(placemarks, &getPlacemarkName);
+}
+
+void renameInIndex(KMLHashTable * table, List * placemarks, void * placemark, int position, const char * oldName) {
+    // Hand the old name on to the next placemark that has it, if this placemark was the one indexed.
+    if (oldName != NULL) {
+        KMLHashEntry * entry = hashTableFind(table, oldName);
+        if (entry != NULL && entry->value == placemark) {
+            hashTableRemove(table, oldName);
+
+            int i = 0;
+            void * elem;
+            ListIterator iter = createIterator(placemarks);
+            while ((elem = nextElement(&iter)) != NULL) {
+                const char * name = getPlacemarkName(elem);
+                if (i > position && name != NULL && strcmp(name, oldName) == 0) {
+                    hashTableInsert(table, name, elem, i);
+                    break;
+                }
+                i++;
+            }
+        }
+    }
+
+    // Take over the new name unless an earlier placemark already has it.
+    const char * newName = getPlacemarkName(placemark);
+    if (newName != NULL) {
+        KMLHashEntry * entry = hashTableFind(table, newName);
+        if (entry == NULL || entry->position > position) {
+            hashTableInsert(table, newName, placemark, position);
+        }
+    }
+}
+
+bool indexKMLNames(KML * doc) {
+    if (doc == NULL) {
+        return false;
+    }
+
+    freeHashTable(doc->pointIndex);
+    freeHashTable(doc->pathIndex);
+    doc->pointIndex = buildNameIndex(doc->pointPlacemarks);
+    doc->pathIndex = buildNameIndex(doc->pathPlacemarks);
+
+    return doc->pointIndex != NULL && doc->pathIndex != NULL;
+}
+
+const char * getStyleUrl(const PathPlacemark * ppm) {
+    void * elem;
+    ListIterator iter = createIterator(ppm->otherElements);
+    while ((elem = nextElement(&iter)) != NULL) {
+        KMLElement * k = (KMLElement *) elem;
+        if (strcmp(k->name, "styleUrl") == 0) {
+            return k->value;
+        }
+    }
+
+    return NULL;
+}
+
+bool stylesLinked(const KML * doc) {
+    // Inserting or deleting a Style or StyleMap behind the library's back makes the links stale.
+    return hashTableCurrent(doc->styleIndex, doc->styles) && hashTableCurrent(doc->styleMapIndex, doc->styleMaps);
+}
+
+static void * findById(const KML * doc, List * list, const KMLHashTable * index, const char * url) {
+    if (url == NULL) {
+        return NULL;
+    }
+
+    // Urls refer to ids in the same document with a leading hashtag.
+    if (url[0] == '#') {
+        url++;
+    }
+
+    // An id changed by hand without invalidateStyleLinks shows up as a hit with the wrong id.
+    if (stylesLinked(doc)) {
+        KMLHashEntry * entry = hashTableFind(index, url);
+        if (entry == NULL) {
+            return NULL;
+        }
+        if (strcmp(((Style *) entry->value)->id, url) == 0) {
+            return entry->value;
+        }
+    }
+
+    // Both Style and StyleMap start with their id.
+    void * elem;
+    ListIterator iter = createIterator(list);
+    while ((elem = nextElement(&iter)) != NULL) {
+        const char * id = ((Style *) elem)->id;
+        if (strcmp(id, url) == 0) {
+            return elem;
+        }
+    }
+
+    return NULL;
+}
+
+StyleMap * findStyleMap(const KML * doc, const char * url) {
+    return findById(doc, doc->styleMaps, doc->styleMapIndex, url);
+}
+
+Style * findStyle(const KML * doc, const char * url) {
+    return findById(doc, doc->styles, doc->styleIndex, url);
+}
+
+bool linkStyles(KML * doc) {
+    if (doc == NULL) {
+        return false;
+    }
+
+    invalidateStyleLinks(doc);
+    doc->styleIndex = buildIndex(doc->styles, &getStyleId);
+    doc->styleMapIndex = buildIndex(doc->styleMaps, &getStyleMapId);
+    if (doc->styleIndex == NULL || doc->styleMapIndex == NULL) {
+        invalidateStyleLinks(doc);
+        return false;
+    }
+
+    // Resolve every link once and stamp it with the current generation.
+    void * elem;
+    ListIterator iter = createIterator(doc->styleMaps);
+    while ((elem = nextElement(&iter)) != NULL) {
+        StyleMap * map = (StyleMap *) elem;
+        map->styles[0] = findStyle(doc, map->url1);
+        map->styles[1] = findStyle(doc, map->url2);
+        map->styleGeneration = doc->styleGeneration;
+    }
+
+    iter = createIterator(doc->pathPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL) {
+        PathPlacemark * ppm = (PathPlacemark *) elem;
+        ppm->styleMap = findStyleMap(doc, getStyleUrl(ppm));
+        ppm->styleGeneration = doc->styleGeneration;
+    }
+
+    return true;
+}
+
+void invalidateStyleLinks(KML * doc) {
+    if (doc == NULL) {
+        return;
+    }
+
+    freeHashTable(doc->styleIndex);
+    freeHashTable(doc->styleMapIndex);
+    doc->styleIndex = NULL;
+    doc->styleMapIndex = NULL;
+
+    // Every link resolved so far now carries an old generation. Zero is never
+    // used, so structs that were never linked never match.
+    doc->styleGeneration++;
+    if (doc->styleGeneration == 0) {
+        doc->styleGeneration++;
+    }
+}
+
+static int compareLengthEntries(const void * first, const void * second) {
+    const KMLLengthEntry * a = (const KMLLengthEntry *) first;
+    const KMLLengthEntry * b = (const KMLLengthEntry *) second;
+
+    // Equal lengths keep document order.
+    if (a->length != b->length) {
+        return a->length < b->length ? -1 : 1;
+    }
+    return a->position - b->position;
+}
+
+KMLLengthIndex * buildLengthIndex(const KML * doc) {
+    KMLLengthIndex * index = malloc(sizeof(KMLLengthIndex));
+    if (index == NULL) {
+        return NULL;
+    }
+
+    index->listModifications = doc->pathPlacemarks->modifications;
+    index->count = getLength(doc->pathPlacemarks);
+    index->entries = malloc((index->count + 1) * sizeof(KMLLengthEntry));
+    if (index->entries == NULL) {
+        free(index);
+        return NULL;
+    }
+
+    int position = 0;
+    void * elem;
+    ListIterator iter = createIterator(doc->pathPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL) {
+        KMLLengthEntry * entry = &index->entries[position];
+        entry->path = (PathPlacemark *) elem;
+        entry->length = getPathLen(entry->path);
+        entry->position = position;
+        position++;
+    }
+    qsort(index->entries, index->count, sizeof(KMLLengthEntry), &compareLengthEntries);
+
+    return index;
+}
+
+void freeLengthIndex(KMLLengthIndex * index) {
+    if (index == NULL) {
+        return;
+    }
+
+    free(index->entries);
+    free(index);
+}
+
+bool indexKMLLengths(KML * doc) {
+    if (doc == NULL) {
+        return false;
+    }
+
+    freeLengthIndex(doc->lengthIndex);
+    doc->lengthIndex = buildLengthIndex(doc);
+
+    return doc->lengthIndex != NULL;
+}
+
+bool lengthIndexCurrent(const KML * doc) {
+    return doc->lengthIndex != NULL && doc->lengthIndex->listModifications == doc->pathPlacemarks->modifications;
+}
+
+// Moves the entry of the path whose Line is line to the place its current length sorts to, in O(n) time.
+static void moveInLengthIndex(KML * doc, const Line * line) {
+    if (!lengthIndexCurrent(doc)) {
+        return;
+    }
+
+    KMLLengthIndex * index = doc->lengthIndex;
+    int from = 0;
+    while (from < index->count && index->entries[from].path->pathData != line) {
+        from++;
+    }
+    if (from == index->count) {
+        return;
+    }
+
+    KMLLengthEntry moved = index->entries[from];
+    moved.length = getPathLen(moved.path);
+
+    // Shift the entries between the old and the new place by one, towards the old place.
+    int to = from;
+    while (to > 0 && compareLengthEntries(&moved, &index->entries[to - 1]) < 0) {
+        to--;
+    }
+    while (to < index->count - 1 && compareLengthEntries(&moved, &index->entries[to + 1]) > 0) {
+        to++;
+    }
+    if (to < from) {
+        memmove(&index->entries[to + 1], &index->entries[to], (from - to) * sizeof(KMLLengthEntry));
+    } else if (to > from) {
+        memmove(&index->entries[from], &index->entries[from + 1], (to - from) * sizeof(KMLLengthEntry));
+    }
+    index->entries[to] = moved;
+}
+
+// Reads the length of every path again and re-sorts the index, for changes to many paths at once.
+static void refreshLengthIndex(KML * doc) {
+    if (!lengthIndexCurrent(doc)) {
+        return;
+    }
+
+    KMLLengthIndex * index = doc->lengthIndex;
+    for (int i = 0; i < index->count; i++) {
+        index->entries[i].length = getPathLen(index->entries[i].path);
+    }
+    qsort(index->entries, index->count, sizeof(KMLLengthEntry), &compareLengthEntries);
+}
+
+int findLengthRange(const KMLLengthIndex * index, double minLength, double maxLength, int * first) {
+    // Binary search for the first entry that is not shorter than minLength.
+    int low = 0;
+    int high = index->count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (index->entries[mid].length < minLength) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    *first = low;
+    int end = low;
+    while (end < index->count && index->entries[end].length <= maxLength) {
+        end++;
+    }
+
+    return end - low;
+}
+
+void recordPathChange(KML * doc, const Line * line) {
+    // Lines built by hand belong to no document.
+    if (doc == NULL) {
+        return;
+    }
+
+    doc->modifications++;
+    dropSpatialIndex(doc);
+    moveInLengthIndex(doc, line);
+}
+
+void recordPathsChange(KML * doc) {
+    doc->modifications++;
+    dropSpatialIndex(doc);
+    refreshLengthIndex(doc);
+}
+
+void recordPointChange(KML * doc) {
+    if (doc == NULL) {
+        return;
+    }
+
+    doc->modifications++;
+    dropSpatialIndex(doc);
+}
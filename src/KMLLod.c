@@ -0,0 +1,219 @@
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+
+static KMLLodPyramid * buildLevels(const CoordinateBuffer * points, unsigned int version) {
+    int count = points->length;
+
+    // Build the levels in scratch space first, since their total size is not known in advance.
+    int capacity = 2 * count + 2;
+    int * scratch = malloc(capacity * sizeof(int));
+    if (scratch == NULL) {
+        return NULL;
+    }
+
+    int levelStart[KML_LOD_MAX_LEVELS + 1];
+    levelStart[0] = 0;
+    for (int i = 0; i < count; i++) {
+        scratch[i] = i;
+    }
+    levelStart[1] = count;
+
+    // Stop once a level is down to its endpoints, since every coarser level would be the same.
+    int numLevels = 1;
+    double tolerance = KML_LOD_BASE_TOLERANCE;
+    while (numLevels < KML_LOD_MAX_LEVELS && levelStart[numLevels] - levelStart[numLevels - 1] > 2) {
+        // The next level is at most as long as the one below it.
+        int belowCount = levelStart[numLevels] - levelStart[numLevels - 1];
+        if (levelStart[numLevels] + belowCount > capacity) {
+            capacity = 2 * (levelStart[numLevels] + belowCount);
+            int * grown = realloc(scratch, capacity * sizeof(int));
+            if (grown == NULL) {
+                free(scratch);
+                return NULL;
+            }
+            scratch = grown;
+        }
+
+        int kept = simplifyIndices(points, &scratch[levelStart[numLevels - 1]], belowCount, tolerance, &scratch[levelStart[numLevels]]);
+        if (kept < 0) {
+            free(scratch);
+            return NULL;
+        }
+
+        numLevels++;
+        levelStart[numLevels] = levelStart[numLevels - 1] + kept;
+        tolerance *= 2;
+    }
+
+    // Copy the levels into one allocation together with the struct.
+    int total = levelStart[numLevels];
+    KMLLodPyramid * pyramid = malloc(sizeof(KMLLodPyramid) + (numLevels + 1 + total) * sizeof(int));
+    if (pyramid == NULL) {
+        free(scratch);
+        return NULL;
+    }
+    pyramid->version = version;
+    pyramid->retired = NULL;
+    pyramid->numLevels = numLevels;
+    pyramid->levelStart = (int *) (pyramid + 1);
+    pyramid->indices = pyramid->levelStart + numLevels + 1;
+    memcpy(pyramid->levelStart, levelStart, (numLevels + 1) * sizeof(int));
+    memcpy(pyramid->indices, scratch, total * sizeof(int));
+
+    free(scratch);
+    return pyramid;
+}
+
+static KMLLodPyramid * buildLodPyramid(const Line * line) {
+    if (line->points.encoding == KML_COORDINATES_DOUBLE) {
+        return buildLevels(&line->points, line->version);
+    }
+
+    // Compact coordinates are decoded once rather than every time a level looks one up.
+    CoordinateBuffer decoded;
+    if (!decodeCoordinateBuffer(&line->points, &decoded)) {
+        return NULL;
+    }
+    KMLLodPyramid * pyramid = buildLevels(&decoded, line->version);
+    freeCoordinateBuffer(&decoded);
+
+    return pyramid;
+}
+
+void freeLodPyramid(KMLLodPyramid * pyramid) {
+    while (pyramid != NULL) {
+        KMLLodPyramid * retired = pyramid->retired;
+        free(pyramid);
+        pyramid = retired;
+    }
+}
+
+void dropLodPyramid(Line * line) {
+    freeLodPyramid(line->lod);
+    line->lod = NULL;
+}
+
+// Returns the current pyramid of a Line, building it if it is missing or stale.
+static const KMLLodPyramid * getLodPyramid(Line * line) {
+    adoptCoordinateList(line);
+    KMLLodPyramid * current = __atomic_load_n(&line->lod, __ATOMIC_ACQUIRE);
+    if (current != NULL && current->version == line->version) {
+        return current;
+    }
+
+    KMLLodPyramid * built = buildLodPyramid(line);
+    if (built == NULL) {
+        return NULL;
+    }
+
+    // Another thread may still be reading the levels of a stale pyramid, so the new one keeps it until the
+    // next change to the path or deleteKML frees both.
+    while (true) {
+        built->retired = current;
+        if (__atomic_compare_exchange_n(&line->lod, &current, built, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return built;
+        }
+
+        // If another thread published a pyramid for the same version first, use that one instead.
+        if (current != NULL && current->version == built->version) {
+            built->retired = NULL;
+            freeLodPyramid(built);
+            return current;
+        }
+    }
+}
+
+const int * getPathLOD(const PathPlacemark * ppm, double metersPerPixel, int * count) {
+    if (count != NULL) {
+        *count = 0;
+    }
+    if (ppm == NULL || ppm->pathData == NULL || count == NULL) {
+        return NULL;
+    }
+
+    // The pyramid is cached state of the Line, so it is built through a const pointer.
+    const KMLLodPyramid * pyramid = getLodPyramid(ppm->pathData);
+    if (pyramid == NULL) {
+        return NULL;
+    }
+
+    // Level i > 0 has a tolerance of KML_LOD_BASE_TOLERANCE * 2^(i - 1). frexp gives the exponent directly.
+    int level = 0;
+    if (metersPerPixel >= KML_LOD_BASE_TOLERANCE) {
+        int exponent;
+        frexp(metersPerPixel / KML_LOD_BASE_TOLERANCE, &exponent);
+        level = exponent;
+    }
+    if (level > pyramid->numLevels - 1) {
+        level = pyramid->numLevels - 1;
+    }
+
+    *count = pyramid->levelStart[level + 1] - pyramid->levelStart[level];
+    return &pyramid->indices[pyramid->levelStart[level]];
+}
+
+static void * buildPyramids(void * data) {
+    KMLLodBuilder * builder = (KMLLodBuilder *) data;
+
+    void * elem;
+    ListIterator iter = createIterator(builder->doc->pathPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL && !__atomic_load_n(&builder->cancel, __ATOMIC_RELAXED)) {
+        PathPlacemark * p = (PathPlacemark *) elem;
+        if (p->pathData != NULL && getLodPyramid(p->pathData) == NULL) {
+            builder->failed = true;
+        }
+    }
+
+    return NULL;
+}
+
+bool buildKMLLod(KML * doc, bool background) {
+    if (doc == NULL) {
+        return false;
+    }
+
+    // Only one background build runs at a time.
+    waitKMLLod(doc);
+
+    KMLLodBuilder * builder = malloc(sizeof(KMLLodBuilder));
+    if (builder == NULL) {
+        return false;
+    }
+    builder->doc = doc;
+    builder->cancel = 0;
+    builder->failed = false;
+
+    if (!background) {
+        buildPyramids(builder);
+        bool ok = !builder->failed;
+        free(builder);
+        return ok;
+    }
+
+    if (pthread_create(&builder->thread, NULL, &buildPyramids, builder) != 0) {
+        free(builder);
+        return false;
+    }
+    doc->lodBuilder = builder;
+
+    return true;
+}
+
+void waitKMLLod(KML * doc) {
+    if (doc == NULL || doc->lodBuilder == NULL) {
+        return;
+    }
+
+    KMLLodBuilder * builder = (KMLLodBuilder *) doc->lodBuilder;
+    pthread_join(builder->thread, NULL);
+    free(builder);
+    doc->lodBuilder = NULL;
+}
+
+void stopKMLLod(KML * doc) {
+    if (doc->lodBuilder != NULL) {
+        KMLLodBuilder * builder = (KMLLodBuilder *) doc->lodBuilder;
+        __atomic_store_n(&builder->cancel, 1, __ATOMIC_RELAXED);
+        waitKMLLod(doc);
+    }
+}
@@ -0,0 +1,134 @@
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+KML * convertFromMemory(const char * buffer, size_t length, const char * url, const KMLSchema * schema, int flags) {
+    // libxml2 takes the size of an in-memory document as an int.
+    if (length > INT_MAX) {
+        return NULL;
+    }
+
+    if (flags & KML_PARSE_STREAM) {
+        double start = getSeconds();
+
+        xmlTextReaderPtr reader = xmlReaderForMemory(buffer, (int) length, url, NULL, getXMLParseOptions(flags));
+        if (reader == NULL) {
+            return NULL;
+        }
+        if (schema != NULL && xmlTextReaderSetSchema(reader, schema->schema) != 0) {
+            xmlFreeTextReader(reader);
+            return NULL;
+        }
+
+        KML * kml = convertFromReader(reader, flags, schema != NULL, NULL);
+
+        xmlFreeTextReader(reader);
+        if (schema != NULL) {
+            recordValidation((KMLSchema *) schema, getSeconds() - start);
+        }
+
+        return kml;
+    }
+
+    xmlDoc * doc = xmlReadMemory(buffer, (int) length, url, NULL, getXMLParseOptions(flags));
+    if (doc == NULL) {
+        return NULL;
+    }
+
+    if (schema != NULL && validateTreeWithSchema(doc, schema) != 0) {
+        xmlFreeDoc(doc);
+        return NULL;
+    }
+
+    KML * kml = convertFromTree(doc, flags, NULL);
+
+    xmlFreeDoc(doc);
+
+    return kml;
+}
+
+KML * convertFromMappedFile(const char * fileName, const KMLSchema * schema, int flags) {
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // Empty files cannot be mapped, and files libxml2 cannot take in one piece are read the usual way.
+    size_t length = (size_t) st.st_size;
+    if (length == 0 || length > INT_MAX) {
+        close(fd);
+        if (schema != NULL) {
+            return createValidKMLFromFile(fileName, schema, flags);
+        }
+        return createKMLWithFlags(fileName, flags);
+    }
+
+    void * data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    // The document is read once from start to end.
+    madvise(data, length, MADV_SEQUENTIAL);
+
+    KML * kml = convertFromMemory(data, length, fileName, schema, flags);
+
+    munmap(data, length);
+
+    return kml;
+}
+
+KML * createKMLFromMemory(const char * buffer, size_t length) {
+    // Null argument check.
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    return convertFromMemory(buffer, length, NULL, NULL, KML_PARSE_DEFAULT);
+}
+
+KML * createValidKMLFromMemory(const char * buffer, size_t length, const char * schemaFile) {
+    // Null argument check.
+    if (buffer == NULL || schemaFile == NULL) {
+        return NULL;
+    }
+
+    KMLSchema * schema = getCachedSchema(schemaFile);
+    if (schema == NULL) {
+        return NULL;
+    }
+
+    return convertFromMemory(buffer, length, NULL, schema, KML_PARSE_DEFAULT);
+}
+
+KML * createKMLMapped(const char * fileName) {
+    // Null argument check.
+    if (fileName == NULL) {
+        return NULL;
+    }
+
+    return convertFromMappedFile(fileName, NULL, KML_PARSE_DEFAULT);
+}
+
+KML * createValidKMLMapped(const char * fileName, const char * schemaFile) {
+    // Null argument check.
+    if (fileName == NULL || schemaFile == NULL) {
+        return NULL;
+    }
+
+    KMLSchema * schema = getCachedSchema(schemaFile);
+    if (schema == NULL) {
+        return NULL;
+    }
+
+    return convertFromMappedFile(fileName, schema, KML_PARSE_DEFAULT);
+}
@@ -0,0 +1,243 @@
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+
+// Same constant as dist() in KMLHelpers.c, so that the tree and dist() agree on where a point is.
+#define DEG_TO_RAD (3.1415926536 / 180)
+
+static void toUnitSphere(double longitude, double latitude, double * xyz) {
+    double th = latitude * DEG_TO_RAD;
+    double ph = longitude * DEG_TO_RAD;
+
+    xyz[0] = cos(th) * cos(ph);
+    xyz[1] = cos(th) * sin(ph);
+    xyz[2] = sin(th);
+}
+
+static double squaredChord(const double * a, const double * b) {
+    double dx = a[0] - b[0];
+    double dy = a[1] - b[1];
+    double dz = a[2] - b[2];
+
+    return dx * dx + dy * dy + dz * dz;
+}
+
+static void swapNodes(KMLPointNode * a, KMLPointNode * b) {
+    KMLPointNode tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+// Partially sorts nodes[low, high) on axis so that nodes[nth] is the node that would be there if they were sorted.
+static void selectNth(KMLPointNode * nodes, int low, int high, int nth, int axis) {
+    high--;
+    while (low < high) {
+        // Median of three pivot, then a Hoare partition.
+        double a = nodes[low].xyz[axis];
+        double b = nodes[low + (high - low) / 2].xyz[axis];
+        double c = nodes[high].xyz[axis];
+        double pivot = fmax(fmin(a, b), fmin(fmax(a, b), c));
+
+        int i = low;
+        int j = high;
+        while (i <= j) {
+            while (nodes[i].xyz[axis] < pivot) {
+                i++;
+            }
+            while (nodes[j].xyz[axis] > pivot) {
+                j--;
+            }
+            if (i <= j) {
+                swapNodes(&nodes[i], &nodes[j]);
+                i++;
+                j--;
+            }
+        }
+
+        // Now [low, j] is at most the pivot, [i, high] at least, and anything in between equals it.
+        if (nth <= j) {
+            high = j;
+        } else if (nth >= i) {
+            low = i;
+        } else {
+            return;
+        }
+    }
+}
+
+static void buildSubtree(KMLPointNode * nodes, int low, int high) {
+    if (high - low < 1) {
+        return;
+    }
+
+    // Split on the axis along which the points are most spread out.
+    double min[3] = {DBL_MAX, DBL_MAX, DBL_MAX};
+    double max[3] = {-DBL_MAX, -DBL_MAX, -DBL_MAX};
+    for (int i = low; i < high; i++) {
+        for (int a = 0; a < 3; a++) {
+            min[a] = fmin(min[a], nodes[i].xyz[a]);
+            max[a] = fmax(max[a], nodes[i].xyz[a]);
+        }
+    }
+    int axis = 0;
+    for (int a = 1; a < 3; a++) {
+        if (max[a] - min[a] > max[axis] - min[axis]) {
+            axis = a;
+        }
+    }
+
+    int root = low + (high - low) / 2;
+    selectNth(nodes, low, high, root, axis);
+    nodes[root].axis = axis;
+
+    buildSubtree(nodes, low, root);
+    buildSubtree(nodes, root + 1, high);
+}
+
+KMLPointTree * buildKMLPointTree(const KML * doc) {
+    if (doc == NULL) {
+        return NULL;
+    }
+
+    KMLPointTree * tree = malloc(sizeof(KMLPointTree));
+    if (tree == NULL) {
+        return NULL;
+    }
+
+    tree->nodes = malloc((getLength(doc->pointPlacemarks) + 1) * sizeof(KMLPointNode));
+    if (tree->nodes == NULL) {
+        free(tree);
+        return NULL;
+    }
+
+    int count = 0;
+    void * elem;
+    ListIterator iter = createIterator(doc->pointPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL) {
+        PointPlacemark * p = (PointPlacemark *) elem;
+        if (p->point == NULL || p->point->coordinate == NULL) {
+            continue;
+        }
+
+        KMLPointNode * node = &tree->nodes[count++];
+        toUnitSphere(p->point->coordinate->longitude, p->point->coordinate->latitude, node->xyz);
+        node->placemark = p;
+        node->axis = 0;
+    }
+    tree->count = count;
+
+    buildSubtree(tree->nodes, 0, count);
+
+    return tree;
+}
+
+void deleteKMLPointTree(KMLPointTree * tree) {
+    if (tree == NULL) {
+        return;
+    }
+
+    free(tree->nodes);
+    free(tree);
+}
+
+// State of one query. The results array doubles as a max-heap on squared chord length while searching.
+typedef struct {
+    const KMLPointNode * nodes;
+    double xyz[3];
+    int k;
+    KMLNeighbour * heap;
+    int size;
+} NearestSearch;
+
+static void offerNeighbour(NearestSearch * search, const KMLPointNode * node, double distance) {
+    KMLNeighbour * heap = search->heap;
+    int i;
+
+    if (search->size < search->k) {
+        // Sift the new entry up from the end.
+        i = search->size++;
+        while (i > 0 && heap[(i - 1) / 2].distance < distance) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    } else if (distance < heap[0].distance) {
+        // Replace the farthest entry and sift down.
+        i = 0;
+        while (true) {
+            int child = 2 * i + 1;
+            if (child >= search->size) {
+                break;
+            }
+            if (child + 1 < search->size && heap[child + 1].distance > heap[child].distance) {
+                child++;
+            }
+            if (heap[child].distance <= distance) {
+                break;
+            }
+            heap[i] = heap[child];
+            i = child;
+        }
+    } else {
+        return;
+    }
+
+    heap[i].placemark = node->placemark;
+    heap[i].distance = distance;
+}
+
+static void searchSubtree(NearestSearch * search, int low, int high) {
+    if (high - low < 1) {
+        return;
+    }
+
+    int root = low + (high - low) / 2;
+    const KMLPointNode * node = &search->nodes[root];
+    offerNeighbour(search, node, squaredChord(node->xyz, search->xyz));
+
+    // Search the side of the splitting plane the query is on first, and the other side only if
+    // the plane is closer than the farthest neighbour found so far.
+    double offset = search->xyz[node->axis] - node->xyz[node->axis];
+    if (offset < 0) {
+        searchSubtree(search, low, root);
+        if (search->size < search->k || offset * offset < search->heap[0].distance) {
+            searchSubtree(search, root + 1, high);
+        }
+    } else {
+        searchSubtree(search, root + 1, high);
+        if (search->size < search->k || offset * offset < search->heap[0].distance) {
+            searchSubtree(search, low, root);
+        }
+    }
+}
+
+static int compareNeighbours(const void * first, const void * second) {
+    double a = ((const KMLNeighbour *) first)->distance;
+    double b = ((const KMLNeighbour *) second)->distance;
+
+    return (a > b) - (a < b);
+}
+
+int findNearestPoints(const KMLPointTree * tree, double longitude, double latitude, int k, KMLNeighbour * results) {
+    if (tree == NULL || k < 0 || (results == NULL && k > 0)) {
+        return -1;
+    }
+
+    NearestSearch search;
+    search.nodes = tree->nodes;
+    toUnitSphere(longitude, latitude, search.xyz);
+    search.k = k < tree->count ? k : tree->count;
+    search.heap = results;
+    search.size = 0;
+
+    if (search.k > 0) {
+        searchSubtree(&search, 0, tree->count);
+    }
+
+    // Report the distances dist() would, and order by them.
+    for (int i = 0; i < search.size; i++) {
+        const Coordinate * c = results[i].placemark->point->coordinate;
+        results[i].distance = dist(latitude, longitude, c->latitude, c->longitude);
+    }
+    qsort(results, search.size, sizeof(KMLNeighbour), &compareNeighbours);
+
+    return search.size;
+}
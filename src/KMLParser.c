@@ -1,153 +1,86 @@
 #include "KMLParser.h"
 #include "KMLHelpers.h"
 
+void kmlInit(void) {
+    xmlInitParser();
+}
+
+void kmlCleanup(void) {
+    clearSchemaCache();
+    xmlSchemaCleanupTypes();
+    xmlCleanupParser();
+}
+
 KML * createKML(const char * filename) {
+    return createKMLWithFlags(filename, KML_PARSE_DEFAULT);
+}
+
+KML* createValidKML(const char * fileName, const char * schemaFile) {
+    return createValidKMLWithFlags(fileName, schemaFile, KML_PARSE_DEFAULT);
+}
+
+KML * createKMLWithFlags(const char * fileName, int flags) {
     // Null argument check.
-    if (filename == NULL) {
+    if (fileName == NULL) {
         return NULL;
     }
 
+    if (flags & KML_PARSE_STREAM) {
+        return createKMLStream(fileName, flags);
+    }
+
     // Parse KML file into XML tree.
     xmlDoc * doc = NULL;
-    xmlNode * root_node = NULL;
-    doc = xmlReadFile(filename, NULL, 0);
+    doc = xmlReadFile(fileName, NULL, getXMLParseOptions(flags));
     if (doc == NULL) {
         return NULL;
     }
-    root_node = xmlDocGetRootElement(doc);
-
-    // Initialize KML struct as well as it's list fields.
-    KML * kml = malloc(sizeof(KML));
-    kml->namespaces = initializeList(&XMLNamespaceToString, &deleteXMLNamespace, &compareXMLNamespace);
-    kml->pointPlacemarks = initializeList(&pointPlacemarkToString, &deletePointPlacemark, &comparePointPlacemarks);
-    kml->pathPlacemarks = initializeList(&pathPlacemarkToString, &deletePathPlacemark, &comparePathPlacemarks);
-    kml->styles = initializeList(&styleToString, &deleteStyle, &compareStyles);
-    kml->styleMaps = initializeList(&styleMapToString, &deleteStyleMap, &compareStyleMaps);
-
-    // Step through the tree iteratively.
-    xmlNode * node = NULL;
-    for (node = root_node; node != NULL; node = node->next) {
-        if (node->type == XML_ELEMENT_NODE) {
-            // Check for kml element.
-            if ((strcmp((char *)node->name, "kml") == 0)) {
-                // Get namespace(s).
-                xmlNs * ns_node = NULL;
-                for (ns_node = node->ns; ns_node != NULL; ns_node = ns_node->next) {
-                    XMLNamespace * ns = initNameSpace(ns_node);
-                    insertBack(kml->namespaces, ns);
-                }
-                // Go lower.
-                node = node->children;
-            }
-            if ((strcmp((char *)node->name, "Document") == 0)) {
-                // Go lower.
-                node = node->children;
-            }
-            // Check for Placemark element.
-            if ((strcmp((char *)node->name, "Placemark") == 0)) {
-                // Point or LineString Placemark?
-                int placemark_type = getPlacemarkType(node->children);
-                // Branch for Point Placemark.
-                if (placemark_type == 1) {
-                    PointPlacemark * pop = initPointPlacemark(node->children, kml);
-                    insertBack(kml->pointPlacemarks, pop);
-                // Branch for Path Placemark.
-                } else if (placemark_type == 0) {
-                    PathPlacemark * pap = initPathPlacemark(node->children, kml);
-                    insertBack(kml->pathPlacemarks, pap);
-                }
-            } 
-            if ((strcmp((char *)node->name, "Style") == 0)) {
-                Style * s = initStyle(node);
-                insertBack(kml->styles, s);
-            }
-            if ((strcmp((char *)node->name, "StyleMap") == 0)) {
-                StyleMap * sm = initStyleMap(node);
-                insertBack(kml->styleMaps, sm);
-            }
-        }
-    }
+
+    KML * kml = convertFromTree(doc, flags, NULL);
 
     xmlFreeDoc(doc);
-    xmlCleanupParser();
 
     return kml;
 }
 
-KML* createValidKML(const char * fileName, const char * schemaFile) {
+KML * createValidKMLWithFlags(const char * fileName, const char * schemaFile, int flags) {
     // Null argument check.
     if (fileName == NULL || schemaFile == NULL) {
         return NULL;
     }
 
-    xmlDoc * doc = NULL;
-    xmlNode * root_node = NULL;
-    doc = xmlReadFile(fileName, NULL, 0);
-    if (doc == NULL) {
+    KMLSchema * schema = getCachedSchema(schemaFile);
+    if (schema == NULL) {
         return NULL;
-    } 
+    }
 
-    int ret = validateTree(doc, schemaFile);
-    if (ret != 0) {
+    return createValidKMLFromFile(fileName, schema, flags);
+}
+
+KML * createValidKMLWithSchema(const char * fileName, const KMLSchema * schema) {
+    // Null argument check.
+    if (fileName == NULL || schema == NULL) {
         return NULL;
     }
 
-    root_node = xmlDocGetRootElement(doc);
-
-    // Initialize KML struct as well as it's list fields.
-    KML * kml = malloc(sizeof(KML));
-    kml->namespaces = initializeList(&XMLNamespaceToString, &deleteXMLNamespace, &compareXMLNamespace);
-    kml->pointPlacemarks = initializeList(&pointPlacemarkToString, &deletePointPlacemark, &comparePointPlacemarks);
-    kml->pathPlacemarks = initializeList(&pathPlacemarkToString, &deletePathPlacemark, &comparePathPlacemarks);
-    kml->styles = initializeList(&styleToString, &deleteStyle, &compareStyles);
-    kml->styleMaps = initializeList(&styleMapToString, &deleteStyleMap, &compareStyleMaps);
-
-    // Step through the tree iteratively.
-    xmlNode * node = NULL;
-    for (node = root_node; node != NULL; node = node->next) {
-        if (node->type == XML_ELEMENT_NODE) {
-            // Check for kml element.
-            if ((strcmp((char *)node->name, "kml") == 0)) {
-                // Get namespace(s).
-                xmlNs * ns_node = NULL;
-                for (ns_node = node->ns; ns_node != NULL; ns_node = ns_node->next) {
-                    XMLNamespace * ns = initNameSpace(ns_node);
-                    insertBack(kml->namespaces, ns);
-                }
-                // Go lower.
-                node = node->children;
-            }
-            if ((strcmp((char *)node->name, "Document") == 0)) {
-                // Go lower.
-                node = node->children;
-            }
-            // Check for Placemark element.
-            if ((strcmp((char *)node->name, "Placemark") == 0)) {
-                // Point or LineString Placemark?
-                int placemark_type = getPlacemarkType(node->children);
-                // Branch for Point Placemark.
-                if (placemark_type == 1) {
-                    PointPlacemark * pop = initPointPlacemark(node->children, kml);
-                    insertBack(kml->pointPlacemarks, pop);
-                // Branch for Path Placemark.
-                } else if (placemark_type == 0) {
-                    PathPlacemark * pap = initPathPlacemark(node->children, kml);
-                    insertBack(kml->pathPlacemarks, pap);
-                }
-            } 
-            if ((strcmp((char *)node->name, "Style") == 0)) {
-                Style * s = initStyle(node);
-                insertBack(kml->styles, s);
-            }
-            if ((strcmp((char *)node->name, "StyleMap") == 0)) {
-                StyleMap * sm = initStyleMap(node);
-                insertBack(kml->styleMaps, sm);
-            }
-        }
+    return createValidKMLFromFile(fileName, schema, KML_PARSE_DEFAULT);
+}
+
+KML * createKMLStream(const char * fileName, int flags) {
+    // Null argument check.
+    if (fileName == NULL) {
+        return NULL;
     }
 
-    xmlFreeDoc(doc);
-    xmlCleanupParser();
+    // The reader only keeps the subtree it is currently positioned on in memory.
+    xmlTextReaderPtr reader = xmlReaderForFile(fileName, NULL, getXMLParseOptions(flags));
+    if (reader == NULL) {
+        return NULL;
+    }
+
+    KML * kml = convertFromReader(reader, flags, false, NULL);
+
+    xmlFreeTextReader(reader);
 
     return kml;
 }
@@ -157,18 +90,50 @@ bool writeKML(const KML* doc, const char* fileName) {
         return false;
     }
 
-    xmlDoc * tree = convertToTree(doc);
-    if (tree == NULL) {
+    // The file is emitted straight from the structs, so memory use does not grow with the document.
+    // An existing file is left alone if the document cannot be written.
+    if (!isWritableKML(doc)) {
         return false;
     }
 
-    int status = xmlSaveFormatFileEnc(fileName, tree, "UTF-8", 1);
-    if (status == -1) {
+    int fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
         return false;
     }
 
-    xmlFreeDoc(tree);
-    return true;
+    bool ok = emitKMLToFd(doc, fd);
+    if (close(fd) != 0) {
+        ok = false;
+    }
+
+    return ok;
+}
+
+bool writeKMLToBuffer(const KML* doc, char** buffer, size_t* length) {
+    if (buffer == NULL || length == NULL) {
+        return false;
+    }
+    *buffer = NULL;
+    *length = 0;
+
+    if (doc == NULL || !isWritableKML(doc)) {
+        return false;
+    }
+
+    return emitKMLToBuffer(doc, buffer, length);
+}
+
+bool writeKMLToFd(const KML* doc, int fd) {
+    if (doc == NULL || fd < 0) {
+        return false;
+    }
+
+    // Checked first, so that nothing is written for a document that cannot be.
+    if (!isWritableKML(doc)) {
+        return false;
+    }
+
+    return emitKMLToFd(doc, fd);
 }
 
 double getPathLen(const PathPlacemark *ppm) {
@@ -176,23 +141,17 @@ double getPathLen(const PathPlacemark *ppm) {
         return 0;
     }
 
-    void * elem;
-    ListIterator iter = createIterator(ppm->pathData->coordinates);
-    int last = getLength(ppm->pathData->coordinates);
-    Coordinate * points[last];
-    int idx = 0;
-    while ((elem = nextElement(&iter)) != NULL) {
-        Coordinate * c = (Coordinate * ) elem;
-        points[idx] = c;
-        idx++;
-    }
+    return updatePathMetrics((PathPlacemark *) ppm)->length;
+}
 
-    double distance = 0;
-    for (int i = 0; i < last - 1; i++) {
-        distance += dist(points[i]->latitude, points[i]->longitude, points[i + 1]->latitude, points[i + 1]->longitude);
+PathMetrics getPathMetrics(const PathPlacemark *ppm) {
+    if (ppm == NULL) {
+        PathMetrics none = {0, 0, 0, 0, 0, 0, 0, 0};
+        return none;
     }
 
-    return distance;
+    // The cache is not part of the observable state of the PathPlacemark, so it is updated through a const pointer.
+    return *updatePathMetrics((PathPlacemark *) ppm);
 }
 
 bool isLoopPath(const PathPlacemark* ppm, double delta) {
@@ -200,39 +159,23 @@ bool isLoopPath(const PathPlacemark* ppm, double delta) {
         return false;
     }
 
-    if (getLength(ppm->pathData->coordinates) < 4) {
+    const PathMetrics * metrics = updatePathMetrics((PathPlacemark *) ppm);
+    if (metrics->numPoints < 4) {
         return false;
     }
 
-    int pos = 0;
-    int last = getLength(ppm->pathData->coordinates) - 1;
-    void * elem;
-    double long1 = 0;
-    double lat1 = 0;
-    double long2 = 0;
-    double lat2 = 0;
-    ListIterator iter = createIterator(ppm->pathData->coordinates);
-    while ((elem = nextElement(&iter)) != NULL) {
-        Coordinate * c = (Coordinate *) elem;
-        if (pos == 0) {
-            long1 = c->longitude;
-            lat1 = c->latitude;
-        }
-        if (pos == last) {
-            long2 = c->longitude;
-            lat2 = c->latitude;
-        }
-    }
-
-    double distance = dist(lat1, long1, lat2, long2);
-
-    if (distance > delta) {
+    // Compare the first and last coordinates of the path.
+    if (metrics->endpointDistance > delta) {
         return false;
     }
     
     return true;
 }
 
+static int comparePositions(const void * first, const void * second) {
+    return ((const KMLLengthEntry *) first)->position - ((const KMLLengthEntry *) second)->position;
+}
+
 List * getPathsWithLength(const KML *doc, double len, double delta) {
     if (doc == NULL || len < 0 || delta < 0) {
         return NULL;
@@ -240,101 +183,155 @@ List * getPathsWithLength(const KML *doc, double len, double delta) {
 
     List * paths = initializeList(&pathPlacemarkToString, &deletePathPlacemark, &comparePathPlacemarks);
 
-    void * elem;
-    ListIterator iter = createIterator(doc->pathPlacemarks);
-    while ((elem = nextElement(&iter)) != NULL) {
-        PathPlacemark * p = (PathPlacemark *) elem;
-        
-        double distance = getPathLen(p);
-        if ((len - distance) <= delta) {
-            insertBack(paths, p);
+    // Without a current index every path is checked.
+    if (!lengthIndexCurrent(doc)) {
+        void * elem;
+        ListIterator iter = createIterator(doc->pathPlacemarks);
+        while ((elem = nextElement(&iter)) != NULL) {
+            PathPlacemark * p = (PathPlacemark *) elem;
+
+            double distance = getPathLen(p);
+            if (fabs(len - distance) <= delta) {
+                insertBack(paths, p);
+            }
         }
 
+        return paths;
+    }
+
+    KMLLengthIndex * index = doc->lengthIndex;
+    int first;
+    int count = findLengthRange(index, len - delta, len + delta, &first);
+
+    // Return the matches in document order rather than by length.
+    KMLLengthEntry * matches = malloc((count + 1) * sizeof(KMLLengthEntry));
+    if (matches == NULL) {
+        return paths;
     }
+    memcpy(matches, &index->entries[first], count * sizeof(KMLLengthEntry));
+    qsort(matches, count, sizeof(KMLLengthEntry), &comparePositions);
 
+    for (int i = 0; i < count; i++) {
+        insertBack(paths, matches[i].path);
+    }
+
+    free(matches);
     return paths;
 }
 
+int findPathsWithLength(const KML *doc, double len, double delta, PathPlacemark **paths, int maxPaths) {
+    if (doc == NULL || len < 0 || delta < 0 || maxPaths < 0 || (paths == NULL && maxPaths > 0)) {
+        return -1;
+    }
+
+    // Without a current index every path is checked, and the matches come in document order.
+    if (!lengthIndexCurrent(doc)) {
+        int count = 0;
+        void * elem;
+        ListIterator iter = createIterator(doc->pathPlacemarks);
+        while ((elem = nextElement(&iter)) != NULL) {
+            PathPlacemark * p = (PathPlacemark *) elem;
+            if (fabs(len - getPathLen(p)) <= delta) {
+                if (count < maxPaths) {
+                    paths[count] = p;
+                }
+                count++;
+            }
+        }
+
+        return count;
+    }
+
+    KMLLengthIndex * index = doc->lengthIndex;
+    int first;
+    int count = findLengthRange(index, len - delta, len + delta, &first);
+    for (int i = 0; i < count && i < maxPaths; i++) {
+        paths[i] = index->entries[first + i].path;
+    }
+
+    return count;
+}
+
 bool validateKML(const KML *doc, const char* schemaFile) {
     if (doc == NULL || schemaFile == NULL) {
         return false;
     }
 
-    xmlDoc * tree = convertToTree(doc);
-    if (tree == NULL) {
+    // The schema is compiled the first time a file name is seen and reused after that.
+    KMLSchema * schema = getCachedSchema(schemaFile);
+    if (schema == NULL) {
         return false;
     }
 
-    int ret = validateTree(tree, schemaFile);
-    if (ret != 0) {
+    // Validated as it is written out, without building a tree.
+    return validateKMLStream(doc, schema) == 0;
+}
+
+bool validateKMLWithSchema(const KML * doc, const KMLSchema * schema) {
+    if (doc == NULL || schema == NULL) {
         return false;
     }
 
-    return true;     
+    return validateKMLStream(doc, schema) == 0;
 }
 
-char * KMLToString(const KML * doc) {
-    KML * kml = (KML *) doc;
+bool appendKMLString(KMLStringBuilder * sb, const KML * doc) {
+    appendString(sb, "    KML\n");
 
-    char * tmpStr = malloc(1000000);
-    strcpy(tmpStr, "    KML\n");
-
-    if (getLength(kml->namespaces) > 0) {
-        strcat(tmpStr, "\n");
-        ListIterator iter = createIterator(kml->namespaces);
+    if (getLength(doc->namespaces) > 0) {
+        appendString(sb, "\n");
+        ListIterator iter = createIterator(doc->namespaces);
         void * elem;
         while ((elem = nextElement(&iter)) != NULL) {
-            char * ns = XMLNamespaceToString(elem);
-            strcat(tmpStr, ns);
-            free(ns);
-	    }
+            appendXMLNamespaceString(sb, elem);
+        }
     }
 
-    if (getLength(kml->pointPlacemarks) > 0) {
-        strcat(tmpStr, "\n    Point Placemarks\n");
-        ListIterator iter = createIterator(kml->pointPlacemarks);
+    if (getLength(doc->pointPlacemarks) > 0) {
+        appendString(sb, "\n    Point Placemarks\n");
+        ListIterator iter = createIterator(doc->pointPlacemarks);
         void * elem;
         while ((elem = nextElement(&iter)) != NULL) {
-            char * p = pointPlacemarkToString(elem);
-            strcat(tmpStr, p);
-            free(p);
-	    }
+            appendPointPlacemarkString(sb, elem);
+        }
     }
 
-    if (getLength(kml->pathPlacemarks) > 0) {
-        strcat(tmpStr, "\n    Path Placemarks\n");
-        ListIterator iter = createIterator(kml->pathPlacemarks);
+    if (getLength(doc->pathPlacemarks) > 0) {
+        appendString(sb, "\n    Path Placemarks\n");
+        ListIterator iter = createIterator(doc->pathPlacemarks);
         void * elem;
         while ((elem = nextElement(&iter)) != NULL) {
-            char * p = pathPlacemarkToString(elem);
-            strcat(tmpStr, p);
-            free(p);
-	    }
+            appendPathPlacemarkString(sb, elem);
+        }
     }
 
-    if (getLength(kml->styles) > 0) {
-        strcat(tmpStr, "\n    Styles\n");
-        ListIterator iter = createIterator(kml->styles);
+    if (getLength(doc->styles) > 0) {
+        appendString(sb, "\n    Styles\n");
+        ListIterator iter = createIterator(doc->styles);
         void * elem;
         while ((elem = nextElement(&iter)) != NULL) {
-            char * p = styleToString(elem);
-            strcat(tmpStr, p);
-            free(p);
-	    }
+            appendStyleString(sb, elem);
+        }
     }
 
-    if (getLength(kml->styleMaps) > 0) {
-        strcat(tmpStr, "\n    StyleMaps\n");
-        ListIterator iter = createIterator(kml->styleMaps);
+    if (getLength(doc->styleMaps) > 0) {
+        appendString(sb, "\n    StyleMaps\n");
+        ListIterator iter = createIterator(doc->styleMaps);
         void * elem;
         while ((elem = nextElement(&iter)) != NULL) {
-            char * p = styleMapToString(elem);
-            strcat(tmpStr, p);
-            free(p);
-	    }
+            appendStyleMapString(sb, elem);
+        }
     }
 
-    return tmpStr;
+    return !sb->failed;
+}
+
+char * KMLToString(const KML * doc) {
+    KMLStringBuilder sb;
+    initStringBuilder(&sb, 4096, NULL, NULL);
+    appendKMLString(&sb, doc);
+
+    return takeStringBuilder(&sb);
 }
 
 void deleteKML(KML * doc) {
@@ -342,14 +339,41 @@ void deleteKML(KML * doc) {
         return;
     }
 
+    freeArena(deleteKMLContents(doc));
+}
+
+KMLArena * deleteKMLContents(KML * doc) {
     KML * k = (KML * ) doc;
 
+    stopKMLLod(k);
+    freeHashTable(k->pointIndex);
+    freeHashTable(k->pathIndex);
+    freeHashTable(k->styleIndex);
+    freeHashTable(k->styleMapIndex);
+    freeLengthIndex(k->lengthIndex);
+    freeSpatialIndex(k->spatialIndex);
+
+    // Everything in an arena document lives in the arena's chunks, except the level of detail
+    // pyramids, which may be built by other threads.
+    if (k->arena != NULL) {
+        void * elem;
+        ListIterator iter = createIterator(k->pathPlacemarks);
+        while ((elem = nextElement(&iter)) != NULL) {
+            freeLodPyramid(((PathPlacemark *) elem)->pathData->lod);
+        }
+
+        KMLArena * arena = k->arena;
+        free(k);
+        return arena;
+    }
+
     freeList(k->namespaces);
     freeList(k->pointPlacemarks);
     freeList(k->pathPlacemarks);
     freeList(k->styles);
     freeList(k->styleMaps);
     free(k);
+    return NULL;
 }
 
 void deletePointPlacemark(void * data) {
@@ -364,33 +388,19 @@ void deletePointPlacemark(void * data) {
     free(pl);
 }
 
-char * pointPlacemarkToString(void * data) {
-    PointPlacemark * pl = (PointPlacemark *) data;
+bool appendPointPlacemarkString(KMLStringBuilder * sb, const PointPlacemark * placemark) {
+    appendString(sb, placemark->name != NULL ? placemark->name : "n/a");
+    appendString(sb, ";");
 
-    char * tmpStr = malloc(100000);
-    
-    if (pl->name) {
-        sprintf(tmpStr, "%s;", pl->name);
-    } else {
-        sprintf(tmpStr, "n/a;");
-    }
-    
-    char * p = pointToString(pl->point);
-    strcat(tmpStr, p);
-    free(p);
+    return appendPointString(sb, placemark->point);
+}
 
-    // if (getLength(pl->otherElements) > 0) {
-    //     strcat(tmpStr, "\n    Placemark elements\n");
-    //     ListIterator iter = createIterator(pl->otherElements);
-    //     void * elem;
-    //     while ((elem = nextElement(&iter)) != NULL) {
-    //         char * k = KMLElementToString(elem);
-    //         strcat(tmpStr, k);
-    //         free(k);
-	//     }
-    // }
+char * pointPlacemarkToString(void * data) {
+    KMLStringBuilder sb;
+    initStringBuilder(&sb, 128, NULL, NULL);
+    appendPointPlacemarkString(&sb, (PointPlacemark *) data);
 
-    return tmpStr;    
+    return takeStringBuilder(&sb);
 }
 
 int comparePointPlacemarks(const void *first, const void *second) {
@@ -410,43 +420,21 @@ void deletePathPlacemark(void * data) {
 
 }
 
-char * pathPlacemarkToString(void * data) {
-    PathPlacemark * pa = (PathPlacemark *) data;
-
-    char * l = malloc(64);
-    strcpy(l, "No");
-    bool isLoop = isLoopPath(pa, 10);
-    if (isLoop == 1) {
-        strcpy(l, "Yes");
-    } 
-    
-    char * tmpStr = malloc(100000);
-    double len = getPathLen(pa);
-
-    if (pa->name) {
-        sprintf(tmpStr, "%s,%f,%s", pa->name, len, l);
-    } else {
-        sprintf(tmpStr, "n/a,%f,%s", len, l);
-    }
+bool appendPathPlacemarkString(KMLStringBuilder * sb, const PathPlacemark * placemark) {
+    double len = getPathLen(placemark);
+    bool isLoop = isLoopPath(placemark, 10);
 
+    appendString(sb, placemark->name != NULL ? placemark->name : "n/a");
 
-    // char * l = lineToString(pa->pathData);
-    // strcat(tmpStr, l);
-    // free(l);
+    return appendFormat(sb, ",%f,%s", len, isLoop ? "Yes" : "No");
+}
 
-    // if (getLength(pa->otherElements) > 0) {
-    //     strcat(tmpStr, "\n    Placemark elements\n");
-    //     ListIterator iter = createIterator(pa->otherElements);
-    //     void * elem;
-    //     while ((elem = nextElement(&iter)) != NULL) {
-    //         char * k = KMLElementToString(elem);
-    //         strcat(tmpStr, k);
-    //         free(k);
-	//     }
-    // }
+char * pathPlacemarkToString(void * data) {
+    KMLStringBuilder sb;
+    initStringBuilder(&sb, 128, NULL, NULL);
+    appendPathPlacemarkString(&sb, (PathPlacemark *) data);
 
-    free(l);
-    return tmpStr;
+    return takeStringBuilder(&sb);
 }
 
 int comparePathPlacemarks(const void *first, const void *second) {
@@ -463,29 +451,16 @@ void deletePoint(void * data) {
     free(p);
 }
 
-char * pointToString(void * data) {
-    Point * point = (Point *) data;
+bool appendPointString(KMLStringBuilder * sb, const Point * point) {
+    return appendCoordinateString(sb, point->coordinate);
+}
 
-    char * c = coordinateToString(point->coordinate);
-    char * tmpStr = malloc(100000);
-    strcpy(tmpStr, "");
-    strcat(tmpStr, c);
-    free(c);
-    // strcat(tmpStr, "\n");
-    
-    
-    // if (getLength(point->otherElements) > 0) {
-    //     strcat(tmpStr, "\n    Point elements\n");
-    //     ListIterator iter = createIterator(point->otherElements);
-    //     void * elem;
-    //     while ((elem = nextElement(&iter)) != NULL) {
-    //         char * k = KMLElementToString(elem);
-    //         strcat(tmpStr, k);
-    //         free(k);
-	//     }
-    // }
+char * pointToString(void * data) {
+    KMLStringBuilder sb;
+    initStringBuilder(&sb, 128, NULL, NULL);
+    appendPointString(&sb, (Point *) data);
 
-    return tmpStr;
+    return takeStringBuilder(&sb);
 }
 
 int comparePoints(const void *first, const void *second) {
@@ -498,19 +473,20 @@ void deleteCoordinate(void * data) {
     free(c);
 }
 
-char * coordinateToString(void * data) {
-    Coordinate * coordinate = (Coordinate *) data;
+bool appendCoordinateString(KMLStringBuilder * sb, const Coordinate * coordinate) {
+    if (coordinate->altitude == DBL_MAX) {
+        return appendFormat(sb, "%f,%f", coordinate->longitude, coordinate->latitude);
+    }
 
-    size_t len = (size_t)snprintf(NULL, 0, "%f %f %f", coordinate->longitude, coordinate->latitude, coordinate->altitude);
-    char * tmpStr = malloc(len + 64);
+    return appendFormat(sb, "%f,%f,%f", coordinate->longitude, coordinate->latitude, coordinate->altitude);
+}
 
-    if (coordinate->altitude == DBL_MAX) {
-        snprintf(tmpStr, len, "%f,%f", coordinate->longitude, coordinate->latitude);
-    } else {
-        snprintf(tmpStr, len, "%f,%f,%f", coordinate->longitude, coordinate->latitude, coordinate->altitude);
-    }   
+char * coordinateToString(void * data) {
+    KMLStringBuilder sb;
+    initStringBuilder(&sb, 64, NULL, NULL);
+    appendCoordinateString(&sb, (Coordinate *) data);
 
-    return tmpStr;
+    return takeStringBuilder(&sb);
 }
 
 int compareCoordinates(const void *first, const void *second) {
@@ -529,13 +505,16 @@ void deleteKMLElement(void * data) {
     free(k);
 }
 
-char * KMLElementToString(void * data) {
-    KMLElement * kmlElement = (KMLElement *) data;
+bool appendKMLElementString(KMLStringBuilder * sb, const KMLElement * element) {
+    return appendFormat(sb, "kml elem    %s: %s\n", element->name, element->value);
+}
 
-    char * tmpStr = malloc(strlen(kmlElement->name) + strlen(kmlElement->value) + 64);
-    sprintf(tmpStr, "kml elem    %s: %s\n", kmlElement->name, kmlElement->value);
+char * KMLElementToString(void * data) {
+    KMLStringBuilder sb;
+    initStringBuilder(&sb, 64, NULL, NULL);
+    appendKMLElementString(&sb, (KMLElement *) data);
 
-    return tmpStr;
+    return takeStringBuilder(&sb);
 }
 
 int compareKMLElements(const void *first, const void *second) {
@@ -556,19 +535,20 @@ void deleteXMLNamespace(void * data) {
     free(ns);
 }
 
-char * XMLNamespaceToString(void * data) {
-    XMLNamespace * ns = (XMLNamespace *) data;
-
-    char * tmpStr;
+bool appendXMLNamespaceString(KMLStringBuilder * sb, const XMLNamespace * ns) {
     if (ns->prefix != NULL) {
-        tmpStr = malloc(strlen(ns->prefix) + strlen(ns->value) + 64);
-        sprintf(tmpStr, "    %s=%s\n", ns->prefix, ns->value);  
-    } else {
-        tmpStr = malloc(strlen(ns->value) + 64);
-        sprintf(tmpStr, "    %s\n", ns->value);  
+        return appendFormat(sb, "    %s=%s\n", ns->prefix, ns->value);
     }
 
-    return tmpStr;
+    return appendFormat(sb, "    %s\n", ns->value);
+}
+
+char * XMLNamespaceToString(void * data) {
+    KMLStringBuilder sb;
+    initStringBuilder(&sb, 64, NULL, NULL);
+    appendXMLNamespaceString(&sb, (XMLNamespace *) data);
+
+    return takeStringBuilder(&sb);
 }
 
 int compareXMLNamespace(const void *first, const void *second) {
@@ -583,16 +563,16 @@ void deleteStyle(void * data) {
     free(s);
 }
 
-char * styleToString(void * data) {
-    Style * s = (Style *) data;
-
-    // char * tmpStr = malloc(strlen(s->id) + strlen(s->colour) + 64);
-    // sprintf(tmpStr, "    id: %s, colour:%s, fill:%d, width:%d\n", s->id, s->colour, s->fill, s->width);
+bool appendStyleString(KMLStringBuilder * sb, const Style * style) {
+    return appendFormat(sb, "%s,%d,%d", style->colour, style->width, style->fill);
+}
 
-    char * tmpStr = malloc(1000);
-    sprintf(tmpStr, "%s,%d,%d", s->colour, s->width, s->fill);
+char * styleToString(void * data) {
+    KMLStringBuilder sb;
+    initStringBuilder(&sb, 64, NULL, NULL);
+    appendStyleString(&sb, (Style *) data);
 
-    return tmpStr;
+    return takeStringBuilder(&sb);
 }
 
 int compareStyles(const void *first, const void *second) {
@@ -610,13 +590,16 @@ void deleteStyleMap(void * data) {
     free(map);
 }
 
-char * styleMapToString(void * data) {
-    StyleMap * map = (StyleMap *) data;
+bool appendStyleMapString(KMLStringBuilder * sb, const StyleMap * map) {
+    return appendFormat(sb, "    id: %s, key1: %s, url1: %s, key2: %s, url2: %s\n", map->id, map->key1, map->url1, map->key2, map->url2);
+}
 
-    char * tmpStr = malloc(strlen(map->id) + strlen(map->key1) + strlen(map->url1) + strlen(map->key2) + strlen(map->url2) +  64);
-    sprintf(tmpStr, "    id: %s, key1: %s, url1: %s, key2: %s, url2: %s\n", map->id, map->key1, map->url1, map->key2, map->url2);
+char * styleMapToString(void * data) {
+    KMLStringBuilder sb;
+    initStringBuilder(&sb, 128, NULL, NULL);
+    appendStyleMapString(&sb, (StyleMap *) data);
 
-    return tmpStr;
+    return takeStringBuilder(&sb);
 }
 
 int compareStyleMaps(const void *first, const void *second) {
@@ -691,6 +674,19 @@ PointPlacemark * getPointPlacemark(const KML * doc, char * name) {
         return NULL;
     }
 
+    // Use the name index unless the list has changed since it was built. A hit whose placemark no
+    // longer has the name was renamed by hand, so the list is searched instead.
+    if (hashTableCurrent(doc->pointIndex, doc->pointPlacemarks)) {
+        KMLHashEntry * entry = hashTableFind(doc->pointIndex, name);
+        if (entry == NULL) {
+            return NULL;
+        }
+        PointPlacemark * p = (PointPlacemark *) entry->value;
+        if (p->name != NULL && strcmp(p->name, name) == 0) {
+            return p;
+        }
+    }
+
     void * elem;
     ListIterator iter = createIterator(doc->pointPlacemarks);
     while ((elem = nextElement(&iter)) != NULL) {
@@ -711,6 +707,19 @@ if (doc == NULL || name == NULL) {
         return NULL;
     }
 
+    // Use the name index unless the list has changed since it was built. A hit whose placemark no
+    // longer has the name was renamed by hand, so the list is searched instead.
+    if (hashTableCurrent(doc->pathIndex, doc->pathPlacemarks)) {
+        KMLHashEntry * entry = hashTableFind(doc->pathIndex, name);
+        if (entry == NULL) {
+            return NULL;
+        }
+        PathPlacemark * p = (PathPlacemark *) entry->value;
+        if (p->name != NULL && strcmp(p->name, name) == 0) {
+            return p;
+        }
+    }
+
     void * elem;
     ListIterator iter = createIterator(doc->pathPlacemarks);
     while ((elem = nextElement(&iter)) != NULL) {
@@ -731,83 +740,306 @@ StyleMap * getMapFromPath(const KML * doc, const PathPlacemark * ppm) {
         return NULL;
     }
 
-    // Go through PathPlacemark elements and look for a styleUrl element.
-    // If found, copy value into url string.
-    char * url = NULL;
-    void * elem;
-    ListIterator iter = createIterator(ppm->otherElements);
-    while ((elem = nextElement(&iter)) != NULL) {
-        KMLElement * k = (KMLElement *) elem;
-        if (strcmp(k->name, "styleUrl") == 0) {
-            url = malloc(strlen(k->value) + 1);
-            strcpy(url, k->value);
-            // Remove leading hashtag.
-            if (url[0] == '#') {
-                memmove(url, url+1, strlen(url));
-            }
-            break;
-        }
+    // Use the link resolved at load time if it is still current.
+    if (ppm->styleGeneration == doc->styleGeneration && stylesLinked(doc)) {
+        return ppm->styleMap;
     }
 
-    // If url string is not initialized, then that means either the PathPlacemark 
-    // has no non-Geography elements, or there is not a styleUrl element present.
-    if (url == NULL) {
+    // If there is no styleUrl element, the PathPlacemark has no StyleMap.
+    return findStyleMap(doc, getStyleUrl(ppm));
+}
+
+Style * getStyleFromMap(const KML * doc, const StyleMap * map, int index) {
+    if (doc == NULL || map == NULL || index < 0 || index > 1) {
         return NULL;
     }
 
-    // Go through StyleMaps and look for StyleMap with an id
-    // that matches the url string. If found, return StyleMap.
-    elem = NULL;
-    iter = createIterator(doc->styleMaps);
-    while ((elem = nextElement(&iter)) != NULL) {
-        StyleMap * sm = (StyleMap *) elem;
-        if (strcmp(sm->id, url) == 0) {
-            free(url);
-            return sm;
+    // Use the link resolved at load time if it is still current.
+    if (map->styleGeneration == doc->styleGeneration && stylesLinked(doc)) {
+        return map->styles[index];
+    }
+
+    // Otherwise look up the url selected by the given index.
+    if (index == 0) {
+        return findStyle(doc, map->url1);
+    }
+    return findStyle(doc, map->url2);
+}
+
+bool setPointCoordinate(Point * point, double longitude, double latitude, double altitude) {
+    if (point == NULL || point->coordinate == NULL) {
+        return false;
+    }
+
+    point->coordinate->longitude = longitude;
+    point->coordinate->latitude = latitude;
+    point->coordinate->altitude = altitude;
+
+    markPointChanged(point);
+    return true;
+}
+
+void markPointChanged(Point * point) {
+    // Points have no cached state of their own, but the spatial index of their document does.
+    if (point != NULL) {
+        recordPointChange(point->document);
+    }
+}
+
+int getNumCoordinates(const Line * line) {
+    if (line == NULL) {
+        return 0;
+    }
+
+    adoptCoordinateList(line);
+    return line->points.length;
+}
+
+Coordinate getLineCoordinate(const Line * line, int index) {
+    // The same values initCoordinate leaves for a coordinate it cannot read.
+    Coordinate none = {-1, -1, DBL_MAX};
+    if (line == NULL) {
+        return none;
+    }
+
+    adoptCoordinateList(line);
+    if (index < 0 || index >= line->points.length) {
+        return none;
+    }
+
+    return decodeCoordinate(&line->points, index);
+}
+
+// Cached metrics compare their version against this one. Zero is never used.
+static void bumpLineVersion(Line * line) {
+    line->version++;
+    if (line->version == 0) {
+        line->version++;
+    }
+}
+
+bool addLineCoordinate(Line * line, double longitude, double latitude, double altitude) {
+    if (line == NULL) {
+        return false;
+    }
+
+    // Compact coordinates are edited as doubles.
+    adoptCoordinateList(line);
+    if (!unpackCoordinateBuffer(&line->points) || !appendCoordinate(&line->points, longitude, latitude, altitude)) {
+        return false;
+    }
+
+    // A filled list only needs the new coordinate at its end.
+    if (line->listFilled) {
+        KMLArena * arena = line->points.arena;
+        Coordinate * c = kmlMalloc(arena, sizeof(Coordinate));
+        if (c != NULL) {
+            c->longitude = longitude;
+            c->latitude = latitude;
+            c->altitude = altitude;
+            kmlInsertBack(arena, line->coordinates, c);
+        }
+        if (getLength(line->coordinates) == line->points.length) {
+            line->listModifications = line->coordinates->modifications;
+        } else {
+            fillCoordinateList(line);
         }
     }
-    
-    if (url != NULL) {
-        free(url);
+
+    bumpLineVersion(line);
+    dropLodPyramid(line);
+    recordPathChange(line->document, line);
+    return true;
+}
+
+bool setLineCoordinate(Line * line, int index, double longitude, double latitude, double altitude) {
+    if (line == NULL) {
+        return false;
     }
-    return NULL;
+    adoptCoordinateList(line);
+    if (index < 0 || index >= line->points.length) {
+        return false;
+    }
+    if (!unpackCoordinateBuffer(&line->points)) {
+        return false;
+    }
+
+    line->points.longitudes[index] = longitude;
+    line->points.latitudes[index] = latitude;
+    line->points.altitudes[index] = altitude;
+
+    // Update the Coordinate in a filled list from whichever end is closer.
+    if (!line->listFilled || getLength(line->coordinates) != line->points.length) {
+        if (line->listFilled) {
+            fillCoordinateList(line);
+        }
+        bumpLineVersion(line);
+        dropLodPyramid(line);
+        recordPathChange(line->document, line);
+        return true;
+    }
+    Node * node;
+    if (index < line->points.length / 2) {
+        node = line->coordinates->head;
+        for (int i = 0; i < index; i++) {
+            node = node->next;
+        }
+    } else {
+        node = line->coordinates->tail;
+        for (int i = line->points.length - 1; i > index; i--) {
+            node = node->previous;
+        }
+    }
+    Coordinate * c = (Coordinate *) node->data;
+    c->longitude = longitude;
+    c->latitude = latitude;
+    c->altitude = altitude;
+
+    bumpLineVersion(line);
+    dropLodPyramid(line);
+    recordPathChange(line->document, line);
+    return true;
 }
 
-Style * getStyleFromMap(const KML * doc, const StyleMap * map, int index) {
-    if (doc == NULL || map == NULL || index < 0 || index > 2) {
-        return NULL;
+void markLineChanged(Line * line) {
+    if (line == NULL) {
+        return;
     }
 
-    // Copy the appropriate StyleMap url determined by the
-    // given index.
-    char * url;
-    if (index == 0) {
-        url = malloc(strlen(map->url1) + 1);
-        strcpy(url, map->url1);
+    syncLine(line);
+    recordPathChange(line->document, line);
+}
+
+void syncLine(Line * line) {
+    dropLodPyramid(line);
 
-    } else if (index == 1) {
-        url = malloc(strlen(map->url2) + 1);
-        strcpy(url, map->url2);
+    // A list changed by hand is adopted as the coordinates, which bumps the version already.
+    if (line->coordinates != NULL && line->coordinates->modifications != line->listModifications) {
+        adoptCoordinateList(line);
+        return;
     }
 
-    if (url[0] == '#') {
-        memmove(url, url+1, strlen(url));
+    if (line->listFilled) {
+        fillCoordinateList(line);
     }
+    bumpLineVersion(line);
+}
+
+bool fillCoordinateList(Line * line) {
+    // Existing Coordinates are overwritten in place, so a path that did not grow allocates nothing.
+    // simplifyKML relies on this to update arena documents from several threads.
+    KMLArena * arena = line->points.arena;
+    List * list = line->coordinates;
+    if (list == NULL) {
+        return false;
+    }
+    Node * node = list->head;
+    bool ok = true;
+
+    Coordinate coordinate;
+    KMLCoordinateIterator iter;
+    initBufferIterator(&iter, &line->points);
+    while (nextCoordinate(&iter, &coordinate)) {
+        if (node != NULL) {
+            *(Coordinate *) node->data = coordinate;
+            node = node->next;
+            continue;
+        }
+
+        Coordinate * c = kmlMalloc(arena, sizeof(Coordinate));
+        if (c == NULL) {
+            ok = false;
+            break;
+        }
+        *c = coordinate;
+        kmlInsertBack(arena, list, c);
+    }
+
+    // Cut off the nodes past the end of the path. Arena nodes stay in the arena.
+    if (node != NULL) {
+        if (node->previous == NULL) {
+            list->head = NULL;
+        } else {
+            node->previous->next = NULL;
+        }
+        list->tail = node->previous;
+        while (node != NULL) {
+            Node * next = node->next;
+            list->length--;
+            if (arena == NULL) {
+                list->deleteData(node->data);
+                free(node);
+            }
+            node = next;
+        }
+        list->modifications++;
+    }
+
+    line->listModifications = list->modifications;
+    line->listFilled = ok && getLength(list) == line->points.length;
+    return line->listFilled;
+}
+
+void dropCoordinateList(Line * line) {
+    List * list = line->coordinates;
+    if (list == NULL) {
+        return;
+    }
+
+    // Arena nodes and Coordinates stay in the arena until the document is deleted.
+    if (line->points.arena == NULL) {
+        clearList(list);
+    } else {
+        list->head = NULL;
+        list->tail = NULL;
+        list->length = 0;
+        list->modifications++;
+    }
+
+    line->listModifications = list->modifications;
+    line->listFilled = false;
+}
+
+void adoptCoordinateList(const Line * line) {
+    if (line == NULL || line->coordinates == NULL || line->coordinates->modifications == line->listModifications) {
+        return;
+    }
+
+    // The list was changed behind the library's back, so it is the up to date copy. The Line is only
+    // const to the caller, like the caches refreshed through const pointers elsewhere.
+    Line * l = (Line *) line;
+    CoordinateBuffer adopted;
+    initCoordinateBuffer(&adopted, NULL);
 
-    // Go through list of Styles in KML struct, if a Style has a
-    // matching id, return it.
     void * elem;
-    ListIterator iter = createIterator(doc->styles);
+    ListIterator iter = createIterator(l->coordinates);
     while ((elem = nextElement(&iter)) != NULL) {
-        Style * s = (Style *) elem;
-        if (strcmp(url, s->id) == 0) {
-            free(url);
-            return s;
+        Coordinate * c = (Coordinate *) elem;
+        if (!appendCoordinate(&adopted, c->longitude, c->latitude, c->altitude)) {
+            freeCoordinateBuffer(&adopted);
+            return;
         }
     }
 
-    if (url != NULL) {
-        free(url);
+    // The arrays go where the old ones came from.
+    shrinkCoordinateBuffer(&adopted, l->points.arena);
+    freeCoordinateBuffer(&l->points);
+    l->points = adopted;
+    l->listModifications = l->coordinates->modifications;
+    l->listFilled = true;
+
+    bumpLineVersion(l);
+}
+
+List * getLineCoordinates(Line * line) {
+    if (line == NULL) {
+        return NULL;
     }
-    return NULL;
-}
\ No newline at end of file
+
+    adoptCoordinateList(line);
+    if (!line->listFilled || getLength(line->coordinates) != line->points.length) {
+        fillCoordinateList(line);
+    }
+
+    return line->coordinates;
+}
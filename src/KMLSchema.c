@@ -0,0 +1,199 @@
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+
+// Size of the chunks validateKMLStream pushes to the parser. The validator appends each chunk of a text node
+// to what it has so far, so larger chunks keep the coordinates of long paths from being copied over and over.
+#define KML_VALIDATE_BUFFER_SIZE (1024 * 1024)
+
+// Schemas compiled on behalf of validateTree, keyed by file name.
+static KMLSchema * schemaCache = NULL;
+static pthread_mutex_t schemaCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+double getSeconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+KMLSchema * loadKMLSchema(const char * schemaFile) {
+    if (schemaFile == NULL) {
+        return NULL;
+    }
+
+    double start = getSeconds();
+
+    xmlSchemaParserCtxtPtr c1 = xmlSchemaNewParserCtxt(schemaFile);
+    if (c1 == NULL) {
+        return NULL;
+    }
+    xmlSchemaSetParserErrors(c1, (xmlSchemaValidityErrorFunc) fprintf, (xmlSchemaValidityWarningFunc) fprintf, stderr);
+    xmlSchemaPtr compiled = xmlSchemaParse(c1);
+    xmlSchemaFreeParserCtxt(c1);
+    if (compiled == NULL) {
+        return NULL;
+    }
+
+    KMLSchema * schema = malloc(sizeof(KMLSchema));
+    schema->schema = compiled;
+    schema->fileName = malloc(strlen(schemaFile) + 1);
+    strcpy(schema->fileName, schemaFile);
+    schema->compileSeconds = getSeconds() - start;
+    schema->validateSeconds = 0;
+    schema->validations = 0;
+    schema->next = NULL;
+    pthread_mutex_init(&schema->lock, NULL);
+
+    return schema;
+}
+
+void deleteKMLSchema(KMLSchema * schema) {
+    if (schema == NULL) {
+        return;
+    }
+
+    xmlSchemaFree(schema->schema);
+    pthread_mutex_destroy(&schema->lock);
+    free(schema->fileName);
+    free(schema);
+}
+
+KMLSchemaStats getKMLSchemaStats(const KMLSchema * schema) {
+    KMLSchemaStats stats = {0, 0, 0};
+    if (schema == NULL) {
+        return stats;
+    }
+
+    KMLSchema * s = (KMLSchema *) schema;
+    pthread_mutex_lock(&s->lock);
+    stats.compileSeconds = s->compileSeconds;
+    stats.validateSeconds = s->validateSeconds;
+    stats.validations = s->validations;
+    pthread_mutex_unlock(&s->lock);
+
+    return stats;
+}
+
+KMLSchema * getCachedSchema(const char * schemaFile) {
+    pthread_mutex_lock(&schemaCacheLock);
+
+    KMLSchema * schema;
+    for (schema = schemaCache; schema != NULL; schema = schema->next) {
+        if (strcmp(schema->fileName, schemaFile) == 0) {
+            break;
+        }
+    }
+
+    // Compile on first use. A schema that fails to compile is not cached, so
+    // that a corrected file is picked up on the next call.
+    if (schema == NULL) {
+        schema = loadKMLSchema(schemaFile);
+        if (schema != NULL) {
+            schema->next = schemaCache;
+            schemaCache = schema;
+        }
+    }
+
+    pthread_mutex_unlock(&schemaCacheLock);
+    return schema;
+}
+
+void clearSchemaCache(void) {
+    pthread_mutex_lock(&schemaCacheLock);
+
+    while (schemaCache != NULL) {
+        KMLSchema * next = schemaCache->next;
+        deleteKMLSchema(schemaCache);
+        schemaCache = next;
+    }
+
+    pthread_mutex_unlock(&schemaCacheLock);
+}
+
+int validateTreeWithSchema(xmlDoc * doc, const KMLSchema * schema) {
+    if (schema == NULL) {
+        return -1;
+    }
+
+    double start = getSeconds();
+
+    // A compiled schema is read-only during validation, so each call only
+    // needs a validation context of its own to be safe to run concurrently.
+    xmlSchemaValidCtxtPtr c2 = xmlSchemaNewValidCtxt(schema->schema);
+    if (c2 == NULL) {
+        return -1;
+    }
+    xmlSchemaSetValidErrors(c2, (xmlSchemaValidityErrorFunc) fprintf, (xmlSchemaValidityWarningFunc) fprintf, stderr);
+    int ret = xmlSchemaValidateDoc(c2, doc);
+    xmlSchemaFreeValidCtxt(c2);
+
+    recordValidation((KMLSchema *) schema, getSeconds() - start);
+
+    return ret;
+}
+
+// Drain of the builder in validateKMLStream. Stops the output at the first error, since the result is known.
+static bool pushToParser(void * target, const char * data, size_t length) {
+    xmlParserCtxtPtr parser = (xmlParserCtxtPtr) target;
+
+    return xmlParseChunk(parser, data, length, 0) == 0 && parser->wellFormed;
+}
+
+int validateKMLStream(const KML * kml, const KMLSchema * schema) {
+    if (schema == NULL || !isWritableKML(kml)) {
+        return -1;
+    }
+
+    double start = getSeconds();
+
+    xmlSchemaValidCtxtPtr c2 = xmlSchemaNewValidCtxt(schema->schema);
+    if (c2 == NULL) {
+        return -1;
+    }
+    xmlSchemaSetValidErrors(c2, (xmlSchemaValidityErrorFunc) fprintf, (xmlSchemaValidityWarningFunc) fprintf, stderr);
+
+    // With no handlers of its own the parser builds nothing; the plug adds the validator's.
+    xmlSAXHandler sax;
+    memset(&sax, 0, sizeof(sax));
+    sax.initialized = XML_SAX2_MAGIC;
+    xmlParserCtxtPtr parser = xmlCreatePushParserCtxt(&sax, NULL, NULL, 0, NULL);
+    if (parser == NULL) {
+        xmlSchemaFreeValidCtxt(c2);
+        return -1;
+    }
+    // Coordinates of a long path are one text node, which may exceed the default limits.
+    xmlCtxtUseOptions(parser, XML_PARSE_HUGE | XML_PARSE_NONET);
+
+    xmlSchemaSAXPlugPtr plug = xmlSchemaSAXPlug(c2, &parser->sax, &parser->userData);
+    if (plug == NULL) {
+        xmlFreeParserCtxt(parser);
+        xmlSchemaFreeValidCtxt(c2);
+        return -1;
+    }
+
+    KMLStringBuilder sb;
+    initStringBuilder(&sb, KML_VALIDATE_BUFFER_SIZE, &pushToParser, parser);
+    bool pushed = !sb.failed && emitKML(kml, &sb);
+    freeStringBuilder(&sb);
+    if (pushed) {
+        pushed = xmlParseChunk(parser, NULL, 0, 1) == 0 && parser->wellFormed;
+    }
+
+    int ret = pushed && xmlSchemaIsValid(c2) == 1 ? 0 : 1;
+
+    // Unplugging puts back the parser's own handler, which the parser frees.
+    xmlSchemaSAXUnplug(plug);
+    xmlFreeParserCtxt(parser);
+    xmlSchemaFreeValidCtxt(c2);
+
+    recordValidation((KMLSchema *) schema, getSeconds() - start);
+
+    return ret;
+}
+
+void recordValidation(KMLSchema * schema, double seconds) {
+    pthread_mutex_lock(&schema->lock);
+    schema->validateSeconds += seconds;
+    schema->validations++;
+    pthread_mutex_unlock(&schema->lock);
+}
@@ -0,0 +1,530 @@
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+
+// Same constants as dist() in KMLHelpers.c.
+#define EARTH_RADIUS 6371e3
+#define DEG_TO_RAD (3.1415926536 / 180)
+
+typedef struct {
+    double x;
+    double y;
+    double z;
+} Vector;
+
+static Vector toUnitVector(double longitude, double latitude) {
+    double th = latitude * DEG_TO_RAD;
+    double ph = longitude * DEG_TO_RAD;
+    Vector v = {cos(th) * cos(ph), cos(th) * sin(ph), sin(th)};
+
+    return v;
+}
+
+static Vector subtract(Vector a, Vector b) {
+    Vector v = {a.x - b.x, a.y - b.y, a.z - b.z};
+    return v;
+}
+
+static Vector cross(Vector a, Vector b) {
+    Vector v = {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+    return v;
+}
+
+static double dot(Vector a, Vector b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+// Great circle distance in meters between two unit vectors.
+static double arcDistance(Vector a, Vector b) {
+    Vector d = subtract(a, b);
+    double chord = sqrt(dot(d, d));
+
+    return asin(fmin(chord / 2, 1)) * 2 * EARTH_RADIUS;
+}
+
+// Distance in meters from p to the great circle arc from a to b.
+static double segmentDistance(Vector p, Vector a, Vector b) {
+    Vector n = cross(a, b);
+    double length = sqrt(dot(n, n));
+
+    // Coincident endpoints make no arc, only a point.
+    if (length < 1e-15) {
+        return arcDistance(p, a);
+    }
+    n.x /= length;
+    n.y /= length;
+    n.z /= length;
+
+    // The foot of the perpendicular from p lies on the arc if it is on the inner side of both endpoints.
+    double s = dot(p, n);
+    Vector foot = {p.x - s * n.x, p.y - s * n.y, p.z - s * n.z};
+    if (dot(cross(a, foot), n) >= 0 && dot(cross(foot, b), n) >= 0) {
+        return fabs(asin(fmax(-1, fmin(s, 1)))) * EARTH_RADIUS;
+    }
+
+    return fmin(arcDistance(p, a), arcDistance(p, b));
+}
+
+// Largest distance from the points strictly between first and last to the arc joining them.
+static double maxDeviation(const Vector * points, int first, int last, int * farthest) {
+    double max = -1;
+    for (int i = first + 1; i < last; i++) {
+        double d = segmentDistance(points[i], points[first], points[last]);
+        if (d > max) {
+            max = d;
+            *farthest = i;
+        }
+    }
+
+    return max;
+}
+
+// Marks the points Douglas-Peucker keeps. Uses an explicit stack of ranges instead of recursion.
+static bool douglasPeucker(const Vector * points, int count, double tolerance, bool * keep) {
+    int * stack = malloc(2 * count * sizeof(int));
+    if (stack == NULL) {
+        return false;
+    }
+
+    keep[0] = true;
+    keep[count - 1] = true;
+    int depth = 0;
+    stack[depth++] = 0;
+    stack[depth++] = count - 1;
+
+    // Every range pushed is split at a point that is then kept, so at most count ranges are pending.
+    while (depth > 0) {
+        int last = stack[--depth];
+        int first = stack[--depth];
+
+        int farthest = first;
+        if (maxDeviation(points, first, last, &farthest) > tolerance) {
+            keep[farthest] = true;
+            stack[depth++] = first;
+            stack[depth++] = farthest;
+            stack[depth++] = farthest;
+            stack[depth++] = last;
+        }
+    }
+
+    free(stack);
+    return true;
+}
+
+// Min-heap of the points Visvalingam may still remove, keyed by effective area.
+typedef struct {
+    int * order;
+    int * slot;
+    double * area;
+    int size;
+} AreaHeap;
+
+static void swapSlots(AreaHeap * heap, int i, int j) {
+    int a = heap->order[i];
+    int b = heap->order[j];
+    heap->order[i] = b;
+    heap->order[j] = a;
+    heap->slot[a] = j;
+    heap->slot[b] = i;
+}
+
+static void siftUp(AreaHeap * heap, int i) {
+    while (i > 0 && heap->area[heap->order[i]] < heap->area[heap->order[(i - 1) / 2]]) {
+        swapSlots(heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void siftDown(AreaHeap * heap, int i) {
+    while (true) {
+        int child = 2 * i + 1;
+        if (child >= heap->size) {
+            return;
+        }
+        if (child + 1 < heap->size && heap->area[heap->order[child + 1]] < heap->area[heap->order[child]]) {
+            child++;
+        }
+        if (heap->area[heap->order[i]] <= heap->area[heap->order[child]]) {
+            return;
+        }
+        swapSlots(heap, i, child);
+        i = child;
+    }
+}
+
+/*
+ * How far the original points between previous and next may be from the path once point i is removed.
+ * spanError holds the same for the span that starts at each point still in the path. An original point
+ * is within its span's error of the arc through i, and that arc is nowhere farther from the arc from
+ * previous to next than i is, so the two add up to a bound that costs nothing to update. The span is only
+ * measured point by point when the bound is over the tolerance, since the bound can be loose.
+*/
+static double removalError(const Vector * points, const double * spanError, int previous, int i, int next, double tolerance) {
+    double bound = fmax(spanError[previous], spanError[i]) + segmentDistance(points[i], points[previous], points[next]);
+    if (bound <= tolerance) {
+        return bound;
+    }
+
+    int farthest;
+    return fmin(bound, maxDeviation(points, previous, next, &farthest));
+}
+
+/*
+ * Effective area of point i between its current neighbours, in square meters, with the error its removal
+ * would leave in removal[i]. A point whose removal would move any original point between the neighbours
+ * more than tolerance from the path gets an infinite area, so the error stays bounded the same way as with
+ * Douglas-Peucker.
+*/
+static double effectiveArea(const Vector * points, const double * spanError, double * removal, int previous, int i, int next, double tolerance) {
+    removal[i] = removalError(points, spanError, previous, i, next, tolerance);
+    if (removal[i] > tolerance) {
+        return INFINITY;
+    }
+
+    Vector n = cross(subtract(points[i], points[previous]), subtract(points[next], points[previous]));
+    return sqrt(dot(n, n)) / 2 * EARTH_RADIUS * EARTH_RADIUS;
+}
+
+// Marks the points Visvalingam-Whyatt keeps, removing the point with the smallest effective area until none can go.
+static bool visvalingam(const Vector * points, int count, double tolerance, bool * keep) {
+    int * previous = malloc(count * sizeof(int));
+    int * next = malloc(count * sizeof(int));
+    double * spanError = malloc(count * sizeof(double));
+    double * removal = malloc(count * sizeof(double));
+    AreaHeap heap;
+    heap.order = malloc(count * sizeof(int));
+    heap.slot = malloc(count * sizeof(int));
+    heap.area = malloc(count * sizeof(double));
+    heap.size = 0;
+    if (previous == NULL || next == NULL || spanError == NULL || removal == NULL || heap.order == NULL || heap.slot == NULL || heap.area == NULL) {
+        free(previous);
+        free(next);
+        free(spanError);
+        free(removal);
+        free(heap.order);
+        free(heap.slot);
+        free(heap.area);
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        keep[i] = true;
+        previous[i] = i - 1;
+        next[i] = i + 1;
+        spanError[i] = 0;
+    }
+    for (int i = 1; i < count - 1; i++) {
+        heap.area[i] = effectiveArea(points, spanError, removal, i - 1, i, i + 1, tolerance);
+        heap.order[heap.size] = i;
+        heap.slot[i] = heap.size;
+        heap.size++;
+        siftUp(&heap, heap.size - 1);
+    }
+
+    double removedArea = 0;
+    while (heap.size > 0 && heap.area[heap.order[0]] != INFINITY) {
+        int i = heap.order[0];
+        removedArea = heap.area[i];
+        swapSlots(&heap, 0, heap.size - 1);
+        heap.size--;
+        siftDown(&heap, 0);
+
+        keep[i] = false;
+        spanError[previous[i]] = removal[i];
+        next[previous[i]] = next[i];
+        previous[next[i]] = previous[i];
+
+        // The neighbours now span more of the original path. Their areas never drop below the
+        // area just removed, so that points are removed in order of significance.
+        int neighbours[2] = {previous[i], next[i]};
+        for (int j = 0; j < 2; j++) {
+            int k = neighbours[j];
+            if (k == 0 || k == count - 1) {
+                continue;
+            }
+            double area = effectiveArea(points, spanError, removal, previous[k], k, next[k], tolerance);
+            heap.area[k] = area < removedArea ? removedArea : area;
+            siftUp(&heap, heap.slot[k]);
+            siftDown(&heap, heap.slot[k]);
+        }
+    }
+
+    free(previous);
+    free(next);
+    free(spanError);
+    free(removal);
+    free(heap.order);
+    free(heap.slot);
+    free(heap.area);
+    return true;
+}
+
+int simplifyIndices(const CoordinateBuffer * buffer, const int * indices, int count, double tolerance, int * kept) {
+    if (count < 3) {
+        memmove(kept, indices, count * sizeof(int));
+        return count;
+    }
+
+    Vector * points = malloc(count * sizeof(Vector));
+    bool * keep = calloc(count, sizeof(bool));
+    if (points == NULL || keep == NULL) {
+        free(points);
+        free(keep);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        points[i] = toUnitVector(buffer->longitudes[indices[i]], buffer->latitudes[indices[i]]);
+    }
+
+    int numKept = -1;
+    if (douglasPeucker(points, count, tolerance, keep)) {
+        numKept = 0;
+        for (int i = 0; i < count; i++) {
+            if (keep[i]) {
+                kept[numKept++] = indices[i];
+            }
+        }
+    }
+
+    free(points);
+    free(keep);
+    return numKept;
+}
+
+// Removes the coordinates of a double buffer that simplification drops, and returns how many are left,
+// or -1 if memory could not be allocated.
+static int removeCoordinates(CoordinateBuffer * buffer, double toleranceMeters, KMLSimplifyAlgorithm algorithm) {
+    int count = buffer->length;
+    Vector * points = malloc(count * sizeof(Vector));
+    bool * keep = calloc(count, sizeof(bool));
+    if (points == NULL || keep == NULL) {
+        free(points);
+        free(keep);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        points[i] = toUnitVector(buffer->longitudes[i], buffer->latitudes[i]);
+    }
+
+    bool ok;
+    if (algorithm == KML_SIMPLIFY_DOUGLAS_PEUCKER) {
+        ok = douglasPeucker(points, count, toleranceMeters, keep);
+    } else {
+        ok = visvalingam(points, count, toleranceMeters, keep);
+    }
+    free(points);
+    if (!ok) {
+        free(keep);
+        return -1;
+    }
+
+    // Move the kept coordinates to the front of the arrays.
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (keep[i]) {
+            buffer->longitudes[kept] = buffer->longitudes[i];
+            buffer->latitudes[kept] = buffer->latitudes[i];
+            buffer->altitudes[kept] = buffer->altitudes[i];
+            kept++;
+        }
+    }
+    free(keep);
+
+    if (kept < count) {
+        buffer->length = kept;
+
+        // Arena arrays are only released with the arena, and reallocating them here would not be thread safe.
+        if (buffer->arena == NULL) {
+            shrinkCoordinateBuffer(buffer, NULL);
+        }
+    }
+
+    return kept;
+}
+
+// simplifyPath without updating the length index of the document, so that simplifyKML can run it on several threads.
+static bool simplifyLine(PathPlacemark * ppm, double toleranceMeters, KMLSimplifyAlgorithm algorithm, KMLSimplifyResult * result) {
+    if (result != NULL) {
+        result->pointsRemoved = 0;
+        result->lengthChange = 0;
+    }
+    if (ppm == NULL || ppm->pathData == NULL || toleranceMeters < 0) {
+        return false;
+    }
+    if (algorithm != KML_SIMPLIFY_DOUGLAS_PEUCKER && algorithm != KML_SIMPLIFY_VISVALINGAM) {
+        return false;
+    }
+
+    Line * line = ppm->pathData;
+    adoptCoordinateList(line);
+    int count = line->points.length;
+    if (count < 3) {
+        return true;
+    }
+    double oldLength = getPathLen(ppm);
+
+    int kept;
+    if (line->points.encoding == KML_COORDINATES_DOUBLE) {
+        kept = removeCoordinates(&line->points, toleranceMeters, algorithm);
+    } else {
+        // Compact coordinates are simplified as doubles and encoded again where they came from.
+        CoordinateBuffer decoded;
+        if (!decodeCoordinateBuffer(&line->points, &decoded)) {
+            return false;
+        }
+        kept = removeCoordinates(&decoded, toleranceMeters, algorithm);
+        if (kept >= 0 && kept < count && !packCoordinateBuffer(&decoded, line->points.encoding, line->points.arena)) {
+            kept = -1;
+        }
+
+        if (kept >= 0 && kept < count) {
+            freeCoordinateBuffer(&line->points);
+            line->points = decoded;
+        } else {
+            freeCoordinateBuffer(&decoded);
+        }
+    }
+    if (kept < 0) {
+        return false;
+    }
+
+    if (kept < count) {
+        syncLine(line);
+    }
+
+    if (result != NULL) {
+        result->pointsRemoved = count - kept;
+        result->lengthChange = getPathLen(ppm) - oldLength;
+    }
+
+    return true;
+}
+
+bool simplifyPath(PathPlacemark * ppm, double toleranceMeters, KMLSimplifyAlgorithm algorithm, KMLSimplifyResult * result) {
+    if (!simplifyLine(ppm, toleranceMeters, algorithm, result)) {
+        return false;
+    }
+
+    recordPathChange(ppm->pathData->document, ppm->pathData);
+    return true;
+}
+
+// Work shared by the threads of simplifyKML. Each thread takes the next path from paths until none are left.
+typedef struct {
+    PathPlacemark ** paths;
+    int numPaths;
+    int next;
+    double toleranceMeters;
+    KMLSimplifyAlgorithm algorithm;
+} SimplifyJob;
+
+typedef struct {
+    SimplifyJob * job;
+    KMLSimplifyResult total;
+    bool ok;
+} SimplifyWorker;
+
+static void * simplifyPaths(void * data) {
+    SimplifyWorker * worker = (SimplifyWorker *) data;
+    SimplifyJob * job = worker->job;
+
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->numPaths) {
+        KMLSimplifyResult result;
+        if (!simplifyLine(job->paths[i], job->toleranceMeters, job->algorithm, &result)) {
+            worker->ok = false;
+            continue;
+        }
+        worker->total.pointsRemoved += result.pointsRemoved;
+        worker->total.lengthChange += result.lengthChange;
+    }
+
+    return NULL;
+}
+
+bool simplifyKML(KML * doc, double toleranceMeters, KMLSimplifyAlgorithm algorithm, int numThreads, KMLSimplifyResult * result) {
+    if (result != NULL) {
+        result->pointsRemoved = 0;
+        result->lengthChange = 0;
+    }
+    if (doc == NULL || toleranceMeters < 0) {
+        return false;
+    }
+
+    if (numThreads <= 0) {
+        numThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    int numPaths = getLength(doc->pathPlacemarks);
+    if (numThreads > numPaths) {
+        numThreads = numPaths;
+    }
+    if (numThreads < 1) {
+        numThreads = 1;
+    }
+
+    SimplifyJob job;
+    job.paths = malloc((numPaths + 1) * sizeof(PathPlacemark *));
+    SimplifyWorker * workers = calloc(numThreads, sizeof(SimplifyWorker));
+    pthread_t * threads = malloc(numThreads * sizeof(pthread_t));
+    if (job.paths == NULL || workers == NULL || threads == NULL) {
+        free(job.paths);
+        free(workers);
+        free(threads);
+        return false;
+    }
+
+    int n = 0;
+    void * elem;
+    ListIterator iter = createIterator(doc->pathPlacemarks);
+    bool arenaPacking = false;
+    while ((elem = nextElement(&iter)) != NULL) {
+        PathPlacemark * p = (PathPlacemark *) elem;
+        job.paths[n++] = p;
+
+        // Encoding simplified compact coordinates allocates from the arena, which is not thread safe.
+        if (p->pathData != NULL && p->pathData->points.encoding != KML_COORDINATES_DOUBLE && p->pathData->points.arena != NULL) {
+            arenaPacking = true;
+        }
+    }
+    job.numPaths = n;
+    if (arenaPacking) {
+        numThreads = 1;
+    }
+    job.next = 0;
+    job.toleranceMeters = toleranceMeters;
+    job.algorithm = algorithm;
+
+    // The calling thread is the first worker. If a thread cannot be started, the others pick up its share.
+    int started = 1;
+    for (int t = 0; t < numThreads; t++) {
+        workers[t].job = &job;
+        workers[t].ok = true;
+    }
+    for (int t = 1; t < numThreads; t++) {
+        if (pthread_create(&threads[started], NULL, &simplifyPaths, &workers[started]) != 0) {
+            break;
+        }
+        started++;
+    }
+    simplifyPaths(&workers[0]);
+
+    bool ok = workers[0].ok;
+    KMLSimplifyResult total = workers[0].total;
+    for (int t = 1; t < started; t++) {
+        pthread_join(threads[t], NULL);
+        ok = ok && workers[t].ok;
+        total.pointsRemoved += workers[t].total.pointsRemoved;
+        total.lengthChange += workers[t].total.lengthChange;
+    }
+
+    free(job.paths);
+    free(workers);
+    free(threads);
+
+    // Every path may have moved, so the length index is sorted once rather than path by path.
+    recordPathsChange(doc);
+
+    if (result != NULL) {
+        *result = total;
+    }
+    return ok;
+}
@@ -0,0 +1,329 @@
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+
+// Maximum number of children of an R-tree node.
+#define SPATIAL_NODE_SIZE 16
+
+// Deep enough for a depth-first query of any tree that fits in memory: each level adds at most
+// SPATIAL_NODE_SIZE - 1 pending nodes, and 2^32 items need fewer than 9 levels.
+#define SPATIAL_STACK_SIZE (SPATIAL_NODE_SIZE * 16)
+
+// Both comparators see the KMLBox at the start of a KMLSpatialItem or KMLSpatialNode.
+static int compareCenterX(const void * first, const void * second) {
+    const KMLBox * a = (const KMLBox *) first;
+    const KMLBox * b = (const KMLBox *) second;
+    double centerA = a->minX + a->maxX;
+    double centerB = b->minX + b->maxX;
+
+    return (centerA > centerB) - (centerA < centerB);
+}
+
+static int compareCenterY(const void * first, const void * second) {
+    const KMLBox * a = (const KMLBox *) first;
+    const KMLBox * b = (const KMLBox *) second;
+    double centerA = a->minY + a->maxY;
+    double centerB = b->minY + b->maxY;
+
+    return (centerA > centerB) - (centerA < centerB);
+}
+
+/*
+ * Sort-Tile-Recursive ordering: sort by x, cut into about sqrt(groups) vertical slices of whole
+ * groups, and sort each slice by y. Consecutive runs of SPATIAL_NODE_SIZE elements then make
+ * compact, mostly non-overlapping nodes. Elements are KMLSpatialItems or KMLSpatialNodes.
+*/
+static void strSort(void * base, int count, size_t size) {
+    int groups = (count + SPATIAL_NODE_SIZE - 1) / SPATIAL_NODE_SIZE;
+    int slices = (int) ceil(sqrt(groups));
+    int sliceSize = slices * SPATIAL_NODE_SIZE;
+
+    qsort(base, count, size, &compareCenterX);
+    for (int start = 0; start < count; start += sliceSize) {
+        int length = count - start < sliceSize ? count - start : sliceSize;
+        qsort((char *) base + start * size, length, size, &compareCenterY);
+    }
+}
+
+// Returns the box that covers count consecutive elements, as laid out for strSort.
+static KMLBox coverBoxes(const void * base, int count, size_t size) {
+    KMLBox cover = *(const KMLBox *) base;
+    for (int i = 1; i < count; i++) {
+        const KMLBox * box = (const KMLBox *) ((const char *) base + i * size);
+        cover.minX = fmin(cover.minX, box->minX);
+        cover.minY = fmin(cover.minY, box->minY);
+        cover.maxX = fmax(cover.maxX, box->maxX);
+        cover.maxY = fmax(cover.maxY, box->maxY);
+    }
+
+    return cover;
+}
+
+// Groups count elements, the first of which has index first, into nodes, and returns how many nodes it made.
+static int packLevel(const void * base, int count, size_t size, int first, bool leaf, KMLSpatialNode * nodes) {
+    int made = 0;
+    for (int start = 0; start < count; start += SPATIAL_NODE_SIZE) {
+        KMLSpatialNode * node = &nodes[made++];
+        node->count = count - start < SPATIAL_NODE_SIZE ? count - start : SPATIAL_NODE_SIZE;
+        node->box = coverBoxes((const char *) base + start * size, node->count, size);
+        node->first = first + start;
+        node->leaf = leaf;
+    }
+
+    return made;
+}
+
+KMLSpatialIndex * buildSpatialIndex(const KML * doc) {
+    KMLSpatialIndex * index = malloc(sizeof(KMLSpatialIndex));
+    if (index == NULL) {
+        return NULL;
+    }
+
+    index->retired = NULL;
+    index->modifications = doc->modifications;
+    index->pointListModifications = doc->pointPlacemarks->modifications;
+    index->pathListModifications = doc->pathPlacemarks->modifications;
+    index->items = malloc((getLength(doc->pointPlacemarks) + getLength(doc->pathPlacemarks) + 1) * sizeof(KMLSpatialItem));
+    if (index->items == NULL) {
+        free(index);
+        return NULL;
+    }
+
+    // Points are boxes with no area. Paths use the bounding box from their cached metrics.
+    int numItems = 0;
+    void * elem;
+    ListIterator iter = createIterator(doc->pointPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL) {
+        PointPlacemark * p = (PointPlacemark *) elem;
+        if (p->point == NULL || p->point->coordinate == NULL) {
+            continue;
+        }
+
+        KMLSpatialItem * item = &index->items[numItems++];
+        item->box.minX = item->box.maxX = p->point->coordinate->longitude;
+        item->box.minY = item->box.maxY = p->point->coordinate->latitude;
+        item->placemark = p;
+        item->isPath = false;
+    }
+
+    iter = createIterator(doc->pathPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL) {
+        PathPlacemark * p = (PathPlacemark *) elem;
+        const PathMetrics * metrics = updatePathMetrics(p);
+        if (metrics->numPoints == 0) {
+            continue;
+        }
+
+        KMLSpatialItem * item = &index->items[numItems++];
+        item->box.minX = metrics->minLongitude;
+        item->box.minY = metrics->minLatitude;
+        item->box.maxX = metrics->maxLongitude;
+        item->box.maxY = metrics->maxLatitude;
+        item->placemark = p;
+        item->isPath = true;
+    }
+    index->numItems = numItems;
+
+    // Every level has a sixteenth of the nodes of the one below, rounded up, down to a single root.
+    int numNodes = 0;
+    int levelCount = numItems;
+    do {
+        levelCount = (levelCount + SPATIAL_NODE_SIZE - 1) / SPATIAL_NODE_SIZE;
+        numNodes += levelCount > 0 ? levelCount : 1;
+    } while (levelCount > 1);
+
+    index->nodes = malloc(numNodes * sizeof(KMLSpatialNode));
+    if (index->nodes == NULL) {
+        free(index->items);
+        free(index);
+        return NULL;
+    }
+
+    // An empty document gets a single empty leaf as its root.
+    if (numItems == 0) {
+        KMLBox empty = {0, 0, 0, 0};
+        index->nodes[0].box = empty;
+        index->nodes[0].first = 0;
+        index->nodes[0].count = 0;
+        index->nodes[0].leaf = true;
+        index->numNodes = 1;
+        index->height = 1;
+        return index;
+    }
+
+    strSort(index->items, numItems, sizeof(KMLSpatialItem));
+    int levelStart = 0;
+    levelCount = packLevel(index->items, numItems, sizeof(KMLSpatialItem), 0, true, index->nodes);
+    index->height = 1;
+
+    // Each level is sorted in place before its parents are packed, which only reorders nodes whose
+    // children are already in their final place.
+    while (levelCount > 1) {
+        KMLSpatialNode * level = &index->nodes[levelStart];
+        strSort(level, levelCount, sizeof(KMLSpatialNode));
+
+        int parentStart = levelStart + levelCount;
+        levelCount = packLevel(level, levelCount, sizeof(KMLSpatialNode), levelStart, false, &index->nodes[parentStart]);
+        levelStart = parentStart;
+        index->height++;
+    }
+    index->numNodes = levelStart + levelCount;
+
+    return index;
+}
+
+void freeSpatialIndex(KMLSpatialIndex * index) {
+    while (index != NULL) {
+        KMLSpatialIndex * retired = index->retired;
+        free(index->items);
+        free(index->nodes);
+        free(index);
+        index = retired;
+    }
+}
+
+void dropSpatialIndex(KML * doc) {
+    freeSpatialIndex(doc->spatialIndex);
+    doc->spatialIndex = NULL;
+}
+
+bool indexKMLSpatial(KML * doc) {
+    if (doc == NULL) {
+        return false;
+    }
+
+    dropSpatialIndex(doc);
+    doc->spatialIndex = buildSpatialIndex(doc);
+
+    return doc->spatialIndex != NULL;
+}
+
+// Whether no placemark was inserted, deleted or moved since index was built.
+static bool spatialIndexMatches(const KMLSpatialIndex * index, const KML * doc) {
+    return index != NULL && index->modifications == doc->modifications
+        && index->pointListModifications == doc->pointPlacemarks->modifications
+        && index->pathListModifications == doc->pathPlacemarks->modifications;
+}
+
+// Returns the current index of doc, building it if it is missing or stale, or NULL if it could not be built.
+static const KMLSpatialIndex * getSpatialIndex(const KML * doc) {
+    // The index is cached state of the document, so it is published through a const pointer.
+    KMLSpatialIndex ** slot = &((KML *) doc)->spatialIndex;
+    KMLSpatialIndex * current = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (spatialIndexMatches(current, doc)) {
+        return current;
+    }
+
+    KMLSpatialIndex * built = buildSpatialIndex(doc);
+    if (built == NULL) {
+        return NULL;
+    }
+
+    // Another thread may still be querying a stale index, so the new one keeps it until the next change
+    // through the library, indexKMLSpatial or deleteKML frees both.
+    while (true) {
+        built->retired = current;
+        if (__atomic_compare_exchange_n(slot, &current, built, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return built;
+        }
+
+        // If another thread published an index of the same state first, use that one instead.
+        if (spatialIndexMatches(current, doc)) {
+            built->retired = NULL;
+            freeSpatialIndex(built);
+            return current;
+        }
+    }
+}
+
+static bool boxesIntersect(const KMLBox * a, const KMLBox * b) {
+    return a->minX <= b->maxX && a->maxX >= b->minX && a->minY <= b->maxY && a->maxY >= b->minY;
+}
+
+// Checks every placemark, for when the index could not be built.
+static int scanBBox(const KML * doc, const KMLBox * query, KMLBBoxCallback callback, void * userData) {
+    int found = 0;
+
+    void * elem;
+    ListIterator iter = createIterator(doc->pointPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL) {
+        PointPlacemark * p = (PointPlacemark *) elem;
+        if (p->point == NULL || p->point->coordinate == NULL) {
+            continue;
+        }
+
+        KMLBox box;
+        box.minX = box.maxX = p->point->coordinate->longitude;
+        box.minY = box.maxY = p->point->coordinate->latitude;
+        if (boxesIntersect(&box, query)) {
+            found++;
+            if (!callback(p, false, userData)) {
+                return found;
+            }
+        }
+    }
+
+    iter = createIterator(doc->pathPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL) {
+        PathPlacemark * p = (PathPlacemark *) elem;
+        PathMetrics metrics = getPathMetrics(p);
+        if (metrics.numPoints == 0) {
+            continue;
+        }
+
+        KMLBox box = {metrics.minLongitude, metrics.minLatitude, metrics.maxLongitude, metrics.maxLatitude};
+        if (boxesIntersect(&box, query)) {
+            found++;
+            if (!callback(p, true, userData)) {
+                return found;
+            }
+        }
+    }
+
+    return found;
+}
+
+int kmlQueryBBox(const KML * doc, double minLon, double minLat, double maxLon, double maxLat, KMLBBoxCallback callback, void * userData) {
+    if (doc == NULL || callback == NULL) {
+        return -1;
+    }
+
+    KMLBox query = {minLon, minLat, maxLon, maxLat};
+
+    // Without the memory for an index, every placemark is checked.
+    const KMLSpatialIndex * index = getSpatialIndex(doc);
+    if (index == NULL) {
+        return scanBBox(doc, &query, callback, userData);
+    }
+
+    int found = 0;
+
+    // Depth-first search from the root.
+    int stack[SPATIAL_STACK_SIZE];
+    int depth = 0;
+    stack[depth++] = index->numNodes - 1;
+    while (depth > 0) {
+        const KMLSpatialNode * node = &index->nodes[stack[--depth]];
+        if (!boxesIntersect(&node->box, &query)) {
+            continue;
+        }
+
+        if (!node->leaf) {
+            for (int i = 0; i < node->count; i++) {
+                stack[depth++] = node->first + i;
+            }
+            continue;
+        }
+
+        for (int i = 0; i < node->count; i++) {
+            const KMLSpatialItem * item = &index->items[node->first + i];
+            if (boxesIntersect(&item->box, &query)) {
+                found++;
+                if (!callback(item->placemark, item->isPath, userData)) {
+                    return found;
+                }
+            }
+        }
+    }
+
+    return found;
+}
@@ -0,0 +1,638 @@
+#include "KMLHelpers.h"
+#include "KMLParser.h"
+
+// Size of the buffer of a string builder that drains its contents as it goes.
+#define KML_WRITER_BUFFER_SIZE (64 * 1024)
+
+void initStringBuilder(KMLStringBuilder * sb, size_t capacity, bool (*drain)(void * target, const char * data, size_t length), void * target) {
+    sb->data = malloc(capacity + 1);
+    sb->length = 0;
+    sb->capacity = sb->data != NULL ? capacity : 0;
+    sb->drain = drain;
+    sb->target = target;
+    sb->failed = sb->data == NULL;
+    if (sb->data != NULL) {
+        sb->data[0] = '\0';
+    }
+}
+
+void freeStringBuilder(KMLStringBuilder * sb) {
+    free(sb->data);
+    sb->data = NULL;
+    sb->length = 0;
+    sb->capacity = 0;
+}
+
+bool flushStringBuilder(KMLStringBuilder * sb) {
+    if (!sb->failed && sb->drain != NULL && sb->length > 0) {
+        sb->failed = !sb->drain(sb->target, sb->data, sb->length);
+        sb->length = 0;
+        sb->data[0] = '\0';
+    }
+
+    return !sb->failed;
+}
+
+bool appendBytes(KMLStringBuilder * sb, const char * bytes, size_t length) {
+    if (sb->failed) {
+        return false;
+    }
+
+    if (length > sb->capacity - sb->length) {
+        if (sb->drain != NULL) {
+            // Drain what is buffered, and pass anything too large to buffer straight through.
+            if (!flushStringBuilder(sb)) {
+                return false;
+            }
+            if (length >= sb->capacity) {
+                sb->failed = !sb->drain(sb->target, bytes, length);
+                return !sb->failed;
+            }
+        } else {
+            // The extra byte keeps room for the terminating NUL.
+            size_t capacity = sb->capacity * 2 > sb->length + length ? sb->capacity * 2 : sb->length + length;
+            char * grown = realloc(sb->data, capacity + 1);
+            if (grown == NULL) {
+                sb->failed = true;
+                return false;
+            }
+            sb->data = grown;
+            sb->capacity = capacity;
+        }
+    }
+
+    memcpy(sb->data + sb->length, bytes, length);
+    sb->length += length;
+    sb->data[sb->length] = '\0';
+
+    return true;
+}
+
+char * takeStringBuilder(KMLStringBuilder * sb) {
+    if (sb->failed) {
+        freeStringBuilder(sb);
+        return NULL;
+    }
+
+    char * data = sb->data;
+    sb->data = NULL;
+    sb->length = 0;
+    sb->capacity = 0;
+
+    return data;
+}
+
+bool appendString(KMLStringBuilder * sb, const char * str) {
+    return appendBytes(sb, str, strlen(str));
+}
+
+bool appendFormat(KMLStringBuilder * sb, const char * format, ...) {
+    if (sb->failed) {
+        return false;
+    }
+
+    char buffer[4 * KML_NUMBER_LENGTH];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (length < 0) {
+        sb->failed = true;
+        return false;
+    }
+    if ((size_t) length < sizeof(buffer)) {
+        return appendBytes(sb, buffer, length);
+    }
+
+    // Too long for the stack, such as %f of a huge value.
+    char * formatted = malloc(length + 1);
+    if (formatted == NULL) {
+        sb->failed = true;
+        return false;
+    }
+    va_start(args, format);
+    vsnprintf(formatted, length + 1, format, args);
+    va_end(args);
+    bool ok = appendBytes(sb, formatted, length);
+    free(formatted);
+
+    return ok;
+}
+
+// Entity for a character that cannot appear as itself in text, or in an attribute value if attribute is true.
+static const char * getEscape(char c, bool attribute) {
+    switch (c) {
+        case '<':
+            return "&lt;";
+        case '>':
+            return "&gt;";
+        case '&':
+            return "&amp;";
+        case '\r':
+            return "&#13;";
+        case '"':
+            return attribute ? "&quot;" : NULL;
+        case '\n':
+            return attribute ? "&#10;" : NULL;
+        case '\t':
+            return attribute ? "&#9;" : NULL;
+        default:
+            return NULL;
+    }
+}
+
+bool appendEscaped(KMLStringBuilder * sb, const char * text, bool attribute) {
+    // Copy runs of characters that need no escaping in one go.
+    const char * run = text;
+    const char * pos;
+    for (pos = text; *pos != '\0'; pos++) {
+        const char * escape = getEscape(*pos, attribute);
+        if (escape != NULL) {
+            appendBytes(sb, run, pos - run);
+            appendString(sb, escape);
+            run = pos + 1;
+        }
+    }
+
+    return appendBytes(sb, run, pos - run);
+}
+
+// Every power of ten that is exactly representable as a double.
+static const double powersOf10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Writes m with a decimal point before its last decimals digits, and returns the length.
+static int formatDecimal(char * buffer, uint64_t m, int decimals) {
+    char digits[24];
+    int count = 0;
+    do {
+        digits[count++] = '0' + m % 10;
+        m /= 10;
+    } while (m > 0 || count <= decimals);
+
+    int length = 0;
+    while (count > decimals) {
+        buffer[length++] = digits[--count];
+    }
+    if (decimals > 0) {
+        buffer[length++] = '.';
+        while (count > 0) {
+            buffer[length++] = digits[--count];
+        }
+    }
+    buffer[length] = '\0';
+
+    return length;
+}
+
+int formatDouble(char * buffer, double value) {
+    if (!isfinite(value)) {
+        return sprintf(buffer, "%.17g", value);
+    }
+
+    char * out = buffer;
+    if (signbit(value)) {
+        *out++ = '-';
+        value = -value;
+    }
+
+    // Find the fewest decimals d for which the nearest multiple m of 10^-d reads back as value. While m and
+    // 10^d are exact doubles, m / 10^d is correctly rounded, so it is exactly what strtod makes of the digits.
+    for (int d = 0; d < (int) (sizeof(powersOf10) / sizeof(powersOf10[0])); d++) {
+        double scaled = value * powersOf10[d];
+        if (scaled >= 9007199254740992.0) {
+            break;
+        }
+
+        uint64_t m = (uint64_t) (scaled + 0.5);
+        if ((double) m / powersOf10[d] == value) {
+            return (out - buffer) + formatDecimal(out, m, d);
+        }
+    }
+
+    // Too large, too small or too many digits for the loop above.
+    int length = 0;
+    for (int precision = 15; precision <= 17; precision++) {
+        length = sprintf(out, "%.*g", precision, value);
+        if (strtod(out, NULL) == value) {
+            break;
+        }
+    }
+
+    return (out - buffer) + length;
+}
+
+int formatCoordinate(char * buffer, double longitude, double latitude, double altitude) {
+    int length = formatDouble(buffer, longitude);
+    buffer[length++] = ',';
+    length += formatDouble(buffer + length, latitude);
+    if (altitude != DBL_MAX) {
+        buffer[length++] = ',';
+        length += formatDouble(buffer + length, altitude);
+    }
+
+    return length;
+}
+
+// Prefix of every element, as convertToTree puts all of them in the first namespace of the document.
+typedef struct {
+    KMLStringBuilder * sb;
+    const char * prefix;
+} KMLEmitter;
+
+static void appendIndent(KMLEmitter * e, int depth) {
+    static const char spaces[] = "                                ";
+    int width = 2 * depth < (int) sizeof(spaces) - 1 ? 2 * depth : (int) sizeof(spaces) - 1;
+    appendBytes(e->sb, spaces, width);
+}
+
+static void appendName(KMLEmitter * e, const char * name) {
+    if (e->prefix != NULL) {
+        appendString(e->sb, e->prefix);
+        appendBytes(e->sb, ":", 1);
+    }
+    appendString(e->sb, name);
+}
+
+// Opens an element whose children are elements, with an optional id attribute.
+static void appendStartTag(KMLEmitter * e, int depth, const char * name, const char * id) {
+    appendIndent(e, depth);
+    appendBytes(e->sb, "<", 1);
+    appendName(e, name);
+    if (id != NULL) {
+        appendString(e->sb, " id=\"");
+        appendEscaped(e->sb, id, true);
+        appendBytes(e->sb, "\"", 1);
+    }
+    appendBytes(e->sb, ">\n", 2);
+}
+
+static void appendEndTag(KMLEmitter * e, int depth, const char * name) {
+    appendIndent(e, depth);
+    appendBytes(e->sb, "</", 2);
+    appendName(e, name);
+    appendBytes(e->sb, ">\n", 2);
+}
+
+// An element holding text. Without text it is written as an empty element.
+static void appendTextElement(KMLEmitter * e, int depth, const char * name, const char * text) {
+    appendIndent(e, depth);
+    appendBytes(e->sb, "<", 1);
+    appendName(e, name);
+    if (text == NULL || text[0] == '\0') {
+        appendBytes(e->sb, "/>\n", 3);
+        return;
+    }
+
+    appendBytes(e->sb, ">", 1);
+    appendEscaped(e->sb, text, false);
+    appendBytes(e->sb, "</", 2);
+    appendName(e, name);
+    appendBytes(e->sb, ">\n", 2);
+}
+
+static void appendElements(KMLEmitter * e, int depth, const List * elements) {
+    void * elem;
+    ListIterator iter = createIterator((List *) elements);
+    while ((elem = nextElement(&iter)) != NULL) {
+        KMLElement * k = (KMLElement *) elem;
+        appendTextElement(e, depth, k->name, k->value);
+    }
+}
+
+static void appendStyleMaps(KMLEmitter * e, int depth, const KML * kml) {
+    void * elem;
+    ListIterator iter = createIterator(kml->styleMaps);
+    while ((elem = nextElement(&iter)) != NULL) {
+        StyleMap * sm = (StyleMap *) elem;
+
+        appendStartTag(e, depth, "StyleMap", sm->id);
+        appendStartTag(e, depth + 1, "Pair", NULL);
+        appendTextElement(e, depth + 2, "key", sm->key1);
+        appendTextElement(e, depth + 2, "styleUrl", sm->url1);
+        appendEndTag(e, depth + 1, "Pair");
+        appendStartTag(e, depth + 1, "Pair", NULL);
+        appendTextElement(e, depth + 2, "key", sm->key2);
+        appendTextElement(e, depth + 2, "styleUrl", sm->url2);
+        appendEndTag(e, depth + 1, "Pair");
+        appendEndTag(e, depth, "StyleMap");
+    }
+}
+
+static void appendStyles(KMLEmitter * e, int depth, const KML * kml) {
+    char number[32];
+    void * elem;
+    ListIterator iter = createIterator(kml->styles);
+    while ((elem = nextElement(&iter)) != NULL) {
+        Style * s = (Style *) elem;
+
+        appendStartTag(e, depth, "Style", s->id);
+        appendStartTag(e, depth + 1, "LineStyle", NULL);
+        appendTextElement(e, depth + 2, "color", s->colour);
+        if (s->width != -1) {
+            snprintf(number, sizeof(number), "%d", s->width);
+            appendTextElement(e, depth + 2, "width", number);
+        }
+        appendEndTag(e, depth + 1, "LineStyle");
+
+        if (s->fill != -1) {
+            appendStartTag(e, depth + 1, "PolyStyle", NULL);
+            snprintf(number, sizeof(number), "%d", s->fill);
+            appendTextElement(e, depth + 2, "fill", number);
+            appendEndTag(e, depth + 1, "PolyStyle");
+        }
+        appendEndTag(e, depth, "Style");
+    }
+}
+
+static void appendPointPlacemarks(KMLEmitter * e, int depth, const KML * kml) {
+    char coordinate[KML_COORDINATE_LENGTH];
+    void * elem;
+    ListIterator iter = createIterator(kml->pointPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL) {
+        PointPlacemark * p = (PointPlacemark *) elem;
+
+        appendStartTag(e, depth, "Placemark", NULL);
+        if (p->name != NULL) {
+            appendTextElement(e, depth + 1, "name", p->name);
+        }
+        appendElements(e, depth + 1, p->otherElements);
+
+        appendStartTag(e, depth + 1, "Point", NULL);
+        appendElements(e, depth + 2, p->point->otherElements);
+        const Coordinate * c = p->point->coordinate;
+        formatCoordinate(coordinate, c->longitude, c->latitude, c->altitude);
+        appendTextElement(e, depth + 2, "coordinates", coordinate);
+        appendEndTag(e, depth + 1, "Point");
+
+        appendEndTag(e, depth, "Placemark");
+    }
+}
+
+static void appendPathPlacemarks(KMLEmitter * e, int depth, const KML * kml) {
+    char coordinate[KML_COORDINATE_LENGTH];
+    void * elem;
+    ListIterator iter = createIterator(kml->pathPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL) {
+        PathPlacemark * p = (PathPlacemark *) elem;
+
+        appendStartTag(e, depth, "Placemark", NULL);
+        if (p->name != NULL) {
+            appendTextElement(e, depth + 1, "name", p->name);
+        }
+        appendElements(e, depth + 1, p->otherElements);
+
+        appendStartTag(e, depth + 1, "LineString", NULL);
+        appendElements(e, depth + 2, p->pathData->otherElements);
+
+        // Streamed one coordinate at a time, each followed by a space. They need no escaping.
+        appendIndent(e, depth + 2);
+        appendBytes(e->sb, "<", 1);
+        appendName(e, "coordinates");
+        appendBytes(e->sb, ">", 1);
+        Coordinate c;
+        KMLCoordinateIterator coordinateIter;
+        initCoordinateIterator(&coordinateIter, p->pathData);
+        while (nextCoordinate(&coordinateIter, &c)) {
+            int length = formatCoordinate(coordinate, c.longitude, c.latitude, c.altitude);
+            coordinate[length++] = ' ';
+            appendBytes(e->sb, coordinate, length);
+        }
+        appendBytes(e->sb, "</", 2);
+        appendName(e, "coordinates");
+        appendBytes(e->sb, ">\n", 2);
+
+        appendEndTag(e, depth + 1, "LineString");
+        appendEndTag(e, depth, "Placemark");
+    }
+}
+
+static bool isValidString(const char * str) {
+    return str != NULL && str[0] != '\0';
+}
+
+static bool areValidElements(const List * elements) {
+    if (elements == NULL) {
+        return false;
+    }
+
+    void * elem;
+    ListIterator iter = createIterator((List *) elements);
+    while ((elem = nextElement(&iter)) != NULL) {
+        KMLElement * k = (KMLElement *) elem;
+        if (!isValidString(k->name) || !isValidString(k->value)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Coordinates of -1 are rejected as convertToTree rejects them, since they are what a missing value is parsed to.
+bool isWritableKML(const KML * kml) {
+    if (kml->namespaces == NULL || kml->pointPlacemarks == NULL || kml->pathPlacemarks == NULL || kml->styles == NULL || kml->styleMaps == NULL) {
+        return false;
+    }
+
+    void * elem;
+    ListIterator iter = createIterator(kml->namespaces);
+    while ((elem = nextElement(&iter)) != NULL) {
+        if (!isValidString(((XMLNamespace *) elem)->value)) {
+            return false;
+        }
+    }
+
+    iter = createIterator(kml->styleMaps);
+    while ((elem = nextElement(&iter)) != NULL) {
+        if (!isValidString(((StyleMap *) elem)->id)) {
+            return false;
+        }
+    }
+
+    iter = createIterator(kml->styles);
+    while ((elem = nextElement(&iter)) != NULL) {
+        Style * s = (Style *) elem;
+        if (!isValidString(s->id) || !isValidString(s->colour)) {
+            return false;
+        }
+    }
+
+    iter = createIterator(kml->pointPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL) {
+        PointPlacemark * p = (PointPlacemark *) elem;
+        if (p->point == NULL || p->point->coordinate == NULL || !areValidElements(p->otherElements) || !areValidElements(p->point->otherElements)) {
+            return false;
+        }
+        if (p->point->coordinate->longitude == -1 || p->point->coordinate->latitude == -1) {
+            return false;
+        }
+    }
+
+    iter = createIterator(kml->pathPlacemarks);
+    while ((elem = nextElement(&iter)) != NULL) {
+        PathPlacemark * p = (PathPlacemark *) elem;
+        adoptCoordinateList(p->pathData);
+        if (p->pathData == NULL || p->pathData->points.length < 2 || !areValidElements(p->otherElements) || !areValidElements(p->pathData->otherElements)) {
+            return false;
+        }
+
+        int count;
+        KMLCoordinateIterator coordinateIter;
+        initCoordinateIterator(&coordinateIter, p->pathData);
+        while ((count = nextCoordinateBlock(&coordinateIter)) > 0) {
+            for (int i = 0; i < count; i++) {
+                if (coordinateIter.longitudes[i] == -1 || coordinateIter.latitudes[i] == -1) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+// Namespace names are not escaped, only quoted so that the quotes they contain survive, as libxml2 writes them.
+static void appendQuoted(KMLStringBuilder * sb, const char * value) {
+    if (strchr(value, '"') == NULL) {
+        appendBytes(sb, "\"", 1);
+        appendString(sb, value);
+        appendBytes(sb, "\"", 1);
+    } else if (strchr(value, '\'') == NULL) {
+        appendBytes(sb, "'", 1);
+        appendString(sb, value);
+        appendBytes(sb, "'", 1);
+    } else {
+        appendBytes(sb, "\"", 1);
+        for (const char * c = value; *c != '\0'; c++) {
+            if (*c == '"') {
+                appendString(sb, "&quot;");
+            } else {
+                appendBytes(sb, c, 1);
+            }
+        }
+        appendBytes(sb, "\"", 1);
+    }
+}
+
+// Whether convertToTree declares ns: xmlNewNs skips a prefix that is already declared, and the predefined xml prefix.
+static bool isDeclared(const KML * kml, const XMLNamespace * ns) {
+    if (ns->prefix != NULL && strcmp(ns->prefix, "xml") == 0 && strcmp(ns->value, (const char *) XML_XML_NAMESPACE) == 0) {
+        return false;
+    }
+
+    void * elem;
+    ListIterator iter = createIterator(kml->namespaces);
+    while ((elem = nextElement(&iter)) != ns) {
+        const char * prefix = ((XMLNamespace *) elem)->prefix;
+        if (prefix == ns->prefix || (prefix != NULL && ns->prefix != NULL && strcmp(prefix, ns->prefix) == 0)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool emitKML(const KML * kml, KMLStringBuilder * sb) {
+    KMLEmitter e;
+    e.sb = sb;
+    e.prefix = NULL;
+
+    // The first namespace is the namespace of the root element, and so of every element, if it is declared.
+    XMLNamespace * first = getFromFront(kml->namespaces);
+    if (first != NULL && isDeclared(kml, first)) {
+        e.prefix = first->prefix;
+    }
+
+    appendString(sb, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<");
+    appendName(&e, "kml");
+    void * elem;
+    ListIterator iter = createIterator(kml->namespaces);
+    while ((elem = nextElement(&iter)) != NULL) {
+        XMLNamespace * ns = (XMLNamespace *) elem;
+        if (!isDeclared(kml, ns)) {
+            continue;
+        }
+
+        if (ns->prefix == NULL) {
+            appendString(sb, " xmlns=");
+        } else {
+            appendString(sb, " xmlns:");
+            appendString(sb, ns->prefix);
+            appendBytes(sb, "=", 1);
+        }
+        appendQuoted(sb, ns->value);
+    }
+
+    int numPoints = getLength(kml->pointPlacemarks);
+    int numPaths = getLength(kml->pathPlacemarks);
+    int numStyles = getLength(kml->styles);
+    int numStyleMaps = getLength(kml->styleMaps);
+    if (numPoints + numPaths + numStyles + numStyleMaps == 0) {
+        appendBytes(sb, "/>\n", 3);
+        return flushStringBuilder(sb);
+    }
+    appendBytes(sb, ">\n", 2);
+
+    // Several placemarks, or any StyleMap, go inside a Document element.
+    bool document = numPaths > 1 || numPoints > 1 || numStyleMaps > 0;
+    int depth = 1;
+    if (document) {
+        appendStartTag(&e, depth++, "Document", NULL);
+    }
+
+    appendStyleMaps(&e, depth, kml);
+    appendStyles(&e, depth, kml);
+    appendPointPlacemarks(&e, depth, kml);
+    appendPathPlacemarks(&e, depth, kml);
+
+    if (document) {
+        appendEndTag(&e, --depth, "Document");
+    }
+    appendEndTag(&e, 0, "kml");
+
+    return flushStringBuilder(sb);
+}
+
+static bool drainToFd(void * target, const char * data, size_t length) {
+    int fd = *(int *) target;
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+
+    return true;
+}
+
+bool emitKMLToFd(const KML * kml, int fd) {
+    KMLStringBuilder sb;
+    initStringBuilder(&sb, KML_WRITER_BUFFER_SIZE, &drainToFd, &fd);
+    bool ok = !sb.failed && emitKML(kml, &sb);
+    freeStringBuilder(&sb);
+
+    return ok;
+}
+
+bool emitKMLToBuffer(const KML * kml, char ** buffer, size_t * length) {
+    // Without a drain the builder grows, so the document ends up in one buffer the caller takes over.
+    KMLStringBuilder sb;
+    initStringBuilder(&sb, KML_WRITER_BUFFER_SIZE, NULL, NULL);
+    emitKML(kml, &sb);
+
+    *length = sb.length;
+    *buffer = takeStringBuilder(&sb);
+    if (*buffer == NULL) {
+        *length = 0;
+        return false;
+    }
+
+    return true;
+}
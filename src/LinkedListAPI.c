@@ -19,6 +19,7 @@ List * initializeList(char* (*printFunction)(void* toBePrinted),void (*deleteFun
 	tmpList->tail = NULL;
 
 	tmpList->length = 0;
+	tmpList->modifications = 0;
 
 	tmpList->deleteData = deleteFunction;
 	tmpList->compare = compareFunction;
@@ -69,6 +70,7 @@ void clearList(List* list){
 	list->head = NULL;
 	list->tail = NULL;
 	list->length = 0;
+	(list->modifications)++;
 }
 
 /**Function for creating a node for the linked list. 
@@ -106,6 +108,7 @@ void insertBack(List* list, void* toBeAdded){
 	}
 	
 	(list->length)++;
+	(list->modifications)++;
 
 	Node* newNode = initializeNode(toBeAdded);
 	
@@ -131,6 +134,7 @@ void insertFront(List* list, void* toBeAdded){
 	}
 	
 	(list->length)++;
+	(list->modifications)++;
 
 	Node* newNode = initializeNode(toBeAdded);
 	
@@ -198,6 +202,7 @@ void* deleteDataFromList(List* list, void* toBeDeleted){
 			free(delNode);
 			
 			(list->length)--;
+			(list->modifications)++;
 
 			return data;
 			
@@ -258,6 +263,7 @@ void insertSorted(List *list, void *toBeAdded){
 			currNode->previous->next = newNode;
 			currNode->previous = newNode;
 			(list->length)++;
+			(list->modifications)++;
 
 			return;
 		}
@@ -278,17 +284,27 @@ returned string must be freed by the calling function.
 char* toString(List * list){
 	ListIterator iter = createIterator(list);
 	char* str;
+	size_t len = 0;
+	size_t capacity = 64;
 		
-	str = (char*)malloc(sizeof(char));
+	str = (char*)malloc(capacity);
 	strcpy(str, "");
 	
 	void* elem;
 	while((elem = nextElement(&iter)) != NULL){
 		char* currDescr = list->printData(elem);
-		int newLen = strlen(str)+50+strlen(currDescr);
-		str = (char*)realloc(str, newLen);
-		strcat(str, "\n");
-		strcat(str, currDescr);
+		size_t descrLen = strlen(currDescr);
+
+		// Grow geometrically and append at the known end, so that this is linear in the output
+		if (len + descrLen + 2 > capacity){
+			while (len + descrLen + 2 > capacity){
+				capacity *= 2;
+			}
+			str = (char*)realloc(str, capacity);
+		}
+		str[len++] = '\n';
+		memcpy(str + len, currDescr, descrLen + 1);
+		len += descrLen;
 		
 		free(currDescr);
 	}
@@ -0,0 +1,258 @@
+/*
+ * Stress test for concurrent loading: every KML file in a corpus directory is parsed from many threads at
+ * once, through each of the loading functions, and each result must print the same as a load made on one
+ * thread. The threads run between kmlInit and kmlCleanup several times over, so that setting up and
+ * tearing down the library between batches is exercised as well.
+ *
+ * Usage: testConcurrentLoad [corpusDir] [numThreads] [rounds]     (defaults: test-files 8 10)
+ * Exits with 1 if any load differs from the single-threaded one. createValidKML is only tested if
+ * bin/ogckml22.xsd can be compiled, which needs network access for the schemas it imports.
+*/
+
+#include "KMLParser.h"
+#include <dirent.h>
+#include <pthread.h>
+
+#define SCHEMA_FILE "bin/ogckml22.xsd"
+#define MAX_FILES 256
+#define NUM_CYCLES 3
+
+typedef enum {
+    LOAD_DEFAULT,
+    LOAD_ARENA,
+    LOAD_STREAM,
+    LOAD_COMPACT,
+    LOAD_VALID,
+    LOAD_MEMORY,
+    LOAD_CONTEXT,
+    NUM_LOADS
+} LoadKind;
+
+static const char * loadNames[NUM_LOADS] = {"createKML", "KML_PARSE_ARENA", "KML_PARSE_STREAM", "KML_PARSE_COMPACT",
+    "createValidKML", "createKMLFromMemory", "createKMLWithCtx"};
+
+typedef struct {
+    char * fileName;
+    char * contents;
+    size_t length;
+    // KMLToString of the single-threaded load of each kind, or NULL if that load failed.
+    char * expected[NUM_LOADS];
+} CorpusFile;
+
+typedef struct {
+    CorpusFile * files;
+    int numFiles;
+    int rounds;
+    // False if the schema could not be compiled, in which case createValidKML is left out.
+    bool validating;
+    int failures;
+} Corpus;
+
+typedef struct {
+    Corpus * corpus;
+    int id;
+    KMLParserCtx * ctx;
+} Worker;
+
+static char * readFile(const char * fileName, size_t * length) {
+    FILE * fp = fopen(fileName, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char * contents = malloc(size + 1);
+    if (contents == NULL || fread(contents, 1, size, fp) != (size_t) size) {
+        free(contents);
+        fclose(fp);
+        return NULL;
+    }
+    contents[size] = '\0';
+    fclose(fp);
+
+    *length = (size_t) size;
+    return contents;
+}
+
+static KML * load(const CorpusFile * file, LoadKind kind, KMLParserCtx * ctx) {
+    switch (kind) {
+        case LOAD_DEFAULT:
+            return createKML(file->fileName);
+        case LOAD_ARENA:
+            return createKMLWithFlags(file->fileName, KML_PARSE_ARENA);
+        case LOAD_STREAM:
+            return createKMLWithFlags(file->fileName, KML_PARSE_STREAM);
+        case LOAD_COMPACT:
+            return createKMLWithFlags(file->fileName, KML_PARSE_COMPACT);
+        case LOAD_VALID:
+            return createValidKML(file->fileName, SCHEMA_FILE);
+        case LOAD_MEMORY:
+            return createKMLFromMemory(file->contents, file->length);
+        case LOAD_CONTEXT:
+            return createKMLWithCtx(ctx, file->fileName);
+        default:
+            return NULL;
+    }
+}
+
+// Loads the file and prints it, or returns NULL if the load failed.
+static char * loadToString(const CorpusFile * file, LoadKind kind, KMLParserCtx * ctx) {
+    KML * doc = load(file, kind, ctx);
+    if (doc == NULL) {
+        return NULL;
+    }
+
+    char * str = KMLToString(doc);
+    if (kind == LOAD_CONTEXT) {
+        recycleKML(ctx, doc);
+    } else {
+        deleteKML(doc);
+    }
+
+    return str;
+}
+
+static void * runWorker(void * data) {
+    Worker * worker = (Worker *) data;
+    Corpus * corpus = worker->corpus;
+
+    // Every thread starts at a different file and kind, so that different loads overlap.
+    int failures = 0;
+    for (int round = 0; round < corpus->rounds; round++) {
+        for (int i = 0; i < corpus->numFiles; i++) {
+            CorpusFile * file = &corpus->files[(i + worker->id) % corpus->numFiles];
+            for (int k = 0; k < NUM_LOADS; k++) {
+                LoadKind kind = (LoadKind) ((k + worker->id + round) % NUM_LOADS);
+                if (kind == LOAD_VALID && !corpus->validating) {
+                    continue;
+                }
+                char * str = loadToString(file, kind, worker->ctx);
+
+                bool same = (str == NULL) == (file->expected[kind] == NULL)
+                    && (str == NULL || strcmp(str, file->expected[kind]) == 0);
+                if (!same) {
+                    fprintf(stderr, "thread %d: %s of %s differs from the single-threaded load\n", worker->id, loadNames[kind], file->fileName);
+                    failures++;
+                }
+                free(str);
+            }
+        }
+    }
+
+    __atomic_add_fetch(&corpus->failures, failures, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static int readCorpus(const char * dirName, CorpusFile * files) {
+    DIR * dir = opendir(dirName);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    int numFiles = 0;
+    struct dirent * entry;
+    while ((entry = readdir(dir)) != NULL && numFiles < MAX_FILES) {
+        size_t nameLength = strlen(entry->d_name);
+        if (nameLength < 4 || strcmp(entry->d_name + nameLength - 4, ".kml") != 0) {
+            continue;
+        }
+
+        CorpusFile * file = &files[numFiles];
+        file->fileName = malloc(strlen(dirName) + nameLength + 2);
+        sprintf(file->fileName, "%s/%s", dirName, entry->d_name);
+        file->contents = readFile(file->fileName, &file->length);
+        if (file->contents == NULL) {
+            free(file->fileName);
+            continue;
+        }
+        numFiles++;
+    }
+    closedir(dir);
+
+    return numFiles;
+}
+
+int main(int argc, char ** argv) {
+    const char * dirName = argc > 1 ? argv[1] : "test-files";
+    int numThreads = argc > 2 ? atoi(argv[2]) : 8;
+    int rounds = argc > 3 ? atoi(argv[3]) : 10;
+    if (numThreads < 1 || rounds < 1) {
+        fprintf(stderr, "usage: %s [corpusDir] [numThreads] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    static CorpusFile files[MAX_FILES];
+    Corpus corpus;
+    corpus.files = files;
+    corpus.numFiles = readCorpus(dirName, files);
+    corpus.rounds = rounds;
+    corpus.failures = 0;
+    if (corpus.numFiles <= 0) {
+        fprintf(stderr, "%s: no .kml files in %s\n", argv[0], dirName);
+        return 1;
+    }
+
+    // The expected output of every load, made on this thread alone.
+    kmlInit();
+    KMLParserCtx * ctx = createKMLParserCtx(NULL, KML_PARSE_DEFAULT);
+    int loaded = 0;
+    for (int i = 0; i < corpus.numFiles; i++) {
+        for (int kind = 0; kind < NUM_LOADS; kind++) {
+            files[i].expected[kind] = loadToString(&files[i], (LoadKind) kind, ctx);
+            if (files[i].expected[kind] != NULL) {
+                loaded++;
+            }
+        }
+    }
+    deleteKMLParserCtx(ctx);
+    kmlCleanup();
+
+    // The corpus is expected to load, other than through a schema that cannot be compiled here.
+    if (loaded == 0) {
+        fprintf(stderr, "%s: no file in %s could be loaded\n", argv[0], dirName);
+        return 1;
+    }
+    corpus.validating = files[0].expected[LOAD_VALID] != NULL;
+    if (!corpus.validating) {
+        printf("note: %s could not be compiled (it imports a schema over HTTP), so createValidKML is not tested\n", SCHEMA_FILE);
+    }
+
+    pthread_t * threads = malloc(numThreads * sizeof(pthread_t));
+    Worker * workers = malloc(numThreads * sizeof(Worker));
+    for (int cycle = 0; cycle < NUM_CYCLES; cycle++) {
+        kmlInit();
+
+        for (int t = 0; t < numThreads; t++) {
+            workers[t].corpus = &corpus;
+            workers[t].id = t;
+            workers[t].ctx = createKMLParserCtx(NULL, KML_PARSE_DEFAULT);
+            if (pthread_create(&threads[t], NULL, &runWorker, &workers[t]) != 0) {
+                fprintf(stderr, "%s: could not start thread %d\n", argv[0], t);
+                return 1;
+            }
+        }
+        for (int t = 0; t < numThreads; t++) {
+            pthread_join(threads[t], NULL);
+            deleteKMLParserCtx(workers[t].ctx);
+        }
+
+        kmlCleanup();
+    }
+    free(threads);
+    free(workers);
+
+    int numLoads = NUM_CYCLES * numThreads * rounds * corpus.numFiles * (corpus.validating ? NUM_LOADS : NUM_LOADS - 1);
+    printf("%d files, %d threads, %d loads, %d failures\n", corpus.numFiles, numThreads, numLoads, corpus.failures);
+
+    for (int i = 0; i < corpus.numFiles; i++) {
+        for (int kind = 0; kind < NUM_LOADS; kind++) {
+            free(files[i].expected[kind]);
+        }
+        free(files[i].fileName);
+        free(files[i].contents);
+    }
+
+    return corpus.failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,102 @@
+/*
+ * Pins what isLoopPath returns. A path is a loop when its first and last coordinates are within delta
+ * meters of each other and it has at least 4 coordinates. isLoopPath used to measure from the last
+ * coordinate to 0,0 instead, so that paths away from 0,0 were never loops and any path ending near 0,0
+ * was one. The cases below fail if that comes back.
+ *
+ * Usage: testLoopPath     (any arguments are ignored, so that make test-tsan can run it like the others)
+ * Exits with 1 if any case gives the wrong answer.
+*/
+
+#include "KMLParser.h"
+
+typedef struct {
+    const char * name;
+    const char * coordinates;
+    double delta;
+    bool loop;
+} LoopCase;
+
+static const LoopCase cases[] = {
+    // A block around the University of Guelph, ending where it starts.
+    {"closed", "-80.2274,43.5320 -80.2200,43.5320 -80.2200,43.5280 -80.2274,43.5280 -80.2274,43.5320", 10, true},
+    // The same block ending about 4.5 m north of where it starts.
+    {"nearly closed", "-80.2274,43.5320 -80.2200,43.5320 -80.2200,43.5280 -80.2274,43.5280 -80.2274,43.53204", 10, true},
+    {"nearly closed, small delta", "-80.2274,43.5320 -80.2200,43.5320 -80.2200,43.5280 -80.2274,43.5280 -80.2274,43.53204", 1, false},
+    {"open", "-80.2274,43.5320 -80.2200,43.5320 -80.2200,43.5280 -80.2150,43.5280", 10, false},
+    // Open paths ending at or starting from 0,0 were loops when the distance was measured to 0,0.
+    {"open, ending at 0,0", "-80.2274,43.5320 -40.0,20.0 -1.0,1.0 0.0,0.0", 10, false},
+    {"open, starting at 0,0", "0.0,0.0 1.0,1.0 1.0,0.0 0.5,0.5", 10, false},
+    {"closed through 0,0", "0.0,0.0 0.001,0.0 0.001,0.001 0.0,0.001 0.0,0.0", 10, true},
+    // Fewer than 4 coordinates are never a loop, even when they end where they start.
+    {"closed, 3 points", "-80.2274,43.5320 -80.2200,43.5320 -80.2274,43.5320", 10, false},
+};
+
+static KML * loadPath(const char * coordinates) {
+    char buffer[1024];
+    int length = snprintf(buffer, sizeof(buffer), "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<kml xmlns=\"http://www.opengis.net/kml/2.2\"><Placemark><LineString><coordinates>%s</coordinates>"
+        "</LineString></Placemark></kml>\n", coordinates);
+
+    return createKMLFromMemory(buffer, length);
+}
+
+static int numChecks = 0;
+
+static bool check(const char * name, const PathPlacemark * path, double delta, bool expected) {
+    numChecks++;
+    bool loop = isLoopPath(path, delta);
+    if (loop != expected) {
+        fprintf(stderr, "%s: isLoopPath gave %s at delta %g, expected %s\n", name, loop ? "true" : "false", delta,
+            expected ? "true" : "false");
+    }
+
+    return loop == expected;
+}
+
+int main(void) {
+    kmlInit();
+
+    int numCases = (int) (sizeof(cases) / sizeof(cases[0]));
+    int failures = 0;
+    for (int i = 0; i < numCases; i++) {
+        KML * doc = loadPath(cases[i].coordinates);
+        PathPlacemark * path = doc == NULL ? NULL : getFromFront(doc->pathPlacemarks);
+        if (path == NULL) {
+            fprintf(stderr, "%s: could not be loaded\n", cases[i].name);
+            failures++;
+        } else if (!check(cases[i].name, path, cases[i].delta, cases[i].loop)) {
+            failures++;
+        }
+        deleteKML(doc);
+    }
+
+    // Closing an open path has to show through the cached endpoint distance.
+    KML * doc = loadPath(cases[3].coordinates);
+    PathPlacemark * path = doc == NULL ? NULL : getFromFront(doc->pathPlacemarks);
+    if (path == NULL || !check("open, before closing", path, 10, false)) {
+        failures++;
+    } else {
+        Coordinate first = getLineCoordinate(path->pathData, 0);
+        addLineCoordinate(path->pathData, first.longitude, first.latitude, first.altitude);
+        if (!check("open, after closing", path, 10, true)) {
+            failures++;
+        }
+    }
+    deleteKML(doc);
+
+    // Invalid arguments.
+    if (!check("NULL path", NULL, 10, false)) {
+        failures++;
+    }
+    doc = loadPath(cases[0].coordinates);
+    if (doc == NULL || !check("closed, negative delta", getFromFront(doc->pathPlacemarks), -1, false)) {
+        failures++;
+    }
+    deleteKML(doc);
+
+    kmlCleanup();
+
+    printf("%d checks, %d failures\n", numChecks, failures);
+    return failures == 0 ? 0 : 1;
+}